@@ -23,42 +23,330 @@
 
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "ksim.h"
 #include "avx-builder.h"
 
-static void *shader_pool, *shader_end;
-const size_t shader_pool_size = 64 * 1024;
-static void *constant_pool;
-const size_t constant_pool_size = 8192;
-uint32_t constant_pool_index;
+/* Shaders live in chunks of memory that are mapped twice from the
+ * same memfd: once writable, for the builder and the constant data
+ * the generated code references, and once executable. Both views are
+ * carved out of one reservation so rip relative references from code
+ * to constants always reach. Code grows up from the start of a chunk
+ * and constants grow down from the end, so a shader and its constants
+ * always share a chunk. New chunks are created as needed and a chunk
+ * is released when the last shader in it is freed.
+ *
+ * Each thread builds shaders into a chunk of its own, so shaders can
+ * be compiled in parallel. Only creating, finishing and freeing
+ * shaders take the arena lock.
+ *
+ * Everything in a shader that depends on where it and ksim live in
+ * memory is recorded as a relocation, so that a shader can be copied
+ * out as an image and loaded back in elsewhere, possibly by another
+ * process. */
+
+#define CHUNK_SIZE (4 * 1024 * 1024)
+#define SHADER_HEADER_SIZE 64
+
+struct shader_chunk {
+	uint8_t *rw;
+	uint8_t *rx;
+	uint32_t code_end;
+	uint32_t const_start;
+	uint32_t live;
+
+	/* Whether the chunk is some thread's current chunk and if
+	 * that thread is building a shader in it. */
+	bool owned;
+	bool open;
+};
+
+struct shader_header {
+	struct shader_chunk *chunk;
+	uint32_t size;
+	uint32_t code_size;
+	uint32_t const_size;
+	uint32_t reloc_count;
+	uint8_t *constants;
+	struct shader_reloc *relocs;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	uint32_t chunk_count;
+	uint64_t live_bytes;
+} arena = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct {
+	struct shader_chunk *current;
+
+	/* Where the code and constants of the shader being built
+	 * start in the current chunk. */
+	uint32_t code_start;
+	uint32_t const_end;
+
+	/* Relocations for the shader being built. Code offsets are
+	 * relative to the start of the code, constant offsets are
+	 * chunk offsets until builder_finish(). */
+	struct shader_reloc *relocs;
+	uint32_t reloc_count;
+	uint32_t reloc_size;
+} local;
+
+static struct shader_chunk *
+create_chunk(void)
+{
+	struct shader_chunk *chunk;
+	void *base;
+	int fd;
+
+	chunk = malloc(sizeof(*chunk));
+	ksim_assert(chunk != NULL);
+
+	fd = memfd_create("jit", MFD_CLOEXEC);
+	ksim_assert(fd >= 0);
+	ftruncate(fd, CHUNK_SIZE);
+
+	base = mmap(NULL, 2 * CHUNK_SIZE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ksim_assert(base != MAP_FAILED);
+	chunk->rw = mmap(base, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED, fd, 0);
+	chunk->rx = mmap(base + CHUNK_SIZE, CHUNK_SIZE, PROT_READ | PROT_EXEC,
+			 MAP_SHARED | MAP_FIXED, fd, 0);
+	ksim_assert(chunk->rw != MAP_FAILED && chunk->rx != MAP_FAILED);
+	close(fd);
+
+	chunk->code_end = 0;
+	chunk->const_start = CHUNK_SIZE;
+	chunk->live = 0;
+	chunk->owned = false;
+	chunk->open = false;
+
+	arena.chunk_count++;
+	trace(TRACE_DEBUG, "jit: new code chunk, %d total\n", arena.chunk_count);
+
+	return chunk;
+}
 
-void
-reset_shader_pool(void)
-{
-	if (shader_pool == NULL) {
-		int fd = memfd_create("jit", MFD_CLOEXEC);
-		ftruncate(fd, shader_pool_size);
-		shader_pool = mmap(NULL, shader_pool_size,
-				   PROT_WRITE | PROT_READ | PROT_EXEC,
-				   MAP_SHARED, fd, 0);
-		close(fd);
+static void
+destroy_chunk(struct shader_chunk *chunk)
+{
+	munmap(chunk->rw, 2 * CHUNK_SIZE);
+	free(chunk);
+	arena.chunk_count--;
+}
+
+static void
+open_shader(void)
+{
+	struct shader_chunk *chunk = local.current;
+
+	if (chunk != NULL && chunk->open)
+		return;
+
+	pthread_mutex_lock(&arena.mutex);
+
+	/* Emitting code doesn't check for space as it goes, so only
+	 * start a shader in a chunk that can hold the largest one
+	 * we allow. */
+	if (chunk == NULL ||
+	    chunk->const_start - chunk->code_end < SHADER_MAX_SIZE) {
+		if (chunk != NULL) {
+			chunk->owned = false;
+			if (chunk->live == 0)
+				destroy_chunk(chunk);
+		}
+		chunk = create_chunk();
+		chunk->owned = true;
+		local.current = chunk;
+	}
+
+	chunk->open = true;
+	local.code_start = align_u64(chunk->code_end, 64);
+	local.const_end = chunk->const_start;
+	local.reloc_count = 0;
+
+	pthread_mutex_unlock(&arena.mutex);
+}
+
+static void
+add_reloc(enum shader_reloc_type type, uint32_t offset, uint64_t target)
+{
+	if (local.reloc_count == local.reloc_size) {
+		local.reloc_size = local.reloc_size ? local.reloc_size * 2 : 64;
+		local.relocs = realloc(local.relocs,
+				       local.reloc_size * sizeof(local.relocs[0]));
+		ksim_assert(local.relocs != NULL);
 	}
 
-	constant_pool = shader_pool;
-	constant_pool_index = 0;
-	shader_end = shader_pool + constant_pool_size;
+	local.relocs[local.reloc_count++] = (struct shader_reloc) {
+		.type = type,
+		.offset = offset,
+		.target = target
+	};
+}
+
+static uint32_t
+code_offset(struct builder *bld)
+{
+	/* All the instructions we relocate end in their rel32. */
+	return bld->p - 4 - (uint8_t *) bld->shader;
+}
+
+void
+builder_reloc_const(struct builder *bld, const void *p)
+{
+	add_reloc(RELOC_CONST, code_offset(bld),
+		  (const uint8_t *) p - local.current->rw);
+}
+
+void
+builder_reloc_call(struct builder *bld, const void *func)
+{
+	add_reloc(RELOC_CALL, code_offset(bld), (uintptr_t) func);
+}
+
+/* Record that the pointer at slot was mapped from a gtt address. Only
+ * pointers stored in the constant data of the shader being built are
+ * of interest, everything else is ignored. */
+void
+shader_reloc_pointer(void *slot, uint64_t address)
+{
+	struct shader_chunk *chunk = local.current;
+	uint8_t *p = slot;
+
+	if (chunk == NULL || !chunk->open ||
+	    p < chunk->rw + chunk->const_start ||
+	    p >= chunk->rw + local.const_end)
+		return;
+
+	add_reloc(RELOC_POINTER, p - chunk->rw, address);
 }
 
 void *
 get_const_data(size_t size, size_t align)
 {
-	int offset = align_u64(constant_pool_index, align);
+	struct shader_chunk *chunk;
+
+	open_shader();
+	chunk = local.current;
+
+	ksim_assert(size <= chunk->const_start);
+	chunk->const_start = (chunk->const_start - size) & ~(align - 1);
+	ksim_assert(local.const_end - chunk->const_start <= SHADER_MAX_SIZE);
+
+	return chunk->rw + chunk->const_start;
+}
+
+void
+free_shader(shader_t shader)
+{
+	struct shader_header *header =
+		(void *) shader - SHADER_HEADER_SIZE;
+	struct shader_chunk *chunk = header->chunk;
+
+	free(header->relocs);
+
+	pthread_mutex_lock(&arena.mutex);
+
+	ksim_assert(chunk->live > 0);
+	chunk->live--;
+	arena.live_bytes -= header->size;
+
+	if (chunk->live == 0) {
+		if (!chunk->owned) {
+			destroy_chunk(chunk);
+		} else if (!chunk->open) {
+			chunk->code_end = 0;
+			chunk->const_start = CHUNK_SIZE;
+		}
+	}
+
+	pthread_mutex_unlock(&arena.mutex);
+}
+
+uint32_t
+shader_size(shader_t shader)
+{
+	struct shader_header *header =
+		(void *) shader - SHADER_HEADER_SIZE;
 
-	constant_pool_index = offset + size;
-	ksim_assert(offset + size <= constant_pool_size);
+	return header->size;
+}
+
+uint64_t
+shader_arena_size(void)
+{
+	uint64_t size;
 
-	return constant_pool + offset;
+	pthread_mutex_lock(&arena.mutex);
+	size = arena.live_bytes;
+	pthread_mutex_unlock(&arena.mutex);
+
+	return size;
+}
+
+void
+shader_get_image(shader_t shader, struct shader_image *image)
+{
+	struct shader_header *header =
+		(void *) shader - SHADER_HEADER_SIZE;
+
+	image->code = shader;
+	image->code_size = header->code_size;
+	image->constants = header->constants;
+	image->const_size = header->const_size;
+	image->relocs = header->relocs;
+	image->reloc_count = header->reloc_count;
+}
+
+/* Copy a shader image into the arena and fix up its code for the new
+ * location. RELOC_CALL targets must be the function addresses in this
+ * process. RELOC_POINTER slots are copied as is, it's up to the caller
+ * to map the addresses and patch them. */
+shader_t
+shader_from_image(const struct shader_image *image)
+{
+	struct builder bld;
+	uint8_t *constants, *code, *pc;
+	uint32_t region;
+
+	ksim_assert(image->code_size <= SHADER_MAX_SIZE);
+
+	constants = get_const_data(image->const_size, 64);
+	memcpy(constants, image->constants, image->const_size);
+	region = constants - local.current->rw;
+
+	builder_init(&bld);
+	code = bld.p;
+	memcpy(code, image->code, image->code_size);
+	bld.p += image->code_size;
+
+	for (uint32_t i = 0; i < image->reloc_count; i++) {
+		const struct shader_reloc *r = &image->relocs[i];
+		int32_t *rel32 = (int32_t *) (code + r->offset);
+
+		pc = code + r->offset + 4 + bld.rx_offset;
+		switch (r->type) {
+		case RELOC_CONST:
+			*rel32 = constants + r->target - pc;
+			add_reloc(RELOC_CONST, r->offset, region + r->target);
+			break;
+		case RELOC_CALL:
+			*rel32 = (uint8_t *) (uintptr_t) r->target - pc;
+			add_reloc(RELOC_CALL, r->offset, r->target);
+			break;
+		case RELOC_POINTER:
+			add_reloc(RELOC_POINTER, region + r->offset, r->target);
+			break;
+		}
+	}
+
+	return builder_finish(&bld);
 }
 
 static int
@@ -80,16 +368,42 @@ builder_disasm_printf(void *_bld, const char *fmt, ...)
 void
 builder_init(struct builder *bld)
 {
-	bld->shader = align_ptr(shader_end, 64);
+	struct shader_chunk *chunk;
+
+	open_shader();
+	chunk = local.current;
+
+	/* The header sits right before the code, so we can get back
+	 * to the chunk from the shader pointer. Starting over without
+	 * finishing discards the previous attempt. */
+	chunk->code_end = local.code_start + SHADER_HEADER_SIZE;
+	bld->shader = (shader_t) (chunk->rw + chunk->code_end);
+
+	/* Drop code relocations from an earlier attempt. */
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < local.reloc_count; i++)
+		if (local.relocs[i].type == RELOC_POINTER)
+			local.relocs[count++] = local.relocs[i];
+	local.reloc_count = count;
 	bld->p = (uint8_t *) bld->shader;
+	bld->rx_offset = chunk->rx - chunk->rw;
+
+	/* The disassembler is set up on first use, most shaders are
+	 * compiled with tracing off. */
+	bld->disasm_tail = chunk->code_end;
+	bld->disasm_base = chunk->rw;
+	bld->disasm_fn = NULL;
+}
 
-	bld->disasm_tail = bld->p - (uint8_t *) shader_pool;
+static void
+init_disasm(struct builder *bld)
+{
 	init_disassemble_info(&bld->info, bld, builder_disasm_printf);
 	bld->info.arch = bfd_arch_i386;
 	bld->info.mach = bfd_mach_x86_64;
 	bld->info.buffer_vma = 0;
-	bld->info.buffer_length = shader_pool_size;
-	bld->info.buffer = shader_pool;
+	bld->info.buffer_length = CHUNK_SIZE;
+	bld->info.buffer = bld->disasm_base;
 	bld->info.section = NULL;
 	disassemble_init_for_target(&bld->info);
 
@@ -101,17 +415,59 @@ builder_init(struct builder *bld)
 shader_t
 builder_finish(struct builder *bld)
 {
-	shader_end = bld->p;
-
-	ksim_assert(shader_end - shader_pool < shader_pool_size);
+	struct shader_chunk *chunk = local.current;
+	struct shader_header *header =
+		(void *) (chunk->rw + local.code_start);
+	uint32_t size;
+
+	ksim_assert(chunk->open);
+
+	chunk->code_end = bld->p - chunk->rw;
+	ksim_assert(chunk->code_end <= chunk->const_start);
+
+	size = chunk->code_end - local.code_start +
+		local.const_end - chunk->const_start;
+	ksim_assert(size <= SHADER_MAX_SIZE);
+
+	/* The constants are copied out as one 64 byte aligned block,
+	 * so that alignment survives loading the image elsewhere. */
+	const uint32_t region = chunk->const_start & ~63;
+	for (uint32_t i = 0; i < local.reloc_count; i++) {
+		struct shader_reloc *r = &local.relocs[i];
+
+		if (r->type == RELOC_CONST)
+			r->target -= region;
+		else if (r->type == RELOC_POINTER)
+			r->offset -= region;
+	}
 
-	return bld->shader;
+	header->chunk = chunk;
+	header->size = size;
+	header->code_size = chunk->code_end - local.code_start - SHADER_HEADER_SIZE;
+	header->constants = chunk->rw + region;
+	header->const_size = local.const_end - region;
+	header->reloc_count = local.reloc_count;
+	header->relocs = malloc(local.reloc_count * sizeof(local.relocs[0]));
+	ksim_assert(local.reloc_count == 0 || header->relocs != NULL);
+	memcpy(header->relocs, local.relocs,
+	       local.reloc_count * sizeof(local.relocs[0]));
+
+	pthread_mutex_lock(&arena.mutex);
+	chunk->live++;
+	chunk->open = false;
+	arena.live_bytes += size;
+	pthread_mutex_unlock(&arena.mutex);
+
+	return (void *) bld->shader + bld->rx_offset;
 }
 
 bool
 builder_disasm(struct builder *bld)
 {
-	const int end = bld->p - (uint8_t *) shader_pool;
+	const int end = bld->p - bld->disasm_base;
+
+	if (bld->disasm_fn == NULL)
+		init_disasm(bld);
 
 	bld->disasm_length = 0;
 	if (bld->disasm_tail < end) {
@@ -188,7 +544,6 @@ check_reg_imm_emit_function(const char *fmt,
 	for (int reg = 0; reg < 16; reg++) {
 		int count, actual_reg, actual_imm;
 
-		reset_shader_pool();
 		builder_init(&bld);
 
 		func(&bld, reg, imm);
@@ -201,6 +556,55 @@ check_reg_imm_emit_function(const char *fmt,
 	}
 }
 
+static void
+check_imm_emit_function(const char *fmt,
+			void (*func)(struct builder *bld, uint32_t imm), int delta)
+{
+	static const uint32_t imms[] = { 8, 100, 0x1234, 0x12345678 };
+	struct builder bld;
+
+	for (int i = 0; i < ARRAY_LENGTH(imms); i++) {
+		uint32_t actual_imm;
+		int count;
+
+		builder_init(&bld);
+
+		func(&bld, imms[i]);
+		builder_disasm(&bld);
+
+		count = sscanf(bld.disasm_output + 10, fmt, &actual_imm);
+
+		if (count != 1 || imms[i] - delta != actual_imm)
+			test_fail(&bld, "fmt='%s' imm=%d:\n    ", fmt, imms[i]);
+	}
+}
+
+/* Branch offsets are relative to the start of the instruction and
+ * the disassembler prints the target address. */
+static void
+check_branch_emit_function(const char *fmt,
+			   void (*func)(struct builder *bld, int32_t offset))
+{
+	static const int32_t offsets[] = { -16, 0, 6, 100, 0x12345 };
+	struct builder bld;
+
+	for (int i = 0; i < ARRAY_LENGTH(offsets); i++) {
+		uint32_t pc, actual_target;
+		int count;
+
+		builder_init(&bld);
+
+		func(&bld, offsets[i]);
+		builder_disasm(&bld);
+
+		count = sscanf(bld.disasm_output, "%x", &pc) +
+			sscanf(bld.disasm_output + 10, fmt, &actual_target);
+
+		if (count != 2 || pc + offsets[i] != actual_target)
+			test_fail(&bld, "fmt='%s' offset=%d:\n    ", fmt, offsets[i]);
+	}
+}
+
 static void
 check_unop_emit_function(const char *fmt,
 			 void (*func)(struct builder *bld, int dst))
@@ -210,7 +614,6 @@ check_unop_emit_function(const char *fmt,
 	for (int dst = 0; dst < 16; dst++) {
 		int count, actual_dst;
 
-		reset_shader_pool();
 		builder_init(&bld);
 
 		func(&bld, dst);
@@ -235,7 +638,6 @@ check_binop_emit_function(const char *fmt,
 		for (int src = 0; src < 16; src++) {
 			int count, actual_dst, actual_src;
 
-			reset_shader_pool();
 			builder_init(&bld);
 
 			func(&bld, dst, src);
@@ -262,7 +664,6 @@ check_triop_emit_function(const char *fmt,
 			for (int src1 = 0; src1 < 16; src1++) {
 				int count, actual_dst, actual_src0, actual_src1;
 
-				reset_shader_pool();
 				builder_init(&bld);
 
 				func(&bld, dst, src0, src1);
@@ -291,7 +692,6 @@ check_quadop_emit_function(const char *fmt,
 					int count, actual_dst, actual_mask;
 					int actual_src0, actual_src1;
 
-					reset_shader_pool();
 					builder_init(&bld);
 
 					func(&bld, dst, mask, src0, src1);
@@ -345,6 +745,12 @@ emit_vmovdqa_from_rax(struct builder *bld, int dst)
 	builder_emit_vmovdqa_from_rax(bld, dst, 0);
 }
 
+static inline void
+emit_vmovdqu_from_rax(struct builder *bld, int dst)
+{
+	builder_emit_vmovdqu_from_rax(bld, dst, 0);
+}
+
 static inline void
 emit_vmovdqa_to_rax(struct builder *bld, int src)
 {
@@ -369,6 +775,78 @@ emit_vpmaskmovd_to_rax_500(struct builder *bld, int src, int mask)
 	builder_emit_vpmaskmovd_to_rax(bld, src, mask, 500);
 }
 
+static void
+emit_vpaddd_rdi_relative(struct builder *bld, int dst, int src)
+{
+	builder_emit_vpaddd_rdi_relative(bld, dst, src, 0x40);
+}
+
+static void
+emit_vpmulld_rdi_relative(struct builder *bld, int dst, int src)
+{
+	builder_emit_vpmulld_rdi_relative(bld, dst, src, 0x400);
+}
+
+static void
+emit_vcvtdq2ps_rdi_relative(struct builder *bld, int dst)
+{
+	builder_emit_vcvtdq2ps_rdi_relative(bld, dst, 0x40);
+}
+
+static void
+emit_vpsrlvd_rdi_relative(struct builder *bld, int dst, int src)
+{
+	builder_emit_vpsrlvd_rdi_relative(bld, dst, src, 0x40);
+}
+
+static void
+emit_vpsravd_rdi_relative(struct builder *bld, int dst, int src)
+{
+	builder_emit_vpsravd_rdi_relative(bld, dst, src, 0x40);
+}
+
+static void
+emit_vpsllvd_rdi_relative(struct builder *bld, int dst, int src)
+{
+	builder_emit_vpsllvd_rdi_relative(bld, dst, src, 0x40);
+}
+
+static void
+emit_vcmpps_lt_rdi_relative(struct builder *bld, int dst, int src)
+{
+	builder_emit_vcmpps_rdi_relative(bld, _CMP_LT_OS, dst, src, 0x40);
+}
+
+static void
+emit_vpabsd_rdi_relative(struct builder *bld, int dst)
+{
+	builder_emit_vpabsd_rdi_relative(bld, dst, 0x40);
+}
+
+static void
+emit_vsqrtps_rdi_relative(struct builder *bld, int dst)
+{
+	builder_emit_vsqrtps_rdi_relative(bld, dst, 0x40);
+}
+
+static void
+emit_vrcpps_rdi_relative(struct builder *bld, int dst)
+{
+	builder_emit_vrcpps_rdi_relative(bld, dst, 0x40);
+}
+
+static void
+emit_vrsqrtps_rdi_relative(struct builder *bld, int dst)
+{
+	builder_emit_vrsqrtps_rdi_relative(bld, dst, 0x40);
+}
+
+static void
+emit_vcvtps2dq_rdi_relative(struct builder *bld, int dst)
+{
+	builder_emit_vcvtps2dq_rdi_relative(bld, dst, 0x40);
+}
+
 int main(int argc, char *argv[])
 {
 	check_reg_imm_emit_function("vpbroadcastd 0x%2$x(%%rip),%%ymm%1$d",
@@ -416,6 +894,7 @@ int main(int argc, char *argv[])
 
 	check_triop_emit_function("vpsrld $0x%2$x,%%ymm%1$d,%%ymm%3$d", builder_emit_vpsrld);
 	check_triop_emit_function("vpslld $0x%2$x,%%ymm%1$d,%%ymm%3$d", builder_emit_vpslld);
+	check_triop_emit_function("vpsrad $0x%2$x,%%ymm%1$d,%%ymm%3$d", builder_emit_vpsrad);
 
 	check_binop_emit_function("vpabsd %%ymm%d,%%ymm%d", builder_emit_vpabsd); 
 	check_binop_emit_function("vrsqrtps %%ymm%d,%%ymm%d", builder_emit_vrsqrtps);
@@ -440,7 +919,26 @@ int main(int argc, char *argv[])
 	check_quadop_emit_function("vpblendvb %%ymm%d,%%ymm%d,%%ymm%d,%%ymm%d",
 				   builder_emit_vpblendvb);
 
+	check_branch_emit_function("je 0x%x", builder_emit_jz_relative);
+	check_branch_emit_function("jne 0x%x", builder_emit_jnz_relative);
+	check_imm_emit_function("test $0x%x,%%eax", builder_emit_test_eax, 0);
+	check_imm_emit_function("incq 0x%x(%%rip)", builder_emit_inc_rip_relative, 7);
+
 	check_unop_emit_function("vmovdqa (%%rax),%%ymm%d", emit_vmovdqa_from_rax);
+	check_unop_emit_function("vmovdqu (%%rax),%%ymm%d", emit_vmovdqu_from_rax);
+
+	check_binop_emit_function("vpaddd 0x40(%%rdi),%%ymm%d,%%ymm%d", emit_vpaddd_rdi_relative);
+	check_binop_emit_function("vpmulld 0x400(%%rdi),%%ymm%d,%%ymm%d", emit_vpmulld_rdi_relative);
+	check_unop_emit_function("vcvtdq2ps 0x40(%%rdi),%%ymm%d", emit_vcvtdq2ps_rdi_relative);
+	check_binop_emit_function("vpsrlvd 0x40(%%rdi),%%ymm%d,%%ymm%d", emit_vpsrlvd_rdi_relative);
+	check_binop_emit_function("vpsravd 0x40(%%rdi),%%ymm%d,%%ymm%d", emit_vpsravd_rdi_relative);
+	check_binop_emit_function("vpsllvd 0x40(%%rdi),%%ymm%d,%%ymm%d", emit_vpsllvd_rdi_relative);
+	check_binop_emit_function("vcmpltps 0x40(%%rdi),%%ymm%d,%%ymm%d", emit_vcmpps_lt_rdi_relative);
+	check_unop_emit_function("vpabsd 0x40(%%rdi),%%ymm%d", emit_vpabsd_rdi_relative);
+	check_unop_emit_function("vsqrtps 0x40(%%rdi),%%ymm%d", emit_vsqrtps_rdi_relative);
+	check_unop_emit_function("vrcpps 0x40(%%rdi),%%ymm%d", emit_vrcpps_rdi_relative);
+	check_unop_emit_function("vrsqrtps 0x40(%%rdi),%%ymm%d", emit_vrsqrtps_rdi_relative);
+	check_unop_emit_function("vcvtps2dq 0x40(%%rdi),%%ymm%d", emit_vcvtps2dq_rdi_relative);
 
 #if 0
 	/* xmm regs */
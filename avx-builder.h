@@ -5,8 +5,11 @@
 struct builder {
 	shader_t shader;
 	uint8_t *p;
+	/* Distance from the writable to the executable mapping. */
+	intptr_t rx_offset;
 
 	/* Disassembly fields */
+	uint8_t *disasm_base;
 	struct disassemble_info info;
 	disassembler_ftype disasm_fn;
 	int disasm_last;
@@ -15,6 +18,9 @@ struct builder {
 	int disasm_length;
 };
 
+void builder_reloc_const(struct builder *bld, const void *p);
+void builder_reloc_call(struct builder *bld, const void *func);
+
 #define emit(bld, ...)							\
 	do {								\
 		uint8_t bytes[] = { __VA_ARGS__ };			\
@@ -101,6 +107,36 @@ builder_set_branch_target(struct builder *bld, uint8_t *branch, uint8_t *target)
 	branch[1] = distance;
 }
 
+static inline void
+builder_emit_jz_relative(struct builder *bld, int32_t offset)
+{
+	emit(bld, 0x0f, 0x84, emit_uint32(offset - 6));
+}
+
+static inline void
+builder_emit_jnz_relative(struct builder *bld, int32_t offset)
+{
+	emit(bld, 0x0f, 0x85, emit_uint32(offset - 6));
+}
+
+/* Patch the rel32 of a jmp or jcc that ends at branch_end. */
+static inline void
+builder_set_branch32_target(struct builder *bld, uint8_t *branch_end, uint8_t *target)
+{
+	int32_t distance = target - branch_end;
+
+	branch_end[-4] = distance;
+	branch_end[-3] = distance >> 8;
+	branch_end[-2] = distance >> 16;
+	branch_end[-1] = distance >> 24;
+}
+
+static inline void
+builder_emit_test_eax(struct builder *bld, uint32_t imm)
+{
+	emit(bld, 0xa9, emit_uint32(imm));
+}
+
 static inline void
 builder_emit_m256i_load(struct builder *bld, int dst, int32_t offset)
 {
@@ -179,6 +215,22 @@ builder_emit_vmovdqa_from_rax(struct builder *bld, int dst, int offset)
 		     emit_uint32(offset));
 }
 
+static inline void
+builder_emit_vmovdqu_from_rax(struct builder *bld, int dst, int offset)
+{
+	/* vmovdqu offset(%rax),%ymm0 */
+	if (offset == 0)
+		emit(bld, 0xc5, 0xfe - (dst & 8) * 16, 0x6f,
+		     (dst & 7) * 8 | RAX);
+	else if (is_byte_range(offset))
+		emit(bld, 0xc5, 0xfe - (dst & 8) * 16, 0x6f,
+		     (dst & 7) * 8 | RAX | IMM_BYTE_OFFSET, offset);
+	else
+		emit(bld, 0xc5, 0xfe - (dst & 8) * 16, 0x6f,
+		     (dst & 7) * 8 | RAX | IMM_DWORD_OFFSET,
+		     emit_uint32(offset));
+}
+
 static inline void
 builder_emit_vpmaskmovd_to_rax(struct builder *bld, int src, int mask, int offset)
 {
@@ -306,7 +358,7 @@ builder_emit_vmovmskps(struct builder *bld, uint32_t src)
 	if (src < 8)
 		emit(bld, 0xc5, 0xfc, 0x50, 0xc0 + src);
 	else
-		emit(bld, 0xc4, 0xc1, 0x7c, 0x50, 0xc0 + src);
+		emit(bld, 0xc4, 0xc1, 0x7c, 0x50, 0xc0 + (src & 7));
 }
 
 static inline void
@@ -329,6 +381,39 @@ builder_emit_short_alu(struct builder *bld, int opcode, int dst, int src0, int s
 	     opcode, 0xc0 + (src0 & 7) + (dst & 7) * 8);
 }
 
+/* ModRM and displacement for an offset(%rdi) memory operand. */
+static inline void
+builder_emit_rdi_relative(struct builder *bld, int reg, int32_t offset)
+{
+	if (is_byte_range(offset))
+		emit(bld, (reg & 7) * 8 | RDI | IMM_BYTE_OFFSET, offset);
+	else
+		emit(bld, (reg & 7) * 8 | RDI | IMM_DWORD_OFFSET,
+		     emit_uint32(offset));
+}
+
+/* The memory operand versions of long and short alu. The memory
+ * operand takes the place of src0, the ModRM r/m operand. */
+static inline void
+builder_emit_long_alu_rdi_relative(struct builder *bld, int opcode0, int opcode1,
+				   int dst, int src1, int32_t offset)
+{
+	ksim_assert(dst < 16 && src1 < 16);
+
+	emit(bld, 0xc5, (0xf0 | opcode0) - src1 * 8 - (dst & 8) * 16, opcode1);
+	builder_emit_rdi_relative(bld, dst, offset);
+}
+
+static inline void
+builder_emit_short_alu_rdi_relative(struct builder *bld, int opcode,
+				    int dst, int src1, int32_t offset)
+{
+	ksim_assert(dst < 16 && src1 < 16);
+
+	emit(bld, 0xc4, 0xe2 - (dst & 8) * 16, 0x7d - src1 * 8, opcode);
+	builder_emit_rdi_relative(bld, dst, offset);
+}
+
 static inline void
 builder_emit_vpgatherdd(struct builder *bld, int dst, int index, int mask, int scale, int offset)
 {
@@ -516,6 +601,16 @@ builder_emit_vpslld(struct builder *bld, int dst, int src0, int shift)
 		     0x72, 0xf0 + (src0 & 7), shift);
 }
 
+static inline void
+builder_emit_vpsrad(struct builder *bld, int dst, int src0, int shift)
+{
+	if (src0 < 8)
+		emit(bld, 0xc5, 0xfd - dst * 8, 0x72, 0xe0 + src0, shift);
+	else
+		emit(bld, 0xc4, 0xc1, 0x7d - dst * 8,
+		     0x72, 0xe0 + (src0 & 7), shift);
+}
+
 /* For the vfmaddXYZps instructions, X and Y are multiplied, Z is
  * added. 1, 2, 3 and refer to the three ymmX register sources, here
  * dst, src0 and src1 (dst is a src too).
@@ -618,9 +713,9 @@ builder_emit_vpermilps(struct builder *bld, int dst, int imm, int src0)
 
 
 static inline void
-builder_emit_vroundps(struct builder *bld, int dst, int op, int src1)
+builder_emit_vroundps(struct builder *bld, int dst, int op, int src0)
 {
-	int src0 = 0;
+	int src1 = 0;
 
 	builder_emit_short_alu_e3(bld, 0x08, dst, src0, src1);
 	emit(bld, op);
@@ -691,6 +786,12 @@ builder_emit_add_rax_rip_relative(struct builder *bld, uint32_t offset)
 	emit(bld, 0x48, 0x03, 0x05, emit_uint32(offset - 7));
 }
 
+static inline void
+builder_emit_inc_rip_relative(struct builder *bld, uint32_t offset)
+{
+	emit(bld, 0x48, 0xff, 0x05, emit_uint32(offset - 7));
+}
+
 static inline void
 builder_emit_vcvtps2dq(struct builder *bld, int dst, int src)
 {
@@ -703,17 +804,184 @@ builder_emit_vcvtdq2ps(struct builder *bld, int dst, int src)
 	builder_emit_long_alu(bld, 0x0c, 0x5b, dst, src, 0);
 }
 
+/* ALU ops with src0 loaded from offset(%rdi). */
+
+static inline void
+builder_emit_vpaddd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xfe, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpaddw_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xfd, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpsubd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xfa, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpmullw_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xd5, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vaddps_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x58, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vmulps_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x59, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vsubps_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x5c, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpand_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xdb, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpandn_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xdf, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpxor_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xef, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpor_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0xeb, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vmaxps_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x5f, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vminps_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x5d, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpcmpeqd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0x76, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpcmpgtd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0x66, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vcmpps_rdi_relative(struct builder *bld, int op, int dst, int src1, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0xc2, dst, src1, offset);
+	emit(bld, op);
+}
+
+static inline void
+builder_emit_vpmulld_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_short_alu_rdi_relative(bld, 0x40, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpsrlvd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_short_alu_rdi_relative(bld, 0x45, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpsravd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_short_alu_rdi_relative(bld, 0x46, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpsllvd_rdi_relative(struct builder *bld, int dst, int src1, int32_t offset)
+{
+	builder_emit_short_alu_rdi_relative(bld, 0x47, dst, src1, offset);
+}
+
+static inline void
+builder_emit_vpabsd_rdi_relative(struct builder *bld, int dst, int32_t offset)
+{
+	builder_emit_short_alu_rdi_relative(bld, 0x1e, dst, 0, offset);
+}
+
+static inline void
+builder_emit_vrsqrtps_rdi_relative(struct builder *bld, int dst, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x52, dst, 0, offset);
+}
+
+static inline void
+builder_emit_vsqrtps_rdi_relative(struct builder *bld, int dst, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x51, dst, 0, offset);
+}
+
+static inline void
+builder_emit_vrcpps_rdi_relative(struct builder *bld, int dst, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x53, dst, 0, offset);
+}
+
+static inline void
+builder_emit_vcvtps2dq_rdi_relative(struct builder *bld, int dst, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0d, 0x5b, dst, 0, offset);
+}
+
+static inline void
+builder_emit_vcvtdq2ps_rdi_relative(struct builder *bld, int dst, int32_t offset)
+{
+	builder_emit_long_alu_rdi_relative(bld, 0x0c, 0x5b, dst, 0, offset);
+}
+
+/* The address the instruction being emitted will execute at. */
+static inline uint8_t *
+builder_pc(struct builder *bld)
+{
+	return bld->p + bld->rx_offset;
+}
+
 static inline uint32_t
 builder_offset(struct builder *bld, void *p)
 {
-	return p - (void *) bld->p;
+	return p - (void *) builder_pc(bld);
 }
 
 static inline int
 builder_emit_call(struct builder *bld, void *func)
 {
 	builder_emit_push_rdi(bld);
-	builder_emit_call_relative(bld, (uint8_t *) func - bld->p);
+	builder_emit_call_relative(bld, (uint8_t *) func - builder_pc(bld));
+	builder_reloc_call(bld, func);
 	builder_emit_pop_rdi(bld);
 
 	return 0;
@@ -725,9 +993,10 @@ builder_emit_trap(struct builder *bld)
 	builder_emit_push_rdi(bld);
 	builder_emit_load_edi(bld, SIGTRAP);
 
-	const uint64_t offset = (uint8_t *) raise - bld->p;
+	const uint64_t offset = (uint8_t *) raise - builder_pc(bld);
 	ksim_assert(offset < INT_MAX);
 	builder_emit_call_relative(bld, offset);
+	builder_reloc_call(bld, raise);
 
 	builder_emit_pop_rdi(bld);
 }
@@ -393,6 +393,8 @@ handle_state_base_address(uint32_t *p)
 		gt.indirect_object_buffer_size = p[14] & mask;
 	if (field(p[15], 0, 0))
 		gt.general_instruction_size = p[15] & mask;
+
+	gt.dirty |= DIRTY_ALL;
 }
 
 static void
@@ -519,6 +521,8 @@ handle_media_interface_descriptor_load(uint32_t *p)
 	gt.compute.sampler_state_address = d.SamplerStatePointer;
 	gt.compute.curbe_read_length = d.ConstantURBEntryReadLength;
 	gt.compute.curbe_read_offset = d.ConstantURBEntryReadOffset;
+
+	gt.dirty |= DIRTY_CS;
 }
 
 static void
@@ -628,6 +632,8 @@ handle_3dstate_depth_buffer(uint32_t *p)
 	gt.depth.format = v.SurfaceFormat;
 	gt.depth.write_enable0 = v.DepthWriteEnable;
 	gt.depth.hiz_enable = v.HierarchicalDepthBufferEnable;
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -669,6 +675,8 @@ handle_3dstate_vertex_buffers(uint32_t *p)
 		gt.vf.vb[vb].size = p[i + 3];
 		gt.vf.vb_valid |= 1 << vb;
 	}
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -693,6 +701,8 @@ handle_3dstate_vertex_elements(uint32_t *p)
 	}
 
 	gt.vf.ve_count = (length - 1) / 2;
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -706,6 +716,8 @@ handle_3dstate_index_buffer(uint32_t *p)
 	gt.vf.ib.format = v.IndexFormat;
 	gt.vf.ib.address = get_u64(&p[2]);
 	gt.vf.ib.size = v.BufferSize;
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -785,6 +797,8 @@ handle_3dstate_vs(uint32_t *p)
 	gt.vs.statistics = v.StatisticsEnable;
 	gt.vs.simd8 = v.SIMD8DispatchEnable;
 	gt.vs.enable = v.Enable;
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -816,6 +830,8 @@ handle_3dstate_gs(uint32_t *p)
 
 	gt.gs.output_vertex_size = v.OutputVertexSize + 1;
 	gt.gs.output_topology = v.OutputTopology;
+
+	gt.dirty |= DIRTY_VS | DIRTY_DS | DIRTY_GS;
 }
 
 static void
@@ -829,6 +845,8 @@ handle_3dstate_clip(uint32_t *p)
 	gt.clip.perspective_divide_disable = v.PerspectiveDivideDisable;
 	gt.clip.guardband_clip_test_enable = v.GuardbandClipTestEnable;
 	gt.clip.viewport_clip_test_enable = v.ViewportXYClipTestEnable;
+
+	gt.dirty |= DIRTY_VS | DIRTY_DS | DIRTY_VIEWPORT;
 }
 
 static void
@@ -844,6 +862,8 @@ handle_3dstate_sf(uint32_t *p)
 	gt.sf.tri_strip_provoking = v.TriangleStripListProvokingVertexSelect;
 	gt.sf.line_strip_provoking = v.LineStripListProvokingVertexSelect;
 	gt.sf.tri_fan_provoking = v.TriangleFanProvokingVertexSelect;
+
+	gt.dirty |= DIRTY_VS | DIRTY_DS | DIRTY_VIEWPORT;
 }
 
 static void
@@ -855,15 +875,21 @@ handle_3dstate_wm(uint32_t *p)
 	GEN9_3DSTATE_WM_unpack(p, &v);
 
 	gt.wm.barycentric_mode = v.BarycentricInterpolationMode;
+
+	gt.dirty |= DIRTY_PS;
 }
 
+/* Shaders only depend on the constant buffer lengths, so a new set of
+ * push constants of the same size doesn't dirty the stage. */
 static void
-fill_curbe(struct curbe *c, uint32_t *p)
+fill_curbe(struct curbe *c, uint32_t *p, uint32_t dirty)
 {
 	struct GEN9_3DSTATE_CONSTANT_BODY v;
 	GEN9_3DSTATE_CONSTANT_BODY_unpack(&p[1], &v);
 
 	for (uint32_t i = 0; i < 4; i++) {
+		if (c->buffer[i].length != v.ReadLength[i])
+			gt.dirty |= dirty;
 		c->buffer[i].length = v.ReadLength[i];
 		c->buffer[i].address = v.Buffer[i];
 	}
@@ -874,7 +900,8 @@ handle_3dstate_constant_vs(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_CONSTANT_VS\n");
 
-	fill_curbe(&gt.vs.curbe, p);
+	fill_curbe(&gt.vs.curbe, p, DIRTY_VS);
+	gt.dirty |= DIRTY_VS_CONSTANTS;
 }
 
 static void
@@ -882,7 +909,7 @@ handle_3dstate_constant_gs(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_CONSTANT_GS\n");
 
-	fill_curbe(&gt.gs.curbe, p);
+	fill_curbe(&gt.gs.curbe, p, DIRTY_GS);
 }
 
 static void
@@ -890,7 +917,7 @@ handle_3dstate_constant_ps(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_CONSTANT_PS\n");
 
-	fill_curbe(&gt.ps.curbe, p);
+	fill_curbe(&gt.ps.curbe, p, DIRTY_PS);
 }
 
 static void
@@ -904,7 +931,7 @@ handle_3dstate_constant_hs(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_CONSTANT_HS\n");
 
-	fill_curbe(&gt.hs.curbe, p);
+	fill_curbe(&gt.hs.curbe, p, DIRTY_HS);
 }
 
 static void
@@ -912,7 +939,7 @@ handle_3dstate_constant_ds(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_CONSTANT_DS\n");
 
-	fill_curbe(&gt.ds.curbe, p);
+	fill_curbe(&gt.ds.curbe, p, DIRTY_DS);
 }
 
 static void
@@ -932,6 +959,8 @@ handle_3dstate_hs(uint32_t *p)
 	gt.hs.dispatch_mode = v.DispatchMode;
 	gt.hs.vue_read_length = v.VertexURBEntryReadLength;
 	gt.hs.vue_read_offset = v.VertexURBEntryReadOffset;
+
+	gt.dirty |= DIRTY_VS | DIRTY_HS;
 }
 
 static void
@@ -946,6 +975,8 @@ handle_3dstate_te(uint32_t *p)
 	gt.te.topology = v.OutputTopology;
 	gt.te.domain = v.TEDomain;
 	gt.te.enable = v.TEEnable;
+
+	gt.dirty |= DIRTY_HS | DIRTY_DS;
 }
 
 static void
@@ -964,6 +995,8 @@ handle_3dstate_ds(uint32_t *p)
 	gt.ds.pue_read_offset = v.PatchURBEntryReadOffset;
 	gt.ds.compute_w = v.ComputeWCoordinateEnable;
 	gt.ds.dispatch_mode = v.DispatchMode;
+
+	gt.dirty |= DIRTY_DS;
 }
 
 static void
@@ -983,6 +1016,8 @@ handle_3dstate_sbe(uint32_t *p)
 	gt.sbe.read_offset = v.VertexURBEntryReadOffset;
 	gt.sbe.num_attributes = v.NumberofSFOutputAttributes;
 	gt.sbe.swiz_enable = v.AttributeSwizzleEnable;
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1006,6 +1041,8 @@ handle_3dstate_ps(uint32_t *p)
 	gt.ps.grf_start0 = v.DispatchGRFStartRegisterForConstantSetupData0;
 	gt.ps.fast_clear = v.RenderTargetFastClearEnable;
 	gt.ps.resolve_type = v.RenderTargetResolveType;
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1032,6 +1069,8 @@ handle_3dstate_viewport_state_pointer_sf_clip(uint32_t *p)
 	gt.sf.guardband.x1 = gt.sf.viewport[9];
 	gt.sf.guardband.y0 = gt.sf.viewport[10];
 	gt.sf.guardband.y1 = gt.sf.viewport[11];
+
+	gt.dirty |= DIRTY_VIEWPORT;
 }
 
 static void
@@ -1081,6 +1120,8 @@ handle_3dstate_binding_table_pointers_vs(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_POINTERS_VS\n");
 
 	gt.vs.binding_table_address = p[1];
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -1089,6 +1130,8 @@ handle_3dstate_binding_table_pointers_hs(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_POINTERS_HS\n");
 
 	gt.hs.binding_table_address = p[1];
+
+	gt.dirty |= DIRTY_HS;
 }
 
 static void
@@ -1097,6 +1140,8 @@ handle_3dstate_binding_table_pointers_ds(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_POINTERS_DS\n");
 
 	gt.ds.binding_table_address = p[1];
+
+	gt.dirty |= DIRTY_DS;
 }
 
 static void
@@ -1105,6 +1150,8 @@ handle_3dstate_binding_table_pointers_gs(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_POINTERS_GS\n");
 
 	gt.gs.binding_table_address = p[1];
+
+	gt.dirty |= DIRTY_GS;
 }
 
 static void
@@ -1113,6 +1160,8 @@ handle_3dstate_binding_table_pointers_ps(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_POINTERS_PS\n");
 
 	gt.ps.binding_table_address = p[1];
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1121,6 +1170,8 @@ handle_3dstate_sampler_state_pointers_vs(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_SAMPLER_STATE_POINTERS_VS\n");
 
 	gt.vs.sampler_state_address = p[1];
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -1129,6 +1180,8 @@ handle_3dstate_sampler_state_pointers_hs(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_SAMPLER_STATE_POINTERS_HS\n");
 
 	gt.hs.sampler_state_address = p[1];
+
+	gt.dirty |= DIRTY_HS;
 }
 
 static void
@@ -1137,6 +1190,8 @@ handle_3dstate_sampler_state_pointers_ds(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_SAMPLER_STATE_POINTERS_DS\n");
 
 	gt.ds.sampler_state_address = p[1];
+
+	gt.dirty |= DIRTY_DS;
 }
 
 static void
@@ -1145,6 +1200,8 @@ handle_3dstate_sampler_state_pointers_gs(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_SAMPLER_STATE_POINTERS_GS\n");
 
 	gt.gs.sampler_state_address = p[1];
+
+	gt.dirty |= DIRTY_GS;
 }
 
 static void
@@ -1153,6 +1210,8 @@ handle_3dstate_sampler_state_pointers_ps(uint32_t *p)
 	ksim_trace(TRACE_CS, "3DSTATE_SAMPLER_STATE_POINTERS_PS\n");
 
 	gt.ps.sampler_state_address = p[1];
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1245,30 +1304,40 @@ static void
 handle_3dstate_binding_table_edit_vs(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_EDIT_VS\n");
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
 handle_3dstate_binding_table_edit_gs(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_EDIT_GS\n");
+
+	gt.dirty |= DIRTY_GS;
 }
 
 static void
 handle_3dstate_binding_table_edit_hs(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_EDIT_HS\n");
+
+	gt.dirty |= DIRTY_HS;
 }
 
 static void
 handle_3dstate_binding_table_edit_ds(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_EDIT_DS\n");
+
+	gt.dirty |= DIRTY_DS;
 }
 
 static void
 handle_3dstate_binding_table_edit_ps(uint32_t *p)
 {
 	ksim_trace(TRACE_CS, "3DSTATE_BINDING_TABLE_EDIT_PS\n");
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1281,6 +1350,8 @@ handle_3dstate_vf_instancing(uint32_t *p)
 
 	gt.vf.ve[v.VertexElementIndex].instancing = v.InstancingEnable;
 	gt.vf.ve[v.VertexElementIndex].step_rate = v.InstanceDataStepRate;
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -1298,6 +1369,8 @@ handle_3dstate_vf_sgvs(uint32_t *p)
 	gt.vf.vid_enable = v.VertexIDEnable;
 	gt.vf.vid_component = v.VertexIDComponentNumber;
 	gt.vf.vid_element = v.VertexIDElementOffset;
+
+	gt.dirty |= DIRTY_VS;
 }
 
 static void
@@ -1309,6 +1382,8 @@ handle_3dstate_vf_topology(uint32_t *p)
 	GEN9_3DSTATE_VF_TOPOLOGY_unpack(p, &v);
 
 	gt.ia.topology = v.PrimitiveTopologyType;
+
+	gt.dirty |= DIRTY_HS;
 }
 
 static void
@@ -1334,6 +1409,8 @@ handle_3dstate_wm_depth_stencil(uint32_t *p)
 	gt.depth.test_enable = v.DepthTestEnable;
 	gt.depth.write_enable1 = v.DepthBufferWriteEnable;
 	gt.depth.test_function = v.DepthTestFunction;
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1349,6 +1426,8 @@ handle_3dstate_ps_extra(uint32_t *p)
 	gt.ps.attribute_enable = v.AttributeEnable;
 	gt.ps.uses_source_w = v.PixelShaderUsesSourceW;
 	gt.ps.uses_source_depth = v.PixelShaderUsesSourceDepth;
+
+	gt.dirty |= DIRTY_PS;
 }
 
 static void
@@ -1647,6 +1726,16 @@ handle_pipe_control(uint32_t *p)
 	ksim_trace(TRACE_CS, "PIPE_CONTROL\n");
 }
 
+/* The parts of 3DPRIMITIVE that vertex fetch bakes into the vs. */
+static uint32_t
+prim_vs_state(void)
+{
+	return gt.prim.access_type |
+		(gt.prim.start_vertex > 0) << 8 |
+		(gt.prim.start_instance > 0) << 9 |
+		(gt.prim.base_vertex > 0) << 10;
+}
+
 static void
 handle_3dprimitive(uint32_t *p)
 {
@@ -1654,6 +1743,7 @@ handle_3dprimitive(uint32_t *p)
 
 	struct GEN9_3DPRIMITIVE v;
 	GEN9_3DPRIMITIVE_unpack(p, &v);
+	const uint32_t vs_state = prim_vs_state();
 
 	gt.prim.predicate = v.PredicateEnable;
 	gt.prim.end_offset = v.EndOffsetEnable;
@@ -1669,6 +1759,9 @@ handle_3dprimitive(uint32_t *p)
 		gt.prim.base_vertex = v.BaseVertexLocation;
 	}
 
+	if (prim_vs_state() != vs_state)
+		gt.dirty |= DIRTY_VS;
+
 	dispatch_primitive();
 }
 
@@ -1708,6 +1801,11 @@ start_batch_buffer(uint64_t address, uint32_t ring)
 	command_handler_t handler;
 
 	gt.curbe_dynamic_state_base = true;
+
+	/* Memory may have changed since the last batch, so don't trust
+	 * any shaders or thread setup from before. */
+	gt.dirty = DIRTY_ALL;
+
 	gt.cs.next = map_gtt_offset(address, &range);
 	gt.cs.end = gt.cs.next + range;
 
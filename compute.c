@@ -21,18 +21,20 @@
  * IN THE SOFTWARE.
  */
 
+#include <stdlib.h>
+#include <pthread.h>
+
 #include "ksim.h"
 #include "kir.h"
 
 static void
-dispatch_group(uint32_t x, uint32_t y, uint32_t z)
+dispatch_group(struct thread *t, uint32_t x, uint32_t y, uint32_t z)
 {
 	/* Not sure what we should make this. */
 	const uint32_t fftid = 0 & 0x1ff;
 	const uint32_t gpgpu_dispatch = 1 << 9;
 	const uint32_t urb_handle = 0;
 	const uint32_t stack_size = 0;
-	struct thread t;
 
 	struct reg grf0 = {
 		.ud = {
@@ -70,20 +72,20 @@ dispatch_group(uint32_t x, uint32_t y, uint32_t z)
 		gt.compute.curbe_read_offset;
 	uint32_t length = gt.compute.curbe_read_length;
 	for (uint32_t i = 0; i < gt.compute.width; i++) {
-		struct reg *dst = &t.grf[1];
-		t.grf[0] = grf0;
+		struct reg *dst = &t->grf[1];
+		t->grf[0] = grf0;
 		for (uint32_t j = 0; j < length; j++)
 			dst[j].ireg = src[j].ireg;
 
 		if (i < gt.compute.width - 1) {
-			t.mask[0].q[0] = _mm256_set1_epi32(-1);
-			t.mask[0].q[1] = _mm256_set1_epi32(-1);
+			t->mask[0].q[0] = _mm256_set1_epi32(-1);
+			t->mask[0].q[1] = _mm256_set1_epi32(-1);
 		} else {
-			t.mask[0].q[0] = right_mask_q0;
-			t.mask[0].q[1] = right_mask_q1;
+			t->mask[0].q[0] = right_mask_q0;
+			t->mask[0].q[1] = right_mask_q1;
 		}
 
-		gt.compute.avx_shader(&t);
+		gt.compute.avx_shader(t);
 
 		src += length;
 	}
@@ -93,6 +95,15 @@ static void
 compile_cs(void)
 {
 	struct kir_program prog;
+	struct shader_key key;
+
+	shader_key_init(&key, SHADER_CS);
+	shader_key_add_value(&key, gt.compute.binding_table_address);
+	shader_key_add_value(&key, gt.compute.sampler_state_address);
+	shader_key_add_kernel(&key, gt.compute.ksp);
+	gt.compute.avx_shader = shader_cache_lookup(&key);
+	if (gt.compute.avx_shader)
+		return;
 
 	kir_program_init(&prog, gt.compute.binding_table_address,
 			 gt.compute.sampler_state_address);
@@ -101,32 +112,137 @@ compile_cs(void)
 
 	kir_program_add_insn(&prog, kir_eot);
 
-	gt.compute.avx_shader = kir_program_finish(&prog);
+	gt.compute.avx_shader = shader_cache_add(kir_program_finish(&prog));
+}
+
+/* Thread groups are numbered linearly in x, y, z order and each worker
+ * starts out with a contiguous range of groups. A worker that runs out
+ * of groups steals the upper half of the remaining range of another
+ * worker. The threads of a group always run in order on one worker.
+ * With a single worker, groups run in the same order as the walker
+ * generates them, so atomics stay deterministic. With more workers,
+ * atomics from different groups are unordered, which is all the
+ * hardware guarantees as well. */
+
+struct group_queue {
+	pthread_mutex_t lock;
+	uint32_t next, end;
+};
+
+struct compute_walk {
+	struct group_queue *queues;
+	struct thread *threads;
+	uint32_t count;
+};
+
+static bool
+steal_groups(struct compute_walk *walk, uint32_t worker)
+{
+	struct group_queue *q = &walk->queues[worker];
+
+	for (uint32_t i = 1; i < walk->count; i++) {
+		struct group_queue *victim =
+			&walk->queues[(worker + i) % walk->count];
+		uint32_t begin, end;
+
+		pthread_mutex_lock(&victim->lock);
+		end = victim->end;
+		begin = end - (end - victim->next) / 2;
+		if (begin == end && victim->next < end)
+			begin = victim->next;
+		victim->end = begin;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (begin < end) {
+			pthread_mutex_lock(&q->lock);
+			q->next = begin;
+			q->end = end;
+			pthread_mutex_unlock(&q->lock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+dispatch_groups(void *data, uint32_t worker)
+{
+	struct compute_walk *walk = data;
+	struct group_queue *q;
+	const uint32_t end_x = gt.compute.end_x;
+	const uint32_t end_y = gt.compute.end_y;
+	uint32_t index;
+
+	/* Small walks may not need all workers. */
+	if (worker >= walk->count)
+		return;
+
+	q = &walk->queues[worker];
+
+	while (true) {
+		pthread_mutex_lock(&q->lock);
+		if (q->next < q->end) {
+			index = q->next++;
+			pthread_mutex_unlock(&q->lock);
+		} else {
+			pthread_mutex_unlock(&q->lock);
+			if (steal_groups(walk, worker))
+				continue;
+			break;
+		}
+
+		dispatch_group(&walk->threads[worker],
+			       index % end_x,
+			       index / end_x % end_y,
+			       index / end_x / end_y);
+	}
 }
 
 void
 dispatch_compute(void)
 {
-	reset_shader_pool();
-	compile_cs();
+	set_default_csr();
+
+	shader_cache_prepare();
+	if (gt.dirty & DIRTY_CS) {
+		compile_cs();
+		gt.dirty &= ~DIRTY_CS;
+	}
 
 	/* FIXME: Any compute statistics that we need to maintain? */
 
-	/* We use this little awkward goto to resume with the given
-	 * start values. x and y are supposed start from start_x and
-	 * start_y but revert back to 0 once they reach end_x and
-	 * end_y. */
-	uint32_t x = gt.compute.start_x;
-	uint32_t y = gt.compute.start_y;
-	uint32_t z = gt.compute.start_z;
-	goto resume;
-
-	for (; z < gt.compute.end_z; z++) {
-		for (y = 0; y < gt.compute.end_y; y++) {
-			for (x = 0; x < gt.compute.end_x; x++) {
-			resume:
-				dispatch_group(x, y, z);
-			}
-		}
+	/* The walker starts from the given start values. x and y are
+	 * supposed start from start_x and start_y but revert back to
+	 * 0 once they reach end_x and end_y, so the groups form one
+	 * linear range in x, y, z order. */
+	const uint32_t begin =
+		(gt.compute.start_z * gt.compute.end_y + gt.compute.start_y) *
+		gt.compute.end_x + gt.compute.start_x;
+	const uint32_t end =
+		gt.compute.end_z * gt.compute.end_y * gt.compute.end_x;
+
+	if (begin >= end)
+		return;
+
+	struct compute_walk walk;
+	walk.count = thread_pool_size();
+	if (walk.count > end - begin)
+		walk.count = end - begin;
+	walk.queues = malloc(walk.count * sizeof(walk.queues[0]));
+	walk.threads = aligned_alloc(32, walk.count * sizeof(walk.threads[0]));
+	ksim_assert(walk.queues != NULL && walk.threads != NULL);
+
+	for (uint32_t i = 0; i < walk.count; i++) {
+		pthread_mutex_init(&walk.queues[i].lock, NULL);
+		walk.queues[i].next = begin + (uint64_t) (end - begin) * i / walk.count;
+		walk.queues[i].end = begin + (uint64_t) (end - begin) * (i + 1) / walk.count;
 	}
+
+	thread_pool_run(dispatch_groups, &walk);
+
+	for (uint32_t i = 0; i < walk.count; i++)
+		pthread_mutex_destroy(&walk.queues[i].lock);
+	free(walk.queues);
+	free(walk.threads);
 }
@@ -219,6 +219,7 @@ emit_dword_atomic_integer(struct kir_program *prog, struct inst *inst)
 	ksim_assert(valid);
 	args->src = unpack_inst_2src_src0(inst).num;
 	args->buffer = s.pixels;
+	shader_reloc_pointer(&args->buffer, s.address);
 	args->simd_mode = m.simd_mode;
 	args->scope = prog->scope;
 	kir_program_send(prog, inst, func, args);
@@ -254,6 +255,7 @@ builder_emit_sfid_dataport1(struct kir_program *prog, struct inst *inst)
 					 bti, &buffer);
 		ksim_assert(valid);
 		args->buffer = buffer.pixels;
+		shader_reloc_pointer(&args->buffer, buffer.address);
 
 		func = sfid_dataport1_untyped_write;
 		kir_program_send(prog, inst, func, args);
@@ -330,6 +332,7 @@ builder_emit_sfid_dataport_ro(struct kir_program *prog, struct inst *inst)
 	struct surface buffer;
 	bool valid;
 	struct kir_reg v, offset, base;
+	uint32_t value, offset_imm;
 
 	switch (md.message_type) {
 	case MT_CC_OWB:
@@ -342,32 +345,34 @@ builder_emit_sfid_dataport_ro(struct kir_program *prog, struct inst *inst)
 			kir_program_comment(prog, "ro dp read 4 ow from bti %d",
 					    md.binding_table_index);
 
-			/* FIXME: We need constant propagation at this
-			 * point to recognize that r72.2 (for example)
-			 * is constant and we can compute the exact
-			 * address at comppile time. Something like,
-			 *
-			 *     if (is_constant(grf, 72, 2, &value) {
-			 *         base = load_base_imm(buffer.pixels);
-			 *         load(prog, base, value * 16 + 0);
-			 *         load(prog, base, value * 16 + 32);
-			 *     } else {
-			 *         what we have below now...
-			 *     }
-			 *
-			 * and then ideally multiple ubo loads from
-			 * the same ubo will use the same
-			 * load_base_imm.
-			 */
-
-			offset = kir_program_load_v8(prog, offsetof(struct thread, grf[src.num]));
-			/* Offset is in owords; multiply by 16. */
-			offset = kir_program_alu(prog, kir_shli, offset, 4);
-			base = kir_program_set_load_base_imm_offset(prog, buffer.pixels, offset);
-
-			v = kir_program_load(prog, base, 0);
+			/* The offset is in owords in dword 2 of the
+			 * header. It's usually constant, in which case
+			 * we compute the address at compile time and
+			 * all loads from the same buffer share one
+			 * load base. */
+			const struct eu_region region = {
+				.offset = offsetof(struct thread, grf[src.num].ud[2]),
+				.type_size = 4,
+				.exec_size = 1,
+				.vstride = 0,
+				.width = 1,
+				.hstride = 0
+			};
+
+			if (kir_program_get_region_constant(prog, &region, &value)) {
+				base = kir_program_set_load_base_imm(prog, buffer.address);
+				offset_imm = value * 16;
+			} else {
+				offset = kir_program_load_v8(prog, offsetof(struct thread, grf[src.num]));
+				/* Offset is in owords; multiply by 16. */
+				offset = kir_program_alu(prog, kir_shli, offset, 4);
+				base = kir_program_set_load_base_imm_offset(prog, buffer.address, offset);
+				offset_imm = 0;
+			}
+
+			v = kir_program_load(prog, base, offset_imm);
 			kir_program_store_v8(prog, offsetof(struct thread, grf[dst.num]), v);
-			v = kir_program_load(prog, base, 32);
+			v = kir_program_load(prog, base, offset_imm + 32);
 			kir_program_store_v8(prog, offsetof(struct thread, grf[dst.num + 1]), v);
 			break;
 		default:
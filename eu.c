@@ -33,6 +33,7 @@
 #include <math.h>
 #include <assert.h>
 #include <immintrin.h>
+#include <pthread.h>
 
 #include "eu.h"
 #include "kir.h"
@@ -237,7 +238,7 @@ kir_program_emit_src_load(struct kir_program *prog,
 	struct inst_common common = unpack_inst_common(inst);
 	struct inst_dst dst;
 	int src_type;
-	struct kir_insn *insn;
+	union kir_imm imm;
 	struct kir_reg reg;
 
 	src_type = src->type;
@@ -255,35 +256,35 @@ kir_program_emit_src_load(struct kir_program *prog,
 		switch (src->type) {
 		case BRW_HW_REG_TYPE_UD:
 		case BRW_HW_REG_TYPE_D:
-		case BRW_HW_REG_TYPE_F: {
-			insn = kir_program_add_insn(prog, kir_immd);
-			insn->imm.d = unpack_inst_imm(inst).d;
+		case BRW_HW_REG_TYPE_F:
+			imm.d = unpack_inst_imm(inst).d;
+			kir_program_imm(prog, kir_immd, imm);
 			break;
-		}
+
 		case BRW_HW_REG_TYPE_UW:
 		case BRW_HW_REG_TYPE_W:
-			insn = kir_program_add_insn(prog, kir_immw);
-			insn->imm.d = unpack_inst_imm(inst).d & 0xffff;
+			imm.d = unpack_inst_imm(inst).d & 0xffff;
+			kir_program_imm(prog, kir_immw, imm);
 			break;
 
 		case BRW_HW_REG_IMM_TYPE_UV:
 			/* Gen6+ packed unsigned immediate vector */
-			insn = kir_program_add_insn(prog, kir_immv);
-			memcpy(insn->imm.v, unpack_inst_imm(inst).v, sizeof(insn->imm.v));
+			memcpy(imm.v, unpack_inst_imm(inst).v, sizeof(imm.v));
+			kir_program_imm(prog, kir_immv, imm);
 			src_type = BRW_HW_REG_TYPE_UW;
 			break;
 
 		case BRW_HW_REG_IMM_TYPE_VF:
 			/* packed float immediate vector */
-			insn = kir_program_add_insn(prog, kir_immvf);
-			memcpy(insn->imm.vf, unpack_inst_imm(inst).vf, sizeof(insn->imm.vf));
+			memcpy(imm.vf, unpack_inst_imm(inst).vf, sizeof(imm.vf));
+			kir_program_imm(prog, kir_immvf, imm);
 			src_type = BRW_HW_REG_TYPE_F;
 			break;
 
 		case BRW_HW_REG_IMM_TYPE_V:
 			/* packed int imm. vector; uword dest only */
-			insn = kir_program_add_insn(prog, kir_immv);
-			memcpy(insn->imm.v, unpack_inst_imm(inst).v, sizeof(insn->imm.v));
+			memcpy(imm.v, unpack_inst_imm(inst).v, sizeof(imm.v));
+			kir_program_imm(prog, kir_immv, imm);
 			src_type = BRW_HW_REG_TYPE_W;
 			break;
 
@@ -436,62 +437,217 @@ builder_emit_sfid_thread_spawner(struct kir_program *prog, struct inst *inst)
 	ksim_assert(opcode == 0 && request == 0 && resource_select == 1);
 }
 
-/* Vectorized AVX2 math functions from glibc's libmvec */
-__m256 _ZGVdN8vv_powf(__m256 x, __m256 y);
-__m256 _ZGVdN8v_logf(__m256 x);
-__m256 _ZGVdN8v_expf(__m256 x);
-__m256 _ZGVdN8v_sinf(__m256 x);
-__m256 _ZGVdN8v_cosf(__m256 x);
-__m256 _ZGVdN8vv_powf(__m256 x, __m256 y);
+/* Inline versions of the EU math functions, so that a MATH
+ * instruction doesn't turn into a call that spills every live
+ * register. EXP and LOG are base 2 on the EU. The polynomials are the
+ * cephes single precision minimax ones, good to a couple of ulp. */
 
-static __m256i
-int_div_quotient(__m256i _n, __m256i _d)
+static struct kir_reg
+emit_exp2(struct kir_program *prog, struct kir_reg x)
 {
-	struct reg n, d, q, r;
+	static const float p[] = {
+		1.535336188319500e-4f, 1.339887440266574e-3f,
+		9.618437357674640e-3f, 5.550332471162809e-2f,
+		2.402264791363012e-1f, 6.931472028550421e-1f, 1.0f
+	};
+	struct kir_reg n, f, r, e;
 
-	n.ireg = _n;
-	d.ireg = _d;
+	/* Keep the exponent in range: 2^-127 flushes to 0, 2^128 is
+	 * inf. */
+	x = kir_program_alu(prog, kir_maxf, x, kir_program_immf(prog, -127.0f));
+	x = kir_program_alu(prog, kir_minf, x, kir_program_immf(prog, 128.0f));
 
-#define div_channel(c)						\
-	do {							\
-		q.ud[c] = n.ud[c] / d.ud[c];			\
-		r.ud[c] = n.ud[c] % d.ud[c];			\
-	} while (0)
+	/* 2^x = 2^n * 2^f, n = round(x), f in [-0.5, 0.5] */
+	n = kir_program_alu(prog, kir_rnde, x);
+	f = kir_program_alu(prog, kir_subf, x, n);
 
-	div_channel(0);
-	div_channel(1);
-	div_channel(2);
-	div_channel(3);
-	div_channel(4);
-	div_channel(5);
-	div_channel(6);
-	div_channel(7);
+	r = kir_program_immf(prog, p[0]);
+	for (uint32_t i = 1; i < ARRAY_LENGTH(p); i++)
+		r = kir_program_alu(prog, kir_maddf, r, f, kir_program_immf(prog, p[i]));
 
-	(void) r;
+	e = kir_program_alu(prog, kir_ps2d, n);
+	e = kir_program_alu(prog, kir_addd, e, kir_program_immd(prog, 127));
+	e = kir_program_alu(prog, kir_shli, e, 23);
 
-	return q.ireg;
+	return kir_program_alu(prog, kir_mulf, r, e);
 }
 
-static __m256i
-int_div_remainder(__m256i _n, __m256i _d)
+static struct kir_reg
+emit_log2(struct kir_program *prog, struct kir_reg x)
 {
-	struct reg n, d, q, r;
+	/* 2 / (k ln 2) for odd k, the atanh series below */
+	static const float p[] = {
+		0.32059889f, 0.41219858f, 0.57707801f, 0.96179669f, 2.88539008f
+	};
+	struct kir_reg e, m, half, big, s, t, r, special;
+
+	/* x = 2^e * m, m in [sqrt(1/2), sqrt(2)) */
+	e = kir_program_alu(prog, kir_shri, x, 23);
+	e = kir_program_alu(prog, kir_subd, e, kir_program_immd(prog, 127));
+	m = kir_program_alu(prog, kir_and, x, kir_program_immd(prog, 0x007fffff));
+	m = kir_program_alu(prog, kir_or, m, kir_program_immd(prog, 0x3f800000));
+	big = kir_program_alu(prog, kir_cmpf,
+			      kir_program_immf(prog, M_SQRT2), m, _CMP_GT_OQ);
+	half = kir_program_alu(prog, kir_mulf, m, kir_program_immf(prog, 0.5f));
+	m = kir_program_alu(prog, kir_blend, half, m, big);
+	e = kir_program_alu(prog, kir_subd, e, big);
+	e = kir_program_alu(prog, kir_d2ps, e);
+
+	/* log2(m) = 2 / ln 2 * atanh(s), s = (m - 1) / (m + 1), |s| < 0.172 */
+	s = kir_program_alu(prog, kir_divf,
+			    kir_program_alu(prog, kir_subf, m, kir_program_immf(prog, 1.0f)),
+			    kir_program_alu(prog, kir_addf, m, kir_program_immf(prog, 1.0f)));
+	t = kir_program_alu(prog, kir_mulf, s, s);
+	r = kir_program_immf(prog, p[0]);
+	for (uint32_t i = 1; i < ARRAY_LENGTH(p); i++)
+		r = kir_program_alu(prog, kir_maddf, r, t, kir_program_immf(prog, p[i]));
+	r = kir_program_alu(prog, kir_maddf, r, s, e);
+
+	/* log2(0) is -inf, log2 of a negative number is NaN */
+	special = kir_program_alu(prog, kir_cmpf,
+				  kir_program_immf(prog, 0.0f), x, _CMP_LE_OQ);
+	r = kir_program_alu(prog, kir_blend,
+			    kir_program_immf(prog, -INFINITY), r, special);
+	special = kir_program_alu(prog, kir_cmpf,
+				  kir_program_immf(prog, 0.0f), x, _CMP_LT_OQ);
+
+	return kir_program_alu(prog, kir_or, r, special);
+}
 
-	n.ireg = _n;
-	d.ireg = _d;
+static struct kir_reg
+emit_sin(struct kir_program *prog, struct kir_reg x, bool cos)
+{
+	struct kir_reg j, r, q, t, s, c;
+
+	/* x = j * pi/2 + r, r in [-pi/4, pi/4]. pi/2 is split in three
+	 * parts so that j * pi/2 is exact. */
+	j = kir_program_alu(prog, kir_mulf, x, kir_program_immf(prog, M_2_PI));
+	j = kir_program_alu(prog, kir_rnde, j);
+	r = kir_program_alu(prog, kir_nmaddf, j,
+			    kir_program_immf(prog, 1.5703125f), x);
+	r = kir_program_alu(prog, kir_nmaddf, j,
+			    kir_program_immf(prog, 4.837512969970703125e-4f), r);
+	r = kir_program_alu(prog, kir_nmaddf, j,
+			    kir_program_immf(prog, 7.54978995489188216e-8f), r);
+	q = kir_program_alu(prog, kir_ps2d, j);
+	/* cos(x) = sin(x + pi/2) */
+	if (cos)
+		q = kir_program_alu(prog, kir_addd, q, kir_program_immd(prog, 1));
+
+	t = kir_program_alu(prog, kir_mulf, r, r);
+
+	/* sin(r) = r + r^3 * S(r^2) */
+	s = kir_program_immf(prog, -1.9515295891e-4f);
+	s = kir_program_alu(prog, kir_maddf, s, t, kir_program_immf(prog, 8.3321608736e-3f));
+	s = kir_program_alu(prog, kir_maddf, s, t, kir_program_immf(prog, -1.6666654611e-1f));
+	s = kir_program_alu(prog, kir_mulf, s, t);
+	s = kir_program_alu(prog, kir_maddf, s, r, r);
+
+	/* cos(r) = 1 - r^2 / 2 + r^4 * C(r^2) */
+	c = kir_program_immf(prog, 2.443315711809948e-5f);
+	c = kir_program_alu(prog, kir_maddf, c, t, kir_program_immf(prog, -1.388731625493765e-3f));
+	c = kir_program_alu(prog, kir_maddf, c, t, kir_program_immf(prog, 4.166664568298827e-2f));
+	c = kir_program_alu(prog, kir_maddf, c, t, kir_program_immf(prog, -0.5f));
+	c = kir_program_alu(prog, kir_maddf, c, t, kir_program_immf(prog, 1.0f));
+
+	/* Odd quadrants use cos(r), blend only looks at the sign bit.
+	 * Quadrants 2 and 3 are negated. */
+	r = kir_program_alu(prog, kir_blend, c, s, kir_program_alu(prog, kir_shli, q, 31));
+	q = kir_program_alu(prog, kir_shli, q, 30);
+	q = kir_program_alu(prog, kir_and, q, kir_program_immd(prog, 0x80000000));
+
+	return kir_program_alu(prog, kir_xor, r, q);
+}
 
-	div_channel(0);
-	div_channel(1);
-	div_channel(2);
-	div_channel(3);
-	div_channel(4);
-	div_channel(5);
-	div_channel(6);
-	div_channel(7);
+static struct kir_reg
+emit_pow(struct kir_program *prog, struct kir_reg x, struct kir_reg y)
+{
+	struct kir_reg l = emit_log2(prog, x);
 
-	(void) q;
+	return emit_exp2(prog, kir_program_alu(prog, kir_mulf, l, y));
+}
 
-	return r.ireg;
+static struct kir_reg
+emit_u2f(struct kir_program *prog, struct kir_reg x)
+{
+	struct kir_reg hi, lo;
+
+	hi = kir_program_alu(prog, kir_d2ps, kir_program_alu(prog, kir_shri, x, 1));
+	lo = kir_program_alu(prog, kir_and, x, kir_program_immd(prog, 1));
+	lo = kir_program_alu(prog, kir_d2ps, lo);
+
+	return kir_program_alu(prog, kir_maddf, hi, kir_program_immf(prog, 2.0f), lo);
+}
+
+static struct kir_reg
+emit_f2u(struct kir_program *prog, struct kir_reg f)
+{
+	struct kir_reg lo, hi;
+
+	/* For f in [0, 2^32). ps2d gives 0x80000000 when f doesn't fit
+	 * in a signed dword and f - 2^32 gives 0x80000000 when it
+	 * does, so xor-ing the two leaves the right bits. */
+	lo = kir_program_alu(prog, kir_ps2d, f);
+	hi = kir_program_alu(prog, kir_subf, f, kir_program_immf(prog, 4294967296.0f));
+	hi = kir_program_alu(prog, kir_ps2d, hi);
+	lo = kir_program_alu(prog, kir_xor, lo, hi);
+
+	return kir_program_alu(prog, kir_xor, lo, kir_program_immd(prog, 0x80000000));
+}
+
+/* Unsigned dword division. There's no integer divide in AVX2, so
+ * estimate the quotient in single precision, scaled down a bit so it
+ * never comes out too big, refine it once using the remainder and fix
+ * up the last off-by-one. Returns the quotient and leaves it as the
+ * last instruction. */
+static struct kir_reg
+emit_int_div(struct kir_program *prog,
+	     struct kir_reg n, struct kir_reg d, struct kir_reg *rem)
+{
+	struct kir_reg inv, q, r, t, bias, lt;
+
+	inv = kir_program_alu(prog, kir_divf,
+			      kir_program_immf(prog, 1.0f - 0x1p-20f), emit_u2f(prog, d));
+
+	q = kir_program_alu(prog, kir_mulf, emit_u2f(prog, n), inv);
+	q = emit_f2u(prog, kir_program_alu(prog, kir_rndz, q));
+	r = kir_program_alu(prog, kir_subd, n, kir_program_alu(prog, kir_muld, q, d));
+
+	t = kir_program_alu(prog, kir_mulf, emit_u2f(prog, r), inv);
+	t = kir_program_alu(prog, kir_ps2d, kir_program_alu(prog, kir_rndz, t));
+	q = kir_program_alu(prog, kir_addd, q, t);
+	r = kir_program_alu(prog, kir_subd, r, kir_program_alu(prog, kir_muld, t, d));
+
+	/* r is now in [0, 2d). Compare unsigned by flipping the sign
+	 * bits. */
+	bias = kir_program_immd(prog, 0x80000000);
+	lt = kir_program_alu(prog, kir_cmpgtd,
+			     kir_program_alu(prog, kir_xor, r, bias),
+			     kir_program_alu(prog, kir_xor, d, bias));
+	*rem = kir_program_alu(prog, kir_subd, r, kir_program_alu(prog, kir_andn, d, lt));
+	q = kir_program_alu(prog, kir_addd, q, lt);
+
+	return kir_program_alu(prog, kir_addd, q, kir_program_immd(prog, 1));
+}
+
+/* A single immediate value, as opposed to a packed vector. The EU
+ * only uses the low 5 bits of a shift count, so these can use the
+ * AVX2 immediate shifts. */
+static bool
+is_scalar_imm(const struct inst_src *src)
+{
+	if (src->file != BRW_IMMEDIATE_VALUE)
+		return false;
+
+	switch (src->type) {
+	case BRW_HW_REG_TYPE_UD:
+	case BRW_HW_REG_TYPE_D:
+	case BRW_HW_REG_TYPE_UW:
+	case BRW_HW_REG_TYPE_W:
+		return true;
+	default:
+		return false;
+	}
 }
 
 static bool
@@ -526,7 +682,6 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 		dst = unpack_inst_2src_dst(inst);
 
 	prog->quarter |= unpack_inst_common(inst).qtr_control;
-	prog->new_scope = prog->scope;
 
 	switch (opcode) {
 	case BRW_OPCODE_MOV:
@@ -601,13 +756,25 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 		kir_program_alu(prog, kir_xor, src0_reg, src1_reg);
 		break;
 	case BRW_OPCODE_SHR:
-		kir_program_alu(prog, kir_shr, src1_reg, src0_reg);
+		if (is_scalar_imm(&src1))
+			kir_program_alu(prog, kir_shri, src0_reg,
+					unpack_inst_imm(inst).ud & 31);
+		else
+			kir_program_alu(prog, kir_shr, src1_reg, src0_reg);
 		break;
 	case BRW_OPCODE_SHL:
-		kir_program_alu(prog, kir_shl, src1_reg, src0_reg);
+		if (is_scalar_imm(&src1))
+			kir_program_alu(prog, kir_shli, src0_reg,
+					unpack_inst_imm(inst).ud & 31);
+		else
+			kir_program_alu(prog, kir_shl, src1_reg, src0_reg);
 		break;
 	case BRW_OPCODE_ASR:
-		kir_program_alu(prog, kir_asr, src1_reg, src0_reg);
+		if (is_scalar_imm(&src1))
+			kir_program_alu(prog, kir_asri, src0_reg,
+					unpack_inst_imm(inst).ud & 31);
+		else
+			kir_program_alu(prog, kir_asr, src1_reg, src0_reg);
 		break;
 	case BRW_OPCODE_CMP: {
 		int modifier = unpack_inst_common(inst).cond_modifier;
@@ -639,50 +806,18 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 		stub("BRW_OPCODE_BFI2");
 		break;
 	case BRW_OPCODE_JMPI:
-		stub("BRW_OPCODE_JMPI");
-		break;
-	case BRW_OPCODE_IF: {
-		int flag_nr = unpack_inst_common(inst).flag_nr;
-		uint32_t q = prog->quarter;
-		struct kir_reg f = kir_program_load_v8(prog, offsetof(struct thread, f[flag_nr].q[q]));
-		struct kir_reg mask = kir_program_load_v8(prog, offsetof(struct thread, mask[prog->scope].q[q]));
-		if (unpack_inst_common(inst).pred_inv)
-			mask = kir_program_alu(prog, kir_andn, mask, f);
-		else
-			mask = kir_program_alu(prog, kir_and, mask, f);
-		kir_program_store_v8(prog, offsetof(struct thread, mask[prog->scope + 1].q[q]), mask);
-		prog->new_scope = prog->scope + 1;
-		break;
-	}
-	case BRW_OPCODE_IFF:
-		stub("BRW_OPCODE_IFF");
-		break;
-	case BRW_OPCODE_ELSE: {
-		ksim_assert(prog->scope > 0);
-		uint32_t q = prog->quarter;
-		struct kir_reg prev_mask = kir_program_load_v8(prog, offsetof(struct thread, mask[prog->scope - 1].q[q]));
-		struct kir_reg mask = kir_program_load_v8(prog, offsetof(struct thread, mask[prog->scope].q[q]));
-		mask = kir_program_alu(prog, kir_xor, prev_mask, mask);
-		kir_program_store_v8(prog, offsetof(struct thread, mask[prog->scope].q[q]), mask);
-		break;
-	}
+	case BRW_OPCODE_IF:
+	case BRW_OPCODE_ELSE:
 	case BRW_OPCODE_ENDIF:
-		prog->new_scope = prog->scope - 1;
-		break;
 	case BRW_OPCODE_DO:
-		stub("BRW_OPCODE_DO");
-		break;
 	case BRW_OPCODE_WHILE:
-		stub("BRW_OPCODE_WHILE");
-		break;
 	case BRW_OPCODE_BREAK:
-		stub("BRW_OPCODE_BREAK");
-		break;
 	case BRW_OPCODE_CONTINUE:
-		stub("BRW_OPCODE_CONTINUE");
-		break;
 	case BRW_OPCODE_HALT:
-		stub("BRW_OPCODE_HALT");
+		ksim_unreachable("control flow is compiled by compile_control_flow()");
+		break;
+	case BRW_OPCODE_IFF:
+		stub("BRW_OPCODE_IFF");
 		break;
 	case BRW_OPCODE_MSAVE:
 		stub("BRW_OPCODE_MSAVE");
@@ -735,10 +870,10 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 			kir_program_alu(prog, kir_rcp, src0_reg);
 			break;
 		case BRW_MATH_FUNCTION_LOG:
-			kir_program_const_call(prog, _ZGVdN8v_logf, 1, src0_reg);
+			emit_log2(prog, src0_reg);
 			break;
 		case BRW_MATH_FUNCTION_EXP:
-			kir_program_const_call(prog, _ZGVdN8v_expf, 1, src0_reg);
+			emit_exp2(prog, src0_reg);
 			break;
 		case BRW_MATH_FUNCTION_SQRT:
 			kir_program_alu(prog, kir_sqrt, src0_reg);
@@ -747,10 +882,10 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 			kir_program_alu(prog, kir_rsqrt, src0_reg);
 			break;
 		case BRW_MATH_FUNCTION_SIN:
-			kir_program_const_call(prog, _ZGVdN8v_sinf, 1, src0_reg);
+			emit_sin(prog, src0_reg, false);
 			break;
 		case BRW_MATH_FUNCTION_COS:
-			kir_program_const_call(prog, _ZGVdN8v_cosf, 1, src0_reg);
+			emit_sin(prog, src0_reg, true);
 			break;
 		case BRW_MATH_FUNCTION_SINCOS:
 			ksim_unreachable("sincos only gen4/5");
@@ -759,23 +894,30 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 			kir_program_alu(prog, kir_divf, src0_reg, src1_reg);
 			break;
 		case BRW_MATH_FUNCTION_POW:
-			kir_program_const_call(prog, _ZGVdN8vv_powf, 2, src0_reg, src1_reg);
+			emit_pow(prog, src0_reg, src1_reg);
 			break;
 		case BRW_MATH_FUNCTION_INT_DIV_QUOTIENT_AND_REMAINDER: {
 			struct inst_dst dst2 = dst;
-			kir_program_const_call(prog, int_div_remainder, 2, src0_reg, src1_reg);
+			struct kir_reg q, r;
+
+			q = emit_int_div(prog, src0_reg, src1_reg, &r);
 			dst2.num++;
-			kir_program_emit_dst_store(prog, prog->dst, inst, &dst2);
+			kir_program_emit_dst_store(prog, r, inst, &dst2);
 
-			kir_program_const_call(prog, int_div_quotient, 2, src0_reg, src1_reg);
+			kir_program_alu(prog, kir_mov, q);
 			break;
 		}
 		case BRW_MATH_FUNCTION_INT_DIV_QUOTIENT: {
-			kir_program_const_call(prog, int_div_quotient, 2, src0_reg, src1_reg);
+			struct kir_reg r;
+
+			emit_int_div(prog, src0_reg, src1_reg, &r);
 			break;
 		}
 		case BRW_MATH_FUNCTION_INT_DIV_REMAINDER: {
-			kir_program_const_call(prog, int_div_remainder, 2, src0_reg, src1_reg);
+			struct kir_reg r;
+
+			emit_int_div(prog, src0_reg, src1_reg, &r);
+			kir_program_alu(prog, kir_mov, r);
 			break;
 		}
 		case GEN8_MATH_FUNCTION_INVM:
@@ -975,6 +1117,228 @@ compile_inst(struct kir_program *prog, struct inst *inst)
 	return eot;
 }
 
+static struct kir_reg
+load_mask(struct kir_program *prog, int scope, uint32_t q)
+{
+	return kir_program_load_v8(prog, offsetof(struct thread, mask[scope].q[q]));
+}
+
+static void
+store_mask(struct kir_program *prog, int scope, uint32_t q, struct kir_reg mask)
+{
+	kir_program_store_v8(prog, offsetof(struct thread, mask[scope].q[q]), mask);
+}
+
+/* The channels of mask that the instruction predicate selects. */
+static struct kir_reg
+emit_predicate(struct kir_program *prog, struct inst *inst,
+	       struct kir_reg mask, uint32_t q)
+{
+	struct inst_common common = unpack_inst_common(inst);
+
+	if (common.pred_control == BRW_PREDICATE_NONE)
+		return mask;
+
+	struct kir_reg f =
+		kir_program_load_v8(prog, offsetof(struct thread, f[common.flag_nr].q[q]));
+	if (common.pred_inv)
+		return kir_program_alu(prog, kir_andn, mask, f);
+	else
+		return kir_program_alu(prog, kir_and, mask, f);
+}
+
+/* Or together the quarters of a scope mask so we can branch on it. */
+static struct kir_reg
+load_branch_mask(struct kir_program *prog, int scope,
+		 uint32_t first, uint32_t count)
+{
+	struct kir_reg mask = load_mask(prog, scope, first);
+
+	for (uint32_t q = first + 1; q < first + count; q++)
+		mask = kir_program_alu(prog, kir_or, mask, load_mask(prog, scope, q));
+
+	return mask;
+}
+
+/* Control flow is structured: every IF and DO pushes a scope with its
+ * own execution mask and ELSE, ENDIF and WHILE update or pop it again,
+ * so we don't need JIP and UIP to find our way. Stores in a scope are
+ * masked, and each block starts with a branch that skips it once its
+ * mask is empty. Loops branch back as long as any channel is left in
+ * the iteration mask. Unlike the ALU instructions, these work on all
+ * quarters at once since there's only one branch per instruction. */
+static void
+compile_control_flow(struct kir_program *prog, struct inst *inst)
+{
+	struct inst_common common = unpack_inst_common(inst);
+	const uint32_t first = common.qtr_control;
+	const uint32_t count = (1 << common.exec_size) > 8 ? 2 : 1;
+	const int scope = prog->scope;
+	struct kir_scope *s;
+	struct kir_reg mask;
+	int loop, outer;
+
+	ksim_assert(first + count <= 2);
+
+	switch (common.opcode) {
+	case BRW_OPCODE_IF:
+		ksim_assert(scope + 1 < MAX_SCOPES);
+		for (uint32_t q = first; q < first + count; q++) {
+			mask = emit_predicate(prog, inst, load_mask(prog, scope, q), q);
+			store_mask(prog, scope + 1, q, mask);
+		}
+
+		s = &prog->scopes[scope + 1];
+		s->loop = false;
+		s->label = kir_program_create_label(prog);
+		mask = load_branch_mask(prog, scope + 1, first, count);
+		kir_program_branch(prog, mask, 0xff, true, s->label);
+		prog->scope = scope + 1;
+		break;
+
+	case BRW_OPCODE_ELSE:
+		s = &prog->scopes[scope];
+		ksim_assert(scope > 0 && !s->loop);
+		kir_program_place_label(prog, s->label);
+		for (uint32_t q = first; q < first + count; q++) {
+			mask = kir_program_alu(prog, kir_xor,
+					       load_mask(prog, scope - 1, q),
+					       load_mask(prog, scope, q));
+			store_mask(prog, scope, q, mask);
+		}
+
+		s->label = kir_program_create_label(prog);
+		mask = load_branch_mask(prog, scope, first, count);
+		kir_program_branch(prog, mask, 0xff, true, s->label);
+		break;
+
+	case BRW_OPCODE_ENDIF:
+		s = &prog->scopes[scope];
+		ksim_assert(scope > 0 && !s->loop);
+		kir_program_place_label(prog, s->label);
+		prog->scope = scope - 1;
+		break;
+
+	case BRW_OPCODE_DO:
+		/* scope + 1 has the channels that haven't left the
+		 * loop, scope + 2 the channels in this iteration. */
+		ksim_assert(scope + 2 < MAX_SCOPES);
+		for (uint32_t q = first; q < first + count; q++) {
+			mask = load_mask(prog, scope, q);
+			store_mask(prog, scope + 1, q, mask);
+			store_mask(prog, scope + 2, q, mask);
+		}
+
+		prog->scope = scope + 2;
+		s = &prog->scopes[scope + 2];
+		s->loop = true;
+		s->label = kir_program_create_label(prog);
+		s->cont = kir_program_create_label(prog);
+		kir_program_place_label(prog, s->label);
+		break;
+
+	case BRW_OPCODE_WHILE:
+		s = &prog->scopes[scope];
+		ksim_assert(scope > 1 && s->loop);
+		kir_program_place_label(prog, s->cont);
+		for (uint32_t q = first; q < first + count; q++) {
+			mask = emit_predicate(prog, inst, load_mask(prog, scope - 1, q), q);
+			store_mask(prog, scope - 1, q, mask);
+			store_mask(prog, scope, q, mask);
+		}
+
+		mask = load_branch_mask(prog, scope, first, count);
+		kir_program_branch(prog, mask, 0xff, false, s->label);
+		prog->scope = scope - 2;
+		break;
+
+	case BRW_OPCODE_BREAK:
+	case BRW_OPCODE_CONTINUE:
+		for (loop = scope; loop > 0 && !prog->scopes[loop].loop; loop--)
+			;
+		ksim_assert(loop > 0);
+
+		/* BREAK takes the channels out of the loop, CONTINUE
+		 * only out of the rest of this iteration. */
+		if (common.opcode == BRW_OPCODE_BREAK)
+			outer = loop - 1;
+		else
+			outer = loop;
+
+		for (uint32_t q = first; q < first + count; q++) {
+			struct kir_reg channels =
+				emit_predicate(prog, inst, load_mask(prog, scope, q), q);
+			for (int i = outer; i <= scope; i++) {
+				mask = kir_program_alu(prog, kir_andn,
+						       load_mask(prog, i, q), channels);
+				store_mask(prog, i, q, mask);
+			}
+		}
+
+		/* Go straight to the WHILE once nobody is left in
+		 * this iteration. */
+		mask = load_branch_mask(prog, loop, first, count);
+		kir_program_branch(prog, mask, 0xff, true, prog->scopes[loop].cont);
+		break;
+
+	case BRW_OPCODE_HALT:
+		/* Mesa uses predicated HALTs for discard and lands
+		 * them on an unpredicated HALT before the render
+		 * target write, which is a no-op for us. We can't
+		 * resume the halted channels there, so we just
+		 * disable them all the way down to scope 0, which
+		 * also drops them from the render target write. */
+		if (common.pred_control == BRW_PREDICATE_NONE) {
+			if (scope > 0)
+				stub("unpredicated HALT in control flow");
+			break;
+		}
+
+		for (uint32_t q = first; q < first + count; q++) {
+			struct kir_reg channels =
+				emit_predicate(prog, inst, load_mask(prog, scope, q), q);
+			for (int i = 0; i <= scope; i++) {
+				mask = kir_program_alu(prog, kir_andn,
+						       load_mask(prog, i, q), channels);
+				store_mask(prog, i, q, mask);
+			}
+		}
+		break;
+
+	case BRW_OPCODE_JMPI: {
+		/* JMPI jumps the whole thread, relative to the next
+		 * instruction. A predicated JMPI looks at channel 0 of
+		 * the flag. We only handle forward jumps and place the
+		 * label when kir_program_emit_shader() gets there. */
+		int32_t offset = unpack_inst_imm(inst).d;
+		struct kir_insn *label;
+
+		if (offset < 0) {
+			stub("backwards JMPI");
+			break;
+		}
+
+		label = kir_program_create_label(prog);
+		label->label.ip = prog->ip + offset;
+		label->label.next = prog->jump_targets;
+		prog->jump_targets = label;
+
+		if (common.pred_control == BRW_PREDICATE_NONE) {
+			kir_program_jump(prog, label);
+		} else {
+			struct kir_reg f =
+				kir_program_load_v8(prog, offsetof(struct thread, f[common.flag_nr].q[0]));
+			kir_program_branch(prog, f, 1, common.pred_inv, label);
+		}
+		break;
+	}
+
+	default:
+		ksim_unreachable();
+		break;
+	}
+}
+
 static bool
 do_compile_inst(struct kir_program *prog, struct inst *inst)
 {
@@ -983,6 +1347,20 @@ do_compile_inst(struct kir_program *prog, struct inst *inst)
 	struct inst_dst dst;
 	bool eot;
 
+	switch (opcode) {
+	case BRW_OPCODE_JMPI:
+	case BRW_OPCODE_IF:
+	case BRW_OPCODE_ELSE:
+	case BRW_OPCODE_ENDIF:
+	case BRW_OPCODE_DO:
+	case BRW_OPCODE_WHILE:
+	case BRW_OPCODE_BREAK:
+	case BRW_OPCODE_CONTINUE:
+	case BRW_OPCODE_HALT:
+		compile_control_flow(prog, inst);
+		return false;
+	}
+
 	if (opcode_info[opcode].num_srcs == 3)
 		dst = unpack_inst_3src_dst(inst);
 	else
@@ -1004,8 +1382,6 @@ do_compile_inst(struct kir_program *prog, struct inst *inst)
 		compile_inst(prog, inst);
 	}
 
-	prog->scope = prog->new_scope;
-
 	return eot;
 }
 
@@ -1020,39 +1396,297 @@ void brw_uncompact_instruction(const struct gen_device_info *devinfo,
 
 static const struct gen_device_info ksim_devinfo = { .gen = 9 };
 
-void
-kir_program_emit_shader(struct kir_program *prog, uint64_t kernel_offset)
+/* The compaction tables are global, and shaders may be compiled on
+ * several threads at once. */
+static pthread_once_t compaction_once = PTHREAD_ONCE_INIT;
+
+static void
+init_compaction_tables(void)
+{
+	brw_init_compaction_tables(&ksim_devinfo);
+}
+
+/* Decoded kernels, so compiling the same kernel again for different
+ * fixed function state doesn't walk and uncompact it again. Entries
+ * are keyed by ksp and keep a copy of the kernel binary, a lookup
+ * only hits if the kernel at ksp is unchanged. A kernel that changed
+ * replaces the old entry, which is freed once the last compile using
+ * it is done. */
+
+#define DECODED_KERNEL_BUCKETS 64
+
+struct decoded_kernel {
+	struct decoded_kernel *next;
+	uint64_t ksp;
+	uint32_t size;
+	uint32_t count;
+	uint32_t refcount;
+	bool stale;
+	void *binary;
+
+	/* The uncompacted instructions and their offsets in the
+	 * kernel. offsets[count] is the size. */
+	struct inst *insns;
+	uint32_t *offsets;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct decoded_kernel *buckets[DECODED_KERNEL_BUCKETS];
+} decoded_kernels = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t
+decoded_kernel_bucket(uint64_t ksp)
+{
+	return (ksp >> 6) % DECODED_KERNEL_BUCKETS;
+}
+
+static void
+free_decoded_kernel(struct decoded_kernel *k)
+{
+	free(k->binary);
+	free(k->insns);
+	free(k->offsets);
+	free(k);
+}
+
+/* Drop the entry for ksp from the table, if any. Called with the
+ * lock held. */
+static void
+remove_decoded_kernel(uint64_t ksp)
 {
-	struct inst uncompacted;
-	void *insn;
+	struct decoded_kernel **link, *k;
+
+	link = &decoded_kernels.buckets[decoded_kernel_bucket(ksp)];
+	for (k = *link; k != NULL; link = &k->next, k = *link) {
+		if (k->ksp == ksp) {
+			*link = k->next;
+			k->stale = true;
+			if (k->refcount == 0)
+				free_decoded_kernel(k);
+			return;
+		}
+	}
+}
+
+static struct decoded_kernel *
+decode_kernel(uint64_t ksp, void *start, uint64_t range)
+{
+	struct decoded_kernel *k;
+	uint32_t size = 0;
+	void *p, *insn;
 	bool eot;
-	uint64_t ksp, range;
-	void *p, *start;
 
-	brw_init_compaction_tables(&ksim_devinfo);
+	k = malloc(sizeof(*k));
+	ksim_assert(k != NULL);
+	k->ksp = ksp;
+	k->count = 0;
+	k->refcount = 0;
+	k->stale = false;
+	k->insns = NULL;
+	k->offsets = NULL;
 
-	ksp = kernel_offset + gt.instruction_base_address;
-	start = map_gtt_offset(ksp, &range);
+	/* The kernel ends at the first EOT send. */
 	p = start;
-
 	do {
-		if (trace_mask & TRACE_EU)
-			fprintf(trace_file, "%04lx  ", p - start);
+		if (k->count + 1 >= size) {
+			size = size ? size * 2 : 64;
+			k->insns = realloc(k->insns, size * sizeof(k->insns[0]));
+			k->offsets = realloc(k->offsets, size * sizeof(k->offsets[0]));
+			ksim_assert(k->insns != NULL && k->offsets != NULL);
+		}
 
+		k->offsets[k->count] = p - start;
 		if (unpack_inst_common(p).cmpt_control) {
-			brw_uncompact_instruction(&ksim_devinfo, &uncompacted, p);
-			insn = &uncompacted;
+			brw_uncompact_instruction(&ksim_devinfo, &k->insns[k->count], p);
 			p += 8;
 		} else {
-			insn = p;
+			memcpy(&k->insns[k->count], p, 16);
 			p += 16;
 		}
+		insn = &k->insns[k->count++];
+
+		switch (unpack_inst_common(insn).opcode) {
+		case BRW_OPCODE_SEND:
+		case BRW_OPCODE_SENDC:
+			eot = unpack_inst_send(insn).eot;
+			break;
+		default:
+			eot = false;
+			break;
+		}
+	} while (!eot && p - start < range);
+
+	k->size = p - start;
+	k->offsets[k->count] = k->size;
+	k->binary = malloc(k->size);
+	ksim_assert(k->binary != NULL);
+	memcpy(k->binary, start, k->size);
+
+	return k;
+}
+
+static struct decoded_kernel *
+get_decoded_kernel(uint64_t kernel_offset)
+{
+	const uint64_t ksp = kernel_offset + gt.instruction_base_address;
+	const uint32_t bucket = decoded_kernel_bucket(ksp);
+	struct decoded_kernel *k;
+	uint64_t range;
+	void *start;
+
+	pthread_once(&compaction_once, init_compaction_tables);
+
+	start = map_gtt_offset(ksp, &range);
+
+	pthread_mutex_lock(&decoded_kernels.mutex);
+	for (k = decoded_kernels.buckets[bucket]; k != NULL; k = k->next) {
+		if (k->ksp == ksp) {
+			if (k->size <= range &&
+			    memcmp(k->binary, start, k->size) == 0) {
+				k->refcount++;
+				pthread_mutex_unlock(&decoded_kernels.mutex);
+				return k;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&decoded_kernels.mutex);
+
+	k = decode_kernel(ksp, start, range);
+
+	pthread_mutex_lock(&decoded_kernels.mutex);
+	remove_decoded_kernel(ksp);
+	k->refcount++;
+	k->next = decoded_kernels.buckets[bucket];
+	decoded_kernels.buckets[bucket] = k;
+	pthread_mutex_unlock(&decoded_kernels.mutex);
+
+	return k;
+}
+
+static void
+put_decoded_kernel(struct decoded_kernel *k)
+{
+	pthread_mutex_lock(&decoded_kernels.mutex);
+	ksim_assert(k->refcount > 0);
+	if (--k->refcount == 0 && k->stale)
+		free_decoded_kernel(k);
+	pthread_mutex_unlock(&decoded_kernels.mutex);
+}
+
+uint32_t
+kernel_size(uint64_t kernel_offset)
+{
+	struct decoded_kernel *k = get_decoded_kernel(kernel_offset);
+	const uint32_t size = k->size;
+
+	put_decoded_kernel(k);
+
+	return size;
+}
+
+/* Whether any instruction in the kernel may write a GRF in
+ * [start, end). Indirect destinations count as writing anything. */
+bool
+kernel_writes_grfs(uint64_t kernel_offset, uint32_t start, uint32_t end)
+{
+	struct decoded_kernel *k = get_decoded_kernel(kernel_offset);
+	bool writes = false;
+
+	for (uint32_t i = 0; i < k->count && !writes; i++) {
+		struct inst *inst = &k->insns[i];
+		struct inst_common common = unpack_inst_common(inst);
+		struct inst_dst dst;
+		uint32_t first, last, stride, subnum, bytes;
+
+		if (common.opcode == BRW_OPCODE_SEND ||
+		    common.opcode == BRW_OPCODE_SENDC) {
+			first = unpack_inst_2src_dst(inst).num;
+			last = first + unpack_inst_send(inst).rlen;
+		} else if (opcode_info[common.opcode].store_dst) {
+			if (opcode_info[common.opcode].num_srcs == 3) {
+				dst = unpack_inst_3src_dst(inst);
+				subnum = dst.da16_subnum;
+			} else {
+				dst = unpack_inst_2src_dst(inst);
+				if (common.access_mode == BRW_ALIGN_1)
+					subnum = dst.da1_subnum;
+				else
+					subnum = dst.da16_subnum * 16;
+			}
+
+			if (dst.file != BRW_GENERAL_REGISTER_FILE)
+				continue;
+			if (dst.address_mode != BRW_ADDRESS_DIRECT) {
+				writes = true;
+				continue;
+			}
+
+			stride = dst.hstride ? 1 << (dst.hstride - 1) : 1;
+			bytes = ((1 << common.exec_size) - 1) * stride + 1;
+			bytes = subnum + bytes * type_size(dst.type);
+			first = dst.num;
+			last = first + DIV_ROUND_UP(bytes, 32);
+
+			/* The remainder goes in the register after the
+			 * quotient. */
+			if (common.opcode == BRW_OPCODE_MATH &&
+			    common.math_function == BRW_MATH_FUNCTION_INT_DIV_QUOTIENT_AND_REMAINDER)
+				last++;
+		} else {
+			continue;
+		}
+
+		writes = first < end && start < last;
+	}
+
+	put_decoded_kernel(k);
+
+	return writes;
+}
+
+/* Place the labels of the JMPIs that land on the instruction at ip. */
+static void
+place_jump_targets(struct kir_program *prog, uint32_t ip)
+{
+	struct kir_insn **link = &prog->jump_targets, *label;
+
+	while (*link) {
+		label = *link;
+		if (label->label.ip == ip) {
+			*link = label->label.next;
+			kir_program_place_label(prog, label);
+		} else {
+			link = &label->label.next;
+		}
+	}
+}
+
+void
+kir_program_emit_shader(struct kir_program *prog, uint64_t kernel_offset)
+{
+	struct decoded_kernel *k = get_decoded_kernel(kernel_offset);
+	bool eot = false;
+
+	for (uint32_t i = 0; i < k->count && !eot; i++) {
+		place_jump_targets(prog, k->offsets[i]);
+
+		if (trace_mask & TRACE_EU) {
+			fprintf(trace_file, "%04x  ", k->offsets[i]);
+			brw_disassemble_inst(trace_file, &ksim_devinfo, &k->insns[i], false);
+		}
+
+		prog->ip = k->offsets[i + 1];
+		eot = do_compile_inst(prog, &k->insns[i]);
+	}
 
-		if (trace_mask & TRACE_EU)
-			brw_disassemble_inst(trace_file, &ksim_devinfo, insn, false);
+	put_decoded_kernel(k);
 
-		eot = do_compile_inst(prog, insn);
-	} while (!eot);
+	if (prog->jump_targets)
+		stub("JMPI past the end of the kernel");
 
 	if (trace_mask & (TRACE_EU | TRACE_AVX))
 		fprintf(trace_file, "\n");
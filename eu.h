@@ -196,6 +196,9 @@ enum brw_math_function {
 #define BRW_ALIGN_1   0
 #define BRW_ALIGN_16  1
 
+#define BRW_PREDICATE_NONE    0
+#define BRW_PREDICATE_NORMAL  1
+
 #define BRW_ADDRESS_DIRECT                        0
 #define BRW_ADDRESS_REGISTER_INDIRECT_REGISTER    1
 
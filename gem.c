@@ -39,6 +39,8 @@
 #include <error.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/prctl.h>
 
 #include "drm_uapi/i915_drm.h"
@@ -72,6 +74,10 @@ struct stub_bo {
 	uint32_t stride; /* tiling in lower 2 bits */
 	void *map;
 	uint32_t kernel_handle;
+
+	/* Seqno and ring of the last batch referencing the bo. */
+	uint64_t seqno;
+	uint32_t ring;
 };
 
 struct gtt_entry {
@@ -136,6 +142,7 @@ create_bo(uint64_t size)
 	bo->gtt_offset = NOT_BOUND;
 	bo->size = size;
 	bo->stride = 0;
+	bo->seqno = 0;
 
 	return bo;
 }
@@ -193,10 +200,155 @@ map_gtt_offset(uint64_t offset, uint64_t *range)
 	return bo->map + (offset - bo->gtt_offset);
 }
 
+/* With threads enabled, execbuffer only queues the batch and a GPU
+ * thread runs the batches in submission order. Each batch gets a seqno
+ * and every bo in the execbuffer is marked with the seqno of the last
+ * batch that references it, so the bo is busy until that batch
+ * completes. Only one application thread submits and waits. */
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t submit_cond;
+	pthread_cond_t complete_cond;
+	pthread_t thread;
+	bool started;
+
+	struct {
+		uint64_t address;
+		uint32_t ring;
+	} queue[64];
+	uint64_t submitted;
+	uint64_t completed;
+} gpu = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.submit_cond = PTHREAD_COND_INITIALIZER,
+	.complete_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+gpu_thread_main(void *arg)
+{
+	uint64_t seqno, address;
+	uint32_t ring;
+
+	pthread_mutex_lock(&gpu.mutex);
+	while (true) {
+		while (gpu.completed == gpu.submitted)
+			pthread_cond_wait(&gpu.submit_cond, &gpu.mutex);
+
+		seqno = gpu.completed + 1;
+		address = gpu.queue[seqno & (ARRAY_LENGTH(gpu.queue) - 1)].address;
+		ring = gpu.queue[seqno & (ARRAY_LENGTH(gpu.queue) - 1)].ring;
+		pthread_mutex_unlock(&gpu.mutex);
+
+		start_batch_buffer(address, ring);
+
+		pthread_mutex_lock(&gpu.mutex);
+		gpu.completed = seqno;
+		pthread_cond_broadcast(&gpu.complete_cond);
+	}
+
+	return NULL;
+}
+
+static void
+submit_batch(uint64_t address, uint32_t ring)
+{
+	if (!use_threads) {
+		start_batch_buffer(address, ring);
+		gpu.submitted++;
+		gpu.completed = gpu.submitted;
+		return;
+	}
+
+	pthread_mutex_lock(&gpu.mutex);
+
+	if (!gpu.started) {
+		int ret = pthread_create(&gpu.thread, NULL, gpu_thread_main, NULL);
+		ksim_assert(ret == 0);
+		gpu.started = true;
+	}
+
+	while (gpu.submitted - gpu.completed == ARRAY_LENGTH(gpu.queue))
+		pthread_cond_wait(&gpu.complete_cond, &gpu.mutex);
+
+	gpu.submitted++;
+	gpu.queue[gpu.submitted & (ARRAY_LENGTH(gpu.queue) - 1)].address = address;
+	gpu.queue[gpu.submitted & (ARRAY_LENGTH(gpu.queue) - 1)].ring = ring;
+	pthread_cond_signal(&gpu.submit_cond);
+
+	pthread_mutex_unlock(&gpu.mutex);
+}
+
+static bool
+bo_busy(struct stub_bo *bo)
+{
+	return bo->seqno > __atomic_load_n(&gpu.completed, __ATOMIC_ACQUIRE);
+}
+
+/* Wait for the last batch referencing bo to complete. A negative
+ * timeout waits forever. Returns false on timeout and updates
+ * timeout_ns with the remaining time. */
+static bool
+wait_bo(struct stub_bo *bo, int64_t *timeout_ns)
+{
+	struct timespec now, deadline;
+	int ret = 0;
+
+	if (!bo_busy(bo))
+		return true;
+
+	if (timeout_ns && *timeout_ns == 0)
+		return false;
+
+	if (timeout_ns && *timeout_ns > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += *timeout_ns / 1000000000;
+		deadline.tv_nsec += *timeout_ns % 1000000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	trace(TRACE_GEM, "waiting for bo %d, seqno %ld\n",
+	      get_handle(bo), bo->seqno);
+
+	pthread_mutex_lock(&gpu.mutex);
+	while (gpu.completed < bo->seqno && ret == 0) {
+		if (timeout_ns && *timeout_ns > 0)
+			ret = pthread_cond_timedwait(&gpu.complete_cond,
+						     &gpu.mutex, &deadline);
+		else
+			pthread_cond_wait(&gpu.complete_cond, &gpu.mutex);
+	}
+	pthread_mutex_unlock(&gpu.mutex);
+
+	if (timeout_ns && *timeout_ns > 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		*timeout_ns = (deadline.tv_sec - now.tv_sec) * 1000000000 +
+			deadline.tv_nsec - now.tv_nsec;
+		if (*timeout_ns < 0 || ret != 0)
+			*timeout_ns = 0;
+	}
+
+	return ret == 0;
+}
+
+static void
+wait_idle(void)
+{
+	pthread_mutex_lock(&gpu.mutex);
+	while (gpu.completed < gpu.submitted)
+		pthread_cond_wait(&gpu.complete_cond, &gpu.mutex);
+	pthread_mutex_unlock(&gpu.mutex);
+}
 
 static void
 close_bo(struct stub_bo *bo)
 {
+	wait_bo(bo, NULL);
+
 	free_range(bo->offset, bo->size);
 
 	if (bo->kernel_handle) {
@@ -521,6 +673,9 @@ dispatch_execbuffer2(int fd, unsigned long request,
 	if (all_matches && (execbuffer2->flags & I915_EXEC_NO_RELOC))
 		/* can skip relocs */;
 
+	const uint64_t seqno = gpu.submitted + 1;
+	uint32_t ring = execbuffer2->flags & I915_EXEC_RING_MASK;
+
 	for (uint32_t i = 0; i < count; i++) {
 		struct stub_bo *bo = get_bo(buffers[i].handle);
 		struct drm_i915_gem_relocation_entry *relocs =
@@ -544,12 +699,17 @@ dispatch_execbuffer2(int fd, unsigned long request,
 			ksim_assert(relocs[j].offset + sizeof(*dst) <= bo->size);
 
 			dst = bo->map + relocs[j].offset;
-			if (relocs[j].presumed_offset != target->gtt_offset)
+			if (relocs[j].presumed_offset != target->gtt_offset) {
+				/* Don't patch a batch that's still queued. */
+				wait_bo(bo, NULL);
 				*dst = target->gtt_offset + relocs[j].delta;
+			}
 		}
+
+		bo->seqno = seqno;
+		bo->ring = ring;
 	}
 
-	uint32_t ring = execbuffer2->flags & I915_EXEC_RING_MASK;
 	switch (ring) {
 	case I915_EXEC_RENDER:
 	case I915_EXEC_BLT:
@@ -561,7 +721,56 @@ dispatch_execbuffer2(int fd, unsigned long request,
 	struct stub_bo *bo = get_bo(buffers[count - 1].handle);
 	ksim_assert(bo != NULL);
 	uint64_t offset = bo->gtt_offset + execbuffer2->batch_start_offset;
-	start_batch_buffer(offset, ring);
+	submit_batch(offset, ring);
+
+	return 0;
+}
+
+static int
+dispatch_busy(int fd, unsigned long request,
+	      struct drm_i915_gem_busy *busy)
+{
+	struct stub_bo *bo = get_bo(busy->handle);
+
+	trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_BUSY\n");
+
+	if (bo == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* High word is the mask of engines reading, low word the
+	 * engine writing. We don't track reads and writes
+	 * separately. */
+	if (bo_busy(bo))
+		busy->busy = (1 << (16 + bo->ring)) | bo->ring;
+	else
+		busy->busy = 0;
+
+	return 0;
+}
+
+static int
+dispatch_wait(int fd, unsigned long request,
+	      struct drm_i915_gem_wait *wait)
+{
+	struct stub_bo *bo = get_bo(wait->bo_handle);
+
+	trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_WAIT\n");
+
+	if (bo == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	int64_t timeout_ns = wait->timeout_ns;
+	bool idle = wait_bo(bo, &timeout_ns);
+
+	wait->timeout_ns = timeout_ns;
+	if (!idle) {
+		errno = ETIME;
+		return -1;
+	}
 
 	return 0;
 }
@@ -604,6 +813,8 @@ dispatch_pread(int fd, unsigned long request,
 
 	trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_PREAD\n");
 
+	wait_bo(bo, NULL);
+
 	/* Check for integer overflow */
 	ksim_assert(gem_pread->offset + gem_pread->size > gem_pread->offset);
 	ksim_assert(gem_pread->offset + gem_pread->size <= bo->size);
@@ -631,6 +842,8 @@ dispatch_pwrite(int fd, unsigned long request,
 	ksim_assert(gem_pwrite->offset + gem_pwrite->size > gem_pwrite->offset);
 	ksim_assert(gem_pwrite->offset + gem_pwrite->size <= bo->size);
 
+	wait_bo(bo, NULL);
+
 	return pwrite(memfd, (void *) (uintptr_t) gem_pwrite->data_ptr,
 		      gem_pwrite->size, bo->offset + gem_pwrite->offset);
 }
@@ -704,7 +917,18 @@ static int
 dispatch_set_domain(int fd, unsigned long request,
 		    struct drm_i915_gem_set_domain *set_domain)
 {
+	struct stub_bo *bo = get_bo(set_domain->handle);
+
 	trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_SET_DOMAIN\n");
+
+	if (bo == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Moving to the CPU or GTT domain waits for rendering. */
+	wait_bo(bo, NULL);
+
 	return 0;
 }
 
@@ -926,8 +1150,7 @@ ioctl(int fd, unsigned long request, ...)
 		return dispatch_execbuffer2(fd, request, argp);
 
 	case DRM_IOCTL_I915_GEM_BUSY:
-		trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_BUSY\n");
-		return 0;
+		return dispatch_busy(fd, request, argp);
 
 	case DRM_IOCTL_I915_GEM_SET_CACHING:
 		trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_SET_CACHING\n");
@@ -979,8 +1202,7 @@ ioctl(int fd, unsigned long request, ...)
 		return 0;
 
 	case DRM_IOCTL_I915_GEM_WAIT:
-		trace(TRACE_GEM, "DRM_IOCTL_I915_GEM_WAIT\n");
-		return 0;
+		return dispatch_wait(fd, request, argp);
 
 	case DRM_IOCTL_I915_GEM_CONTEXT_CREATE: {
 		struct drm_i915_gem_context_create *gem_context_create = argp;
@@ -1088,6 +1310,12 @@ uint32_t breakpoint_mask = 0;
 FILE *trace_file;
 char *framebuffer_filename;
 bool use_threads;
+uint32_t thread_count;
+char *shader_cache_dir;
+bool bake_constants;
+uint32_t tier_threshold;
+bool use_perf_map;
+bool use_jitdump;
 
 static const struct { const char *name; uint32_t flag; } debug_tags[] = {
 	{ "debug",	TRACE_DEBUG },
@@ -1178,6 +1406,21 @@ ksim_stub_init(void)
 		} else if (is_prefix(s, "breakpoint", &value)) {
 			breakpoint_mask = parse_trace_flags(value);
 			trace_mask |= breakpoint_mask;
+		} else if (is_prefix(s, "threads", &value)) {
+			use_threads = true;
+			if (value)
+				thread_count = strtol(value, NULL, 0);
+		} else if (is_prefix(s, "cache", &value)) {
+			ksim_assert(value != NULL);
+			shader_cache_dir = strndup(value, end - value);
+		} else if (is_prefix(s, "bake-constants", NULL)) {
+			bake_constants = true;
+		} else if (is_prefix(s, "tiered", &value)) {
+			tier_threshold = value ? strtol(value, NULL, 0) : 1000;
+		} else if (is_prefix(s, "perf-map", NULL)) {
+			use_perf_map = true;
+		} else if (is_prefix(s, "jitdump", NULL)) {
+			use_jitdump = true;
 		}
 	}
 
@@ -1194,3 +1437,12 @@ ksim_stub_init(void)
 	if (trace_file == NULL)
 		trace_file = stdout;
 }
+
+__attribute__ ((destructor)) static void
+ksim_stub_fini(void)
+{
+	/* Let queued batches finish, so the framebuffer dump and
+	 * statistics are complete. */
+	if (gpu.started)
+		wait_idle();
+}
@@ -36,10 +36,20 @@ void
 compile_gs(void)
 {
 	struct kir_program prog;
+	struct shader_key key;
 
 	if (!gt.gs.enable)
 		return;
 
+	shader_key_init(&key, SHADER_GS);
+	shader_key_add_value(&key, gt.gs.binding_table_address);
+	shader_key_add_value(&key, gt.gs.sampler_state_address);
+	add_constants_key(&key, &gt.gs.curbe, gt.gs.urb_start_grf);
+	shader_key_add_kernel(&key, gt.gs.ksp);
+	gt.gs.avx_shader = shader_cache_lookup(&key);
+	if (gt.gs.avx_shader)
+		return;
+
 	ksim_trace(TRACE_EU | TRACE_AVX, "jit gs\n");
 
 	kir_program_init(&prog,
@@ -53,7 +63,7 @@ compile_gs(void)
 
 	kir_program_add_insn(&prog, kir_eot);
 
-	gt.gs.avx_shader = kir_program_finish(&prog);
+	gt.gs.avx_shader = shader_cache_add(kir_program_finish(&prog));
 }
 
 static void
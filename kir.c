@@ -27,12 +27,86 @@
 #include "avx-builder.h"
 #include "kir.h"
 
-struct kir_insn *
-kir_insn_create(uint32_t opcode, struct kir_reg dst, struct list *other)
+static const struct kir_reg void_reg = { };
+
+struct kir_arena {
+	struct kir_arena *next;
+	size_t used, size;
+	uint8_t data[] __attribute__((aligned(16)));
+};
+
+#define KIR_ARENA_BLOCK_SIZE (64 * 1024)
+
+static struct kir_arena *
+kir_arena_create(size_t size)
+{
+	struct kir_arena *arena = malloc(sizeof(*arena) + size);
+
+	ksim_assert(arena != NULL);
+	arena->used = 0;
+	arena->size = size;
+
+	return arena;
+}
+
+static void *
+kir_program_alloc(struct kir_program *prog, size_t size)
+{
+	struct kir_arena *arena = prog->arena;
+
+	size = align_u64(size, 16);
+	if (size > KIR_ARENA_BLOCK_SIZE / 4) {
+		/* Big tables get a block of their own behind the
+		 * current one, so we don't waste what's left of it. */
+		arena = kir_arena_create(size);
+		arena->used = size;
+		if (prog->arena) {
+			arena->next = prog->arena->next;
+			prog->arena->next = arena;
+		} else {
+			arena->next = NULL;
+			prog->arena = arena;
+		}
+		return arena->data;
+	}
+
+	if (arena == NULL || arena->used + size > arena->size) {
+		arena = kir_arena_create(KIR_ARENA_BLOCK_SIZE);
+		arena->next = prog->arena;
+		prog->arena = arena;
+	}
+
+	void *p = arena->data + arena->used;
+	arena->used += size;
+
+	return p;
+}
+
+static void *
+kir_program_zalloc(struct kir_program *prog, size_t size)
+{
+	return memset(kir_program_alloc(prog, size), 0, size);
+}
+
+static void
+kir_program_free_arena(struct kir_program *prog)
+{
+	struct kir_arena *arena, *next;
+
+	for (arena = prog->arena; arena; arena = next) {
+		next = arena->next;
+		free(arena);
+	}
+	prog->arena = NULL;
+}
+
+static struct kir_insn *
+kir_insn_create(struct kir_program *prog, uint32_t opcode,
+		struct kir_reg dst, struct list *other)
 {
 	struct kir_insn *insn;
 
-	insn = malloc(sizeof(*insn));
+	insn = kir_program_alloc(prog, sizeof(*insn));
 	insn->opcode = opcode;
 	insn->dst = dst;
 	if (other)
@@ -45,33 +119,236 @@ struct kir_insn *
 kir_program_add_insn(struct kir_program *prog, uint32_t opcode)
 {
 	struct kir_reg dst = kir_reg(prog->next_reg.n++);
-	struct kir_insn *insn = kir_insn_create(opcode, dst, prog->insns.prev);
+	struct kir_insn *insn = kir_insn_create(prog, opcode, dst, prog->insns.prev);
 
 	prog->dst = dst;
 	insn->scope = prog->scope;
 	insn->quarter = prog->quarter;
 
+	switch (opcode) {
+	case kir_set_load_base_indirect:
+	case kir_set_load_base_imm:
+	case kir_set_load_base_imm_offset:
+	case kir_send:
+	case kir_const_send:
+	case kir_call:
+	case kir_const_call:
+	case kir_branch:
+	case kir_eot_if_dead:
+		/* These all overwrite rax. */
+		prog->load_base_address = 0;
+		break;
+	default:
+		break;
+	}
+
+	if (dst.n >= prog->defs_size) {
+		uint32_t size = prog->defs_size * 2;
+		while (size <= dst.n)
+			size *= 2;
+		struct kir_insn **defs =
+			kir_program_zalloc(prog, size * sizeof(prog->defs[0]));
+		memcpy(defs, prog->defs, prog->defs_size * sizeof(prog->defs[0]));
+		prog->defs = defs;
+		prog->defs_size = size;
+	}
+	prog->defs[dst.n] = insn;
+
 	return insn;
 }
 
+/* The value of lane of reg, if it's an immediate. */
+static bool
+get_lane_constant(struct kir_program *prog, struct kir_reg reg,
+		  uint32_t lane, uint32_t *value)
+{
+	struct kir_insn *def;
+
+	if (reg.n >= prog->defs_size || prog->defs[reg.n] == NULL)
+		return false;
+
+	def = prog->defs[reg.n];
+	switch (def->opcode) {
+	case kir_immd:
+		*value = def->imm.d;
+		return true;
+	case kir_immvf:
+		*value = float_to_u32(def->imm.vf[lane & 3]);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline uint32_t
+region_lane_offset(const struct eu_region *region, uint32_t lane)
+{
+	uint32_t x = lane % region->width, y = lane / region->width;
+
+	return region->offset +
+		(x * region->hstride + y * region->vstride) * region->type_size;
+}
+
+static void
+region_extent(const struct eu_region *region, uint32_t *start, uint32_t *end)
+{
+	*start = ~0;
+	*end = 0;
+	for (uint32_t i = 0; i < region->exec_size; i++) {
+		uint32_t offset = region_lane_offset(region, i);
+
+		if (offset < *start)
+			*start = offset;
+		if (offset + region->type_size > *end)
+			*end = offset + region->type_size;
+	}
+}
+
+static void
+update_constants(struct kir_program *prog, const struct eu_region *region,
+		 struct kir_reg src, bool masked)
+{
+	for (uint32_t i = 0; i < region->exec_size; i++) {
+		uint32_t offset = region_lane_offset(region, i);
+		uint32_t grf = offset / 32, dw = (offset & 31) / 4;
+		uint32_t value;
+
+		if (grf >= ARRAY_LENGTH(prog->grf_known))
+			continue;
+
+		/* A masked store only keeps what we know if it
+		 * writes the same value. */
+		if (region->type_size == 4 && (offset & 3) == 0 &&
+		    get_lane_constant(prog, src, i, &value) &&
+		    (!masked || ((prog->grf_known[grf] & (1 << dw)) &&
+				 prog->grf_value[grf][dw] == value))) {
+			prog->grf_known[grf] |= 1 << dw;
+			prog->grf_value[grf][dw] = value;
+		} else {
+			prog->grf_known[grf] &= ~(1 << dw);
+			dw = ((offset + region->type_size - 1) & 31) / 4;
+			prog->grf_known[grf] &= ~(1 << dw);
+		}
+	}
+}
+
+/* Returns true if all dwords the region reads hold the same known
+ * value. */
+static bool
+region_is_constant(struct kir_program *prog, const struct eu_region *region,
+		   uint32_t *value)
+{
+	if (region->type_size != 4)
+		return false;
+
+	for (uint32_t i = 0; i < region->exec_size; i++) {
+		uint32_t offset = region_lane_offset(region, i);
+		uint32_t grf = offset / 32, dw = (offset & 31) / 4;
+
+		if (grf >= ARRAY_LENGTH(prog->grf_known) || (offset & 3) ||
+		    !(prog->grf_known[grf] & (1 << dw)))
+			return false;
+		if (i > 0 && prog->grf_value[grf][dw] != *value)
+			return false;
+		*value = prog->grf_value[grf][dw];
+	}
+
+	return true;
+}
+
+bool
+kir_program_get_region_constant(struct kir_program *prog,
+				const struct eu_region *region, uint32_t *value)
+{
+	return region_is_constant(prog, region, value);
+}
+
+bool
+kir_program_get_constant(struct kir_program *prog, uint32_t grf, uint32_t *value)
+{
+	const struct eu_region region = {
+		.offset = grf * 32,
+		.type_size = 4,
+		.exec_size = 8,
+		.vstride = 8,
+		.width = 8,
+		.hstride = 1
+	};
+
+	return region_is_constant(prog, &region, value);
+}
+
+void
+kir_program_set_constant(struct kir_program *prog, uint32_t grf, const uint32_t *values)
+{
+	ksim_assert(grf < ARRAY_LENGTH(prog->grf_known));
+
+	prog->grf_known[grf] = 0xff;
+	memcpy(prog->grf_value[grf], values, sizeof(prog->grf_value[grf]));
+}
+
+static void
+forget_constants(struct kir_program *prog)
+{
+	memset(prog->grf_known, 0, sizeof(prog->grf_known));
+	memset(prog->imm_cache, 0, sizeof(prog->imm_cache));
+	prog->load_base_address = 0;
+}
+
+struct kir_reg
+kir_program_imm(struct kir_program *prog, enum kir_opcode opcode, union kir_imm imm)
+{
+	const size_t size = opcode == kir_immv || opcode == kir_immvf ?
+		sizeof(imm) : sizeof(imm.d);
+	struct kir_insn *insn;
+
+	for (uint32_t i = 0; i < ARRAY_LENGTH(prog->imm_cache); i++) {
+		insn = prog->imm_cache[i];
+		if (insn && insn->opcode == opcode &&
+		    memcmp(&insn->imm, &imm, size) == 0) {
+			prog->dst = insn->dst;
+			return insn->dst;
+		}
+	}
+
+	insn = kir_program_add_insn(prog, opcode);
+	insn->imm = imm;
+
+	prog->imm_cache[prog->imm_next++ % ARRAY_LENGTH(prog->imm_cache)] = insn;
+
+	return insn->dst;
+}
+
 void
 kir_program_comment(struct kir_program *prog, const char *fmt, ...)
 {
 	struct kir_insn *insn = kir_program_add_insn(prog, kir_comment);
 
-	va_list va;
+	va_list va, copy;
+	int length;
 
 	va_start(va, fmt);
-	vasprintf(&insn->comment, fmt, va);
+	va_copy(copy, va);
+	length = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+	insn->comment = kir_program_alloc(prog, length + 1);
+	vsnprintf(insn->comment, length + 1, fmt, va);
 	va_end(va);
 }
 
 struct kir_reg
 kir_program_load_region(struct kir_program *prog, const struct eu_region *region)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_load_region);
+	struct kir_insn *insn;
+	uint32_t value;
+
+	if (region_is_constant(prog, region, &value))
+		return kir_program_immd(prog, value);
+
+	insn = kir_program_add_insn(prog, kir_load_region);
 
 	insn->xfer.region = *region;
+	insn->xfer.fold = false;
 
 	return insn->dst;
 }
@@ -85,6 +362,8 @@ kir_program_store_region_mask(struct kir_program *prog, const struct eu_region *
 	insn->xfer.region = *region;
 	insn->xfer.src = src;
 	insn->xfer.mask = mask;
+
+	update_constants(prog, region, src, true);
 }
 
 void
@@ -94,6 +373,8 @@ kir_program_store_region(struct kir_program *prog, const struct eu_region *regio
 
 	insn->xfer.region = *region;
 	insn->xfer.src = src;
+
+	update_constants(prog, region, src, false);
 }
 
 struct kir_reg
@@ -125,6 +406,10 @@ __kir_program_send(struct kir_program *prog, struct inst *inst,
 	insn->send.rlen = send.rlen;
 	insn->send.func = func;
 	insn->send.args = args;
+
+	for (uint32_t i = insn->send.dst;
+	     i < insn->send.dst + send.rlen && i < ARRAY_LENGTH(prog->grf_known); i++)
+		prog->grf_known[i] = 0;
 }
 
 struct kir_reg
@@ -189,21 +474,35 @@ kir_program_set_load_base_indirect(struct kir_program *prog, uint32_t offset)
 }
 
 struct kir_reg
-kir_program_set_load_base_imm(struct kir_program *prog, void *pointer)
+kir_program_set_load_base_imm(struct kir_program *prog, uint64_t address)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_set_load_base_imm);
+	struct kir_insn *insn;
+	uint64_t range;
+
+	/* Reuse the base if nothing touched rax since we set it. */
+	if (address != 0 && address == prog->load_base_address) {
+		prog->dst = prog->load_base;
+		return prog->load_base;
+	}
 
-	insn->set_load_base.pointer = pointer;
+	insn = kir_program_add_insn(prog, kir_set_load_base_imm);
+	insn->set_load_base.pointer = map_gtt_offset(address, &range);
+	insn->set_load_base.address = address;
+
+	prog->load_base_address = address;
+	prog->load_base = insn->dst;
 
 	return insn->dst;
 }
 
 struct kir_reg
-kir_program_set_load_base_imm_offset(struct kir_program *prog, void *pointer, struct kir_reg src)
+kir_program_set_load_base_imm_offset(struct kir_program *prog, uint64_t address, struct kir_reg src)
 {
 	struct kir_insn *insn = kir_program_add_insn(prog, kir_set_load_base_imm_offset);
+	uint64_t range;
 
-	insn->set_load_base.pointer = pointer;
+	insn->set_load_base.pointer = map_gtt_offset(address, &range);
+	insn->set_load_base.address = address;
 	insn->set_load_base.src = src;
 
 	return insn->dst;
@@ -233,6 +532,53 @@ kir_program_mask_store(struct kir_program *prog,
 	insn->store.mask = mask;
 }
 
+struct kir_insn *
+kir_program_create_label(struct kir_program *prog)
+{
+	struct kir_insn *label =
+		kir_insn_create(prog, kir_label, kir_reg(prog->next_reg.n++), NULL);
+
+	label->label.ip = 0;
+	label->label.next = NULL;
+	label->label.pc = NULL;
+	label->label.branches = NULL;
+
+	return label;
+}
+
+/* Labels are created before they're placed so that forward branches
+ * have something to refer to. */
+void
+kir_program_place_label(struct kir_program *prog, struct kir_insn *label)
+{
+	label->scope = prog->scope;
+	label->quarter = prog->quarter;
+	list_insert(prog->insns.prev, &label->link);
+
+	/* Other paths get here too. */
+	forget_constants(prog);
+}
+
+void
+kir_program_branch(struct kir_program *prog, struct kir_reg src,
+		   uint32_t test, bool if_empty, struct kir_insn *label)
+{
+	struct kir_insn *insn = kir_program_add_insn(prog, kir_branch);
+
+	insn->branch.src = src;
+	insn->branch.test = test;
+	insn->branch.if_empty = if_empty;
+	insn->branch.label = label;
+	insn->branch.pc = NULL;
+	insn->branch.next = NULL;
+}
+
+void
+kir_program_jump(struct kir_program *prog, struct kir_insn *label)
+{
+	kir_program_branch(prog, void_reg, 0, false, label);
+}
+
 static char *
 format_region(char *buf, int len, struct eu_region *region)
 {
@@ -425,6 +771,10 @@ kir_insn_format(struct kir_insn *insn, char *buf, size_t size)
 		snprintf(buf, size, "r%-3d = shli r%d, %d", insn->dst.n,
 			 insn->alu.src0.n, insn->alu.imm1);
 		break;
+	case kir_asri:
+		snprintf(buf, size, "r%-3d = asri r%d, %d", insn->dst.n,
+			 insn->alu.src0.n, insn->alu.imm1);
+		break;
 	case kir_shl:
 		snprintf(buf, size, "r%-3d = shl r%d, r%d", insn->dst.n,
 			 insn->alu.src0.n, insn->alu.src1.n);
@@ -560,6 +910,19 @@ kir_insn_format(struct kir_insn *insn, char *buf, size_t size)
 			 insn->gather.base_offset,
 			 insn->gather.offset.n, insn->gather.base.n, insn->gather.scale);
 		break;
+	case kir_label:
+		snprintf(buf, size, "L%d:", insn->dst.n);
+		break;
+	case kir_branch:
+		if (insn->branch.test == 0)
+			snprintf(buf, size, "       jump L%d",
+				 insn->branch.label->dst.n);
+		else
+			snprintf(buf, size, "       branch_if_%s r%d & 0x%x, L%d",
+				 insn->branch.if_empty ? "empty" : "any",
+				 insn->branch.src.n, insn->branch.test,
+				 insn->branch.label->dst.n);
+		break;
 	case kir_eot:
 		snprintf(buf, size, "       eot");
 		break;
@@ -667,10 +1030,8 @@ kir_program_compute_live_ranges(struct kir_program *prog)
 	uint32_t region_map[512];
 	int count = prog->next_reg.n;
 
-	live_regs = malloc(count * sizeof(live_regs[0]));
-	memset(live_regs, 0, count * sizeof(live_regs[0]));
-	range = malloc(count * sizeof(range[0]));
-	memset(range, 0, count * sizeof(range[0]));
+	live_regs = kir_program_zalloc(prog, count * sizeof(live_regs[0]));
+	range = kir_program_zalloc(prog, count * sizeof(range[0]));
 	memset(region_map, 0, 512 * sizeof(region_map[0]));
 
 	/* Initialize URB buffer live if we have one. URB offset
@@ -793,6 +1154,7 @@ kir_program_compute_live_ranges(struct kir_program *prog)
 		case kir_rndz:
 		case kir_shri:
 		case kir_shli:
+		case kir_asri:
 			live = live_regs[insn->dst.n];
 			set_live(insn->alu.src0, live, insn, range, live_regs);
 			break;
@@ -850,6 +1212,16 @@ kir_program_compute_live_ranges(struct kir_program *prog)
 			set_live(insn->gather.offset, live, insn, range, live_regs);
 			set_live(insn->gather.base, live, insn, range, live_regs);
 			break;
+		case kir_label:
+		case kir_branch:
+			/* We haven't scanned all the code that can run
+			 * after a branch or before a label, so assume
+			 * the whole register file is live. */
+			memset(region_map, ~0, sizeof(region_map));
+			if (insn->opcode == kir_branch && insn->branch.test)
+				set_live(insn->branch.src, true, insn, range, live_regs);
+			range[insn->dst.n] = insn->dst.n + 1;
+			break;
 		case kir_eot:
 			range[insn->dst.n] = insn->dst.n + 1;
 			break;
@@ -865,8 +1237,6 @@ kir_program_compute_live_ranges(struct kir_program *prog)
 		insn = container_of(insn->link.prev, insn, link);
 	}
 
-	free(live_regs);
-
 	prog->live_ranges = range;
 }
 
@@ -876,6 +1246,87 @@ struct resident_region {
 	struct list link;
 };
 
+/* Does the region cover all of one register, in order? */
+static bool
+is_full_reg(const struct eu_region *region)
+{
+	return (region->offset & 31) == 0 &&
+		region->exec_size * region->type_size == 32 &&
+		region->hstride == 1 &&
+		(region->width == region->exec_size ||
+		 region->vstride == region->width);
+}
+
+/* Besides forwarding registers from stores to loads of the same
+ * region, we track registers that are plain copies of other
+ * registers, like the attribute setup copying g236 to g2. A later
+ * load from the copy, say g2.12<0,1,0>, then loads from the original
+ * instead, g236.12<0,1,0>, which often leaves the store to the copy
+ * dead. A write to a register bumps its version, which tells us
+ * whether the original is still unchanged. */
+struct copy_tracker {
+	uint32_t *version;	/* Per eu reg */
+	uint32_t *copy_of;	/* Per eu reg, original + 1 or 0 */
+	uint32_t *copy_version;	/* Version of the original when copied */
+	uint32_t *reg_src;	/* Per kir reg, loaded eu reg + 1 or 0 */
+	uint32_t *reg_version;
+};
+
+static void
+copy_tracker_write(struct copy_tracker *ct, uint32_t grf)
+{
+	ct->version[grf]++;
+	ct->copy_of[grf] = 0;
+}
+
+static void
+copy_tracker_forward_load(struct copy_tracker *ct, struct kir_insn *insn)
+{
+	struct eu_region *region = &insn->xfer.region;
+	const uint32_t grf = region->offset / 32;
+	uint32_t start, end, src;
+
+	region_extent(region, &start, &end);
+	if (start / 32 == grf && (end - 1) / 32 == grf && ct->copy_of[grf] &&
+	    ct->version[ct->copy_of[grf] - 1] == ct->copy_version[grf]) {
+		src = ct->copy_of[grf] - 1;
+		region->offset = src * 32 + (region->offset & 31);
+	}
+}
+
+static void
+copy_tracker_load(struct copy_tracker *ct, struct kir_insn *insn)
+{
+	const uint32_t grf = insn->xfer.region.offset / 32;
+
+	if (is_full_reg(&insn->xfer.region)) {
+		ct->reg_src[insn->dst.n] = grf + 1;
+		ct->reg_version[insn->dst.n] = ct->version[grf];
+	}
+}
+
+static void
+copy_tracker_store(struct copy_tracker *ct, struct kir_insn *insn)
+{
+	const uint32_t grf = insn->xfer.region.offset / 32;
+	const uint32_t src_reg = insn->xfer.src.n;
+	uint32_t start, end;
+
+	region_extent(&insn->xfer.region, &start, &end);
+	for (uint32_t i = start / 32; i <= (end - 1) / 32; i++)
+		copy_tracker_write(ct, i);
+
+	if (insn->opcode == kir_store_region &&
+	    is_full_reg(&insn->xfer.region) && ct->reg_src[src_reg]) {
+		const uint32_t src = ct->reg_src[src_reg] - 1;
+
+		if (src != grf && ct->version[src] == ct->reg_version[src_reg]) {
+			ct->copy_of[grf] = src + 1;
+			ct->copy_version[grf] = ct->version[src];
+		}
+	}
+}
+
 void
 kir_program_copy_propagation(struct kir_program *prog)
 {
@@ -883,30 +1334,41 @@ kir_program_copy_propagation(struct kir_program *prog)
 	struct resident_region *rr, *next, *rr_pool;
 	int count = prog->next_reg.n, rr_pool_next;
 	struct kir_reg *remap;
+	struct copy_tracker ct;
 
-	remap = malloc(count * sizeof(remap[0]));
+	remap = kir_program_alloc(prog, count * sizeof(remap[0]));
 	for (uint32_t i = 0; i < count; i++)
 		remap[i] = kir_reg(i);
 
-	/* We allocate these up front instead a malloc call per
-	 * insn. More efficient and they're easier to clean up. Each
-	 * insn allocates at most 1 so we won't need more than count. */
-	rr_pool = malloc(count * sizeof(rr_pool[0]));
+	/* We allocate these up front instead of one allocation per
+	 * insn. Each insn allocates at most 1 so we won't need more
+	 * than count. */
+	rr_pool = kir_program_alloc(prog, count * sizeof(rr_pool[0]));
 	rr_pool_next = 0;
 
-	const uint32_t max_eu_regs = 400;
+	const uint32_t max_eu_regs = 512;
 	struct list region_to_reg[max_eu_regs];
 	for (uint32_t i = 0; i < max_eu_regs; i++)
 		list_init(&region_to_reg[i]);
 
+	uint32_t ct_eu[3][max_eu_regs];
+	memset(ct_eu, 0, sizeof(ct_eu));
+	ct.version = ct_eu[0];
+	ct.copy_of = ct_eu[1];
+	ct.copy_version = ct_eu[2];
+	ct.reg_src = kir_program_zalloc(prog, count * sizeof(ct.reg_src[0]));
+	ct.reg_version = kir_program_alloc(prog, count * sizeof(ct.reg_version[0]));
+
 	list_for_each_entry(insn, &prog->insns, link) {
 		uint32_t mask[2];
 		switch (insn->opcode) {
 		case kir_comment:
 			break;
 		case kir_load_region: {
+			copy_tracker_forward_load(&ct, insn);
 			uint32_t grf = insn->xfer.region.offset / 32;
 			ksim_assert(grf < max_eu_regs);
+			copy_tracker_load(&ct, insn);
 			region_to_mask(&insn->xfer.region, mask);
 			list_for_each_entry(rr, &region_to_reg[grf], link) {
 				if (rr->mask[0] == mask[0] && rr->mask[1] == mask[1]) {
@@ -929,6 +1391,7 @@ kir_program_copy_propagation(struct kir_program *prog)
 
 			insn->xfer.src = remap[insn->xfer.src.n];
 			insn->xfer.mask = remap[insn->xfer.mask.n];
+			copy_tracker_store(&ct, insn);
 
 			ksim_assert(grf < max_eu_regs);
 			region_to_mask(&insn->xfer.region, mask);
@@ -946,6 +1409,7 @@ kir_program_copy_propagation(struct kir_program *prog)
 			uint32_t grf = insn->xfer.region.offset / 32;
 
 			insn->xfer.src = remap[insn->xfer.src.n];
+			copy_tracker_store(&ct, insn);
 
 			ksim_assert(grf < max_eu_regs);
 			region_to_mask(&insn->xfer.region, mask);
@@ -997,6 +1461,7 @@ kir_program_copy_propagation(struct kir_program *prog)
 				struct list *head = &region_to_reg[grf];
 				list_for_each_entry_safe(rr, next, head, link)
 					list_remove(&rr->link);
+				copy_tracker_write(&ct, grf);
 			}
 			break;
 		case kir_call:
@@ -1026,6 +1491,7 @@ kir_program_copy_propagation(struct kir_program *prog)
 		case kir_rndz:
 		case kir_shri:
 		case kir_shli:
+		case kir_asri:
 			insn->alu.src0 = remap[insn->alu.src0.n];
 			break;
 		case kir_and:
@@ -1080,6 +1546,20 @@ kir_program_copy_propagation(struct kir_program *prog)
 			insn->gather.offset = remap[insn->gather.offset.n];
 			insn->gather.base = remap[insn->gather.base.n];
 			break;
+		case kir_label:
+			/* Other paths may get here with different
+			 * values in the register file. Forgetting what
+			 * we know also guarantees that no register is
+			 * live across a label. */
+			for (uint32_t i = 0; i < max_eu_regs; i++) {
+				list_init(&region_to_reg[i]);
+				copy_tracker_write(&ct, i);
+			}
+			break;
+		case kir_branch:
+			if (insn->branch.test)
+				insn->branch.src = remap[insn->branch.src.n];
+			break;
 		case kir_eot:
 			break;
 		case kir_eot_if_dead:
@@ -1087,17 +1567,6 @@ kir_program_copy_propagation(struct kir_program *prog)
 			break;
 		}
 	}
-
-	free(remap);
-	free(rr_pool);
-}
-
-void
-kir_insn_destroy(struct kir_insn *insn)
-{
-	if (insn->opcode == kir_comment)
-		free(insn->comment);
-	free(insn);
 }
 
 void
@@ -1107,88 +1576,1086 @@ kir_program_dead_code_elimination(struct kir_program *prog)
 	uint32_t *range = prog->live_ranges;
 
 	list_for_each_entry_safe(insn, next, &prog->insns, link) {
-		if (insn->dst.n >= range[insn->dst.n]) {
+		if (insn->dst.n >= range[insn->dst.n])
 			list_remove(&insn->link);
-			kir_insn_destroy(insn);
-		}
 	}
 }
 
-struct bit_vector {
-	uint64_t bits[2];
-};
-
-static void
-bit_vector_init(struct bit_vector *v)
-{
-	v->bits[0] = ~0ul;
-	v->bits[1] = ~0ul;
-}
-
+/* Pointers to the register operands of insn. Returns the count. */
 static uint32_t
-bit_vector_alloc(struct bit_vector *v)
+kir_insn_srcs(struct kir_insn *insn, struct kir_reg **srcs)
 {
-	for (uint32_t i = 0; i < ARRAY_LENGTH(v->bits); i++) {
-		if (v->bits[i]) {
-			uint32_t b = __builtin_ffsl(v->bits[i]) - 1;
-			v->bits[i] &= ~(1ul << b);
-			return b + i * 64;
-		}
-	}
+	uint32_t n = 0;
 
-	ksim_unreachable();
-	return 0;
-}
+	switch (insn->opcode) {
+	case kir_store_region_mask:
+		srcs[n++] = &insn->xfer.src;
+		srcs[n++] = &insn->xfer.mask;
+		break;
+	case kir_store_region:
+		srcs[n++] = &insn->xfer.src;
+		break;
+	case kir_gather:
+		srcs[n++] = &insn->gather.mask;
+		srcs[n++] = &insn->gather.offset;
+		srcs[n++] = &insn->gather.base;
+		break;
+	case kir_set_load_base_imm_offset:
+		srcs[n++] = &insn->set_load_base.src;
+		break;
+	case kir_load:
+		srcs[n++] = &insn->load.base;
+		break;
+	case kir_mask_store:
+		srcs[n++] = &insn->store.src;
+		srcs[n++] = &insn->store.mask;
+		srcs[n++] = &insn->store.base;
+		break;
+	case kir_call:
+	case kir_const_call:
+		if (insn->call.args > 0)
+			srcs[n++] = &insn->call.src0;
+		if (insn->call.args > 1)
+			srcs[n++] = &insn->call.src1;
+		break;
+	case kir_zxwd ... kir_asri:
+		srcs[n++] = &insn->alu.src0;
+		break;
+	case kir_and ... kir_cmpgtd:
+		srcs[n++] = &insn->alu.src0;
+		srcs[n++] = &insn->alu.src1;
+		break;
+	case kir_nmaddf ... kir_blend:
+		srcs[n++] = &insn->alu.src0;
+		srcs[n++] = &insn->alu.src1;
+		srcs[n++] = &insn->alu.src2;
+		break;
+	case kir_branch:
+		if (insn->branch.test)
+			srcs[n++] = &insn->branch.src;
+		break;
+	case kir_eot_if_dead:
+		srcs[n++] = &insn->eot.src;
+		break;
+	default:
+		break;
+	}
 
-static void
-bit_vector_free(struct bit_vector *v, uint32_t b)
-{
-	ksim_assert((v->bits[b >> 6] & (1ul << (b & 63))) == 0);
-	v->bits[b >> 6] |= 1ul << (b & 63);
+	return n;
 }
 
-struct ra_state {
-	uint32_t *range;
-	uint32_t regs;
-	uint8_t *reg_to_avx;
-	struct kir_reg avx_to_reg[16];
-	struct bit_vector spill_slots;
-	uint32_t locked_regs;	/* Don't spill these */
-	uint32_t exclude_regs;	/* Don't allocate these */
+/* Uniform values are the same in all lanes: broadcast immediates,
+ * loads of scalar regions and lane-wise ops on uniform values. We
+ * only track dword values, word ops and conversions don't keep lanes
+ * lined up with dwords. A uniform op on immediates is folded into an
+ * immediate and a uniform op that repeats one from earlier in the
+ * block reuses its result. Most of those repeats come from SIMD16
+ * instructions with scalar operands, where both halves compute the
+ * same thing. */
+
+struct uniform_value {
+	uint32_t block;
+	uint32_t opcode;
+	uint32_t key[3];
+	void *func;
+	struct kir_reg reg;
+};
 
-	uint32_t next_reg;
-	uint32_t next_spill_reg;
+struct uniform_state {
+	struct kir_program *prog;
+	struct uniform_value *values;
+	uint32_t size;
+	uint32_t block;
+	bool *uniform;
+	bool *clobbered;
 };
 
-static const struct kir_reg void_reg = { };
+static bool
+region_is_uniform(const struct eu_region *region)
+{
+	if (region->type_size != 4)
+		return false;
+
+	for (uint32_t i = 1; i < region->exec_size; i++)
+		if (region_lane_offset(region, i) != region->offset)
+			return false;
+
+	return true;
+}
+
+static bool
+is_uniform_alu(enum kir_opcode opcode)
+{
+	switch (opcode) {
+	case kir_ps2d:
+	case kir_d2ps:
+	case kir_absd:
+	case kir_rcp:
+	case kir_sqrt:
+	case kir_rsqrt:
+	case kir_rndu:
+	case kir_rndd:
+	case kir_rnde:
+	case kir_rndz:
+	case kir_shri:
+	case kir_shli:
+	case kir_asri:
+	case kir_and:
+	case kir_andn:
+	case kir_or:
+	case kir_xor:
+	case kir_shr:
+	case kir_shl:
+	case kir_asr:
+	case kir_maxd:
+	case kir_maxud:
+	case kir_maxf:
+	case kir_mind:
+	case kir_minud:
+	case kir_minf:
+	case kir_divf:
+	case kir_addd:
+	case kir_addf:
+	case kir_subd:
+	case kir_subf:
+	case kir_muld:
+	case kir_mulf:
+	case kir_cmpf:
+	case kir_cmpeqd:
+	case kir_cmpgtd:
+	case kir_nmaddf:
+	case kir_maddf:
+	case kir_blend:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool
+get_immd(struct kir_program *prog, struct kir_reg reg, uint32_t *value)
+{
+	struct kir_insn *def;
+
+	if (reg.n >= prog->defs_size || prog->defs[reg.n] == NULL)
+		return false;
+
+	def = prog->defs[reg.n];
+	if (def->opcode != kir_immd)
+		return false;
+
+	*value = def->imm.d;
+
+	return true;
+}
+
+/* Evaluate insn at compile time if all its sources are immediates. */
+static bool
+fold_uniform(struct kir_program *prog, struct kir_insn *insn, uint32_t *value)
+{
+	uint32_t a, b, c;
+	uint32_t shift;
+
+	if (!get_immd(prog, insn->alu.src0, &a))
+		return false;
+
+	switch (insn->opcode) {
+	case kir_d2ps:
+		*value = float_to_u32((int32_t) a);
+		return true;
+	case kir_shli:
+	case kir_shri:
+	case kir_asri:
+		shift = insn->alu.imm1;
+		if (insn->opcode == kir_asri)
+			*value = (int32_t) a >> (shift < 32 ? shift : 31);
+		else if (shift >= 32)
+			*value = 0;
+		else if (insn->opcode == kir_shli)
+			*value = a << shift;
+		else
+			*value = a >> shift;
+		return true;
+	default:
+		break;
+	}
+
+	if (!get_immd(prog, insn->alu.src1, &b))
+		return false;
+
+	switch (insn->opcode) {
+	case kir_and:
+		*value = a & b;
+		return true;
+	case kir_andn:
+		*value = a & ~b;
+		return true;
+	case kir_or:
+		*value = a | b;
+		return true;
+	case kir_xor:
+		*value = a ^ b;
+		return true;
+	case kir_addd:
+		*value = a + b;
+		return true;
+	case kir_subd:
+		*value = a - b;
+		return true;
+	case kir_muld:
+		*value = a * b;
+		return true;
+	case kir_addf:
+		*value = float_to_u32(u32_to_float(a) + u32_to_float(b));
+		return true;
+	case kir_subf:
+		*value = float_to_u32(u32_to_float(a) - u32_to_float(b));
+		return true;
+	case kir_mulf:
+		*value = float_to_u32(u32_to_float(a) * u32_to_float(b));
+		return true;
+	case kir_maddf:
+	case kir_nmaddf:
+		if (!get_immd(prog, insn->alu.src2, &c))
+			return false;
+		if (insn->opcode == kir_maddf)
+			*value = float_to_u32(fmaf(u32_to_float(a), u32_to_float(b),
+						   u32_to_float(c)));
+		else
+			*value = float_to_u32(fmaf(-u32_to_float(a), u32_to_float(b),
+						   u32_to_float(c)));
+		return true;
+	default:
+		return false;
+	}
+}
+
+static struct uniform_value *
+lookup_uniform(struct uniform_state *us, struct kir_insn *insn)
+{
+	struct uniform_value v = {
+		.block = us->block,
+		.opcode = insn->opcode,
+		.reg = insn->dst
+	};
+	uint64_t hash;
+
+	struct kir_reg *srcs[3];
+	const uint32_t n = kir_insn_srcs(insn, srcs);
+
+	for (uint32_t i = 0; i < n; i++)
+		v.key[i] = srcs[i]->n;
+
+	switch (insn->opcode) {
+	case kir_immd:
+		v.key[0] = insn->imm.d;
+		break;
+	case kir_const_call:
+		v.func = insn->call.func;
+		break;
+	case kir_shri:
+	case kir_shli:
+	case kir_asri:
+		v.key[1] = insn->alu.imm1;
+		break;
+	case kir_cmpf:
+		v.key[2] = insn->alu.imm2;
+		break;
+	default:
+		break;
+	}
+
+	hash = v.opcode * 0x9e3779b97f4a7c15ull;
+	hash = (hash ^ v.key[0]) * 0x100000001b3ull;
+	hash = (hash ^ v.key[1]) * 0x100000001b3ull;
+	hash = (hash ^ v.key[2]) * 0x100000001b3ull;
+	hash ^= (uintptr_t) v.func;
+
+	for (uint32_t i = hash & (us->size - 1); ; i = (i + 1) & (us->size - 1)) {
+		struct uniform_value *e = &us->values[i];
+
+		/* Entries from earlier blocks are free slots. */
+		if (e->block != us->block) {
+			*e = v;
+			return NULL;
+		}
+
+		if (e->opcode == v.opcode && e->func == v.func &&
+		    e->key[0] == v.key[0] && e->key[1] == v.key[1] &&
+		    e->key[2] == v.key[2])
+			return e;
+	}
+}
+
+static void
+kir_program_uniform_values(struct kir_program *prog)
+{
+	const uint32_t count = prog->next_reg.n;
+	struct uniform_state us = { .prog = prog, .block = 1 };
+	struct kir_reg *remap, *srcs[3];
+	struct uniform_value *v;
+	struct kir_insn *insn;
+	uint32_t n, value;
+	bool uniform;
+
+	us.size = 64;
+	while (us.size < 2 * count)
+		us.size *= 2;
+	us.values = kir_program_zalloc(prog, us.size * sizeof(us.values[0]));
+	us.uniform = kir_program_zalloc(prog, count * sizeof(us.uniform[0]));
+	us.clobbered = kir_program_zalloc(prog, count * sizeof(us.clobbered[0]));
+	remap = kir_program_alloc(prog, count * sizeof(remap[0]));
+	for (uint32_t i = 0; i < count; i++)
+		remap[i] = kir_reg(i);
+
+	/* vpgatherdd clears its mask, so a mask register can't stand
+	 * in for another value. */
+	list_for_each_entry(insn, &prog->insns, link) {
+		if (insn->opcode == kir_gather)
+			us.clobbered[insn->gather.mask.n] = true;
+	}
+
+	list_for_each_entry(insn, &prog->insns, link) {
+		n = kir_insn_srcs(insn, srcs);
+		uniform = true;
+		for (uint32_t i = 0; i < n; i++) {
+			if (srcs[i] == &insn->gather.mask &&
+			    insn->opcode == kir_gather)
+				continue;
+			*srcs[i] = remap[srcs[i]->n];
+			uniform = uniform && us.uniform[srcs[i]->n];
+		}
+
+		switch (insn->opcode) {
+		case kir_label:
+			us.block++;
+			continue;
+		case kir_immd:
+			break;
+		case kir_load_region:
+			/* Copy propagation already reuses loads. */
+			if (region_is_uniform(&insn->xfer.region))
+				us.uniform[insn->dst.n] = true;
+			continue;
+		case kir_const_call:
+			if (!uniform || insn->call.args == 0)
+				continue;
+			break;
+		default:
+			if (!uniform || !is_uniform_alu(insn->opcode))
+				continue;
+			if (fold_uniform(prog, insn, &value)) {
+				insn->opcode = kir_immd;
+				insn->imm.d = value;
+			}
+			break;
+		}
+
+		us.uniform[insn->dst.n] = true;
+		if (us.clobbered[insn->dst.n])
+			continue;
+
+		v = lookup_uniform(&us, insn);
+		if (v && !us.clobbered[v->reg.n])
+			remap[insn->dst.n] = v->reg;
+	}
+}
+
+/* A region we load with a single 32 byte vmovdqa. */
+static bool
+is_full_region(const struct eu_region *region)
+{
+	return region->hstride == 1 && region->width == region->vstride &&
+		region->type_size * region->exec_size == 32;
+}
+
+/* Which source of insn can be a memory operand when it's reg. The
+ * memory operand goes in the ModRM r/m slot, which is src0 for most
+ * ops and src1 for sub. Commutative ops can take either. Returns -1
+ * if reg can't be folded, including when it's used twice. */
+static int
+alu_fold_slot(struct kir_insn *insn, struct kir_reg reg)
+{
+	struct kir_reg *srcs[3];
+	uint32_t n, uses = 0;
+	int slot = -1;
+
+	switch (insn->opcode) {
+	case kir_ps2d:
+	case kir_d2ps:
+	case kir_absd:
+	case kir_rcp:
+	case kir_sqrt:
+	case kir_rsqrt:
+	case kir_andn:
+	case kir_shr:
+	case kir_shl:
+	case kir_asr:
+	case kir_maxf:
+	case kir_minf:
+	case kir_cmpf:
+	case kir_cmpgtd:
+		if (insn->alu.src0.n == reg.n)
+			slot = 0;
+		break;
+	case kir_subd:
+	case kir_subf:
+		if (insn->alu.src1.n == reg.n)
+			slot = 1;
+		break;
+	case kir_and:
+	case kir_or:
+	case kir_xor:
+	case kir_addd:
+	case kir_addw:
+	case kir_addf:
+	case kir_muld:
+	case kir_mulw:
+	case kir_mulf:
+	case kir_cmpeqd:
+		if (insn->alu.src0.n == reg.n)
+			slot = 0;
+		else if (insn->alu.src1.n == reg.n)
+			slot = 1;
+		break;
+	default:
+		return -1;
+	}
+
+	n = kir_insn_srcs(insn, srcs);
+	for (uint32_t i = 0; i < n; i++)
+		if (srcs[i]->n == reg.n)
+			uses++;
+
+	return uses == 1 ? slot : -1;
+}
+
+/* Rough latencies, only used to order the ready list. */
+static uint32_t
+kir_insn_latency(struct kir_insn *insn)
+{
+	switch (insn->opcode) {
+	case kir_gather:
+		return 20;
+	case kir_divf:
+	case kir_sqrt:
+	case kir_rsqrt:
+	case kir_rcp:
+		return 12;
+	case kir_load_region:
+	case kir_load:
+	case kir_muld:
+	case kir_mulw:
+	case kir_mulf:
+	case kir_maddf:
+	case kir_nmaddf:
+		return 5;
+	default:
+		return 1;
+	}
+}
+
+/* The scheduler doesn't move anything across these. */
+static bool
+is_schedule_barrier(struct kir_insn *insn)
+{
+	switch (insn->opcode) {
+	case kir_send:
+	case kir_const_send:
+	case kir_call:
+	case kir_const_call:
+	case kir_label:
+	case kir_branch:
+	case kir_eot:
+	case kir_eot_if_dead:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool
+defines_reg(struct kir_insn *insn)
+{
+	switch (insn->opcode) {
+	case kir_comment:
+	case kir_store_region_mask:
+	case kir_store_region:
+	case kir_set_load_base_indirect:
+	case kir_set_load_base_imm:
+	case kir_set_load_base_imm_offset:
+	case kir_mask_store:
+		return false;
+	default:
+		return true;
+	}
+}
+
+struct sched_node {
+	struct kir_insn *insn;
+	struct kir_insn *comment;	/* Comments to keep in front */
+	uint32_t *succs;
+	uint32_t succ_count, succ_alloc;
+	uint32_t pred_count;
+	uint32_t height;
+	uint32_t rep;			/* Node this one is scheduled with */
+	int32_t fold;			/* Load to place right before this one */
+	bool scheduled;
+};
+
+struct sched_state {
+	struct kir_program *prog;
+	struct sched_node *nodes;
+	uint32_t count;
+	int32_t *block_def;		/* Per kir reg, node defining it or -1 */
+	uint32_t *uses;			/* Per kir reg, all uses in the program */
+	uint32_t *uses_left;		/* Per kir reg, unscheduled uses in the block */
+};
+
+/* Schedule for latency while fewer than this many values are live,
+ * then prefer insns that free registers. Leaves a few of the 16 ymm
+ * regs for the allocator. */
+#define SCHEDULE_PRESSURE_LIMIT 12
+
+static void
+add_dep(struct sched_state *s, uint32_t from, uint32_t to)
+{
+	struct sched_node *node = &s->nodes[from];
+
+	for (uint32_t i = 0; i < node->succ_count; i++)
+		if (node->succs[i] == to)
+			return;
+
+	if (node->succ_count == node->succ_alloc) {
+		uint32_t *succs;
+
+		node->succ_alloc = node->succ_alloc ? node->succ_alloc * 2 : 4;
+		succs = kir_program_alloc(s->prog,
+					  node->succ_alloc * sizeof(node->succs[0]));
+		memcpy(succs, node->succs, node->succ_count * sizeof(node->succs[0]));
+		node->succs = succs;
+	}
+	node->succs[node->succ_count++] = to;
+	s->nodes[to].pred_count++;
+}
+
+enum sched_access {
+	ACCESS_NONE,
+	ACCESS_REGION_READ,
+	ACCESS_REGION_WRITE,
+	ACCESS_RAX_READ,
+	ACCESS_RAX_WRITE,
+	ACCESS_MEMORY_READ,
+	ACCESS_MEMORY_WRITE,
+};
+
+static enum sched_access
+insn_access(struct kir_insn *insn)
+{
+	switch (insn->opcode) {
+	case kir_load_region:
+		return ACCESS_REGION_READ;
+	case kir_store_region:
+	case kir_store_region_mask:
+		return ACCESS_REGION_WRITE;
+	case kir_set_load_base_indirect:
+	case kir_set_load_base_imm:
+	case kir_set_load_base_imm_offset:
+		return ACCESS_RAX_WRITE;
+	case kir_load:
+	case kir_gather:
+		return ACCESS_MEMORY_READ;
+	case kir_mask_store:
+		return ACCESS_MEMORY_WRITE;
+	default:
+		return ACCESS_NONE;
+	}
+}
+
+/* Byte range of the thread GRF space insn reads or writes, if any. */
+static bool
+grf_extent(struct kir_insn *insn, uint32_t *start, uint32_t *end)
+{
+	switch (insn->opcode) {
+	case kir_load_region:
+	case kir_store_region:
+	case kir_store_region_mask:
+		region_extent(&insn->xfer.region, start, end);
+		return true;
+	case kir_set_load_base_indirect:
+		*start = insn->set_load_base.offset;
+		*end = *start + 8;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Does b have to stay after a, besides register dependencies? */
+static bool
+memory_dependency(struct kir_insn *a, struct kir_insn *b)
+{
+	enum sched_access aa = insn_access(a), ba = insn_access(b);
+	uint32_t as, ae, bs, be;
+
+	/* Loads, gathers and mask stores go through rax, and
+	 * set_load_base changes it. */
+	if ((aa == ACCESS_RAX_WRITE && ba >= ACCESS_RAX_READ) ||
+	    (aa >= ACCESS_RAX_READ && ba == ACCESS_RAX_WRITE))
+		return true;
+
+	if ((aa == ACCESS_MEMORY_WRITE && ba >= ACCESS_MEMORY_READ) ||
+	    (aa >= ACCESS_MEMORY_READ && ba == ACCESS_MEMORY_WRITE))
+		return true;
+
+	if ((aa == ACCESS_REGION_WRITE || ba == ACCESS_REGION_WRITE) &&
+	    grf_extent(a, &as, &ae) && grf_extent(b, &bs, &be))
+		return as < be && bs < ae;
+
+	return false;
+}
+
+static void
+place_node(struct sched_state *s, struct sched_node *node,
+	   struct list *tail, uint32_t *live)
+{
+	struct kir_reg *srcs[3];
+	uint32_t n = kir_insn_srcs(node->insn, srcs);
+
+	node->scheduled = true;
+	for (uint32_t j = 0; j < node->succ_count; j++)
+		s->nodes[node->succs[j]].pred_count--;
+
+	for (uint32_t j = 0; j < n; j++) {
+		const uint32_t reg = srcs[j]->n;
+
+		s->uses[reg]--;
+		if (--s->uses_left[reg] == 0 && s->uses[reg] == 0 &&
+		    s->block_def[reg] >= 0)
+			(*live)--;
+	}
+	if (defines_reg(node->insn) && s->uses[node->insn->dst.n] > 0)
+		(*live)++;
+
+	if (node->comment)
+		list_insert(tail->prev, &node->comment->link);
+	list_insert(tail->prev, &node->insn->link);
+}
+
+/* A load that can become the memory operand of its only user stays
+ * glued to it: we redirect its dependencies to the user and place it
+ * right before it. Only done if nothing in between writes the
+ * region, so that moving the load down is always legal. */
+static int32_t
+find_fold_user(struct sched_state *s, uint32_t i)
+{
+	struct kir_insn *load = s->nodes[i].insn;
+
+	if (load->opcode != kir_load_region ||
+	    !is_full_region(&load->xfer.region) ||
+	    s->uses[load->dst.n] != 1)
+		return -1;
+
+	for (uint32_t j = i + 1; j < s->count; j++) {
+		struct kir_insn *insn = s->nodes[j].insn;
+
+		if (alu_fold_slot(insn, load->dst) >= 0)
+			return j;
+		if (memory_dependency(load, insn))
+			return -1;
+	}
+
+	return -1;
+}
+
+static void
+schedule_block(struct sched_state *s, struct list *tail)
+{
+	struct kir_reg *srcs[3];
+	uint32_t live = 0;
+
+	if (s->count < 3)
+		goto done;
+
+	for (uint32_t i = 0; i < s->count; i++) {
+		struct sched_node *node = &s->nodes[i];
+		uint32_t n = kir_insn_srcs(node->insn, srcs);
+		const int32_t fold_user = find_fold_user(s, i);
+		const uint32_t rep = fold_user >= 0 ? fold_user : i;
+
+		if (fold_user >= 0)
+			s->nodes[fold_user].fold = i;
+
+		for (uint32_t j = 0; j < n; j++) {
+			int32_t def = s->block_def[srcs[j]->n];
+			if (def >= 0 && s->nodes[def].rep != rep)
+				add_dep(s, s->nodes[def].rep, rep);
+			s->uses_left[srcs[j]->n]++;
+		}
+		for (uint32_t j = 0; j < i; j++)
+			if (s->nodes[j].rep != rep &&
+			    memory_dependency(s->nodes[j].insn, node->insn))
+				add_dep(s, s->nodes[j].rep, rep);
+		if (defines_reg(node->insn))
+			s->block_def[node->insn->dst.n] = i;
+		node->rep = rep;
+	}
+
+	for (uint32_t i = s->count; i-- > 0; ) {
+		struct sched_node *node = &s->nodes[i];
+		uint32_t height = 0;
+
+		for (uint32_t j = 0; j < node->succ_count; j++)
+			if (s->nodes[node->succs[j]].height > height)
+				height = s->nodes[node->succs[j]].height;
+		node->height = height + kir_insn_latency(node->insn);
+	}
+
+	while (true) {
+		int32_t best = -1, best_score = 0;
+
+		for (uint32_t i = 0; i < s->count; i++) {
+			struct sched_node *node = &s->nodes[i];
+			int32_t score;
+
+			if (node->scheduled || node->pred_count > 0 ||
+			    node->rep != i)
+				continue;
+
+			if (live >= SCHEDULE_PRESSURE_LIMIT) {
+				uint32_t n = kir_insn_srcs(node->insn, srcs);
+
+				score = defines_reg(node->insn) ? -1 : 0;
+				for (uint32_t j = 0; j < n; j++)
+					if (s->block_def[srcs[j]->n] >= 0 &&
+					    s->uses_left[srcs[j]->n] == 1 &&
+					    s->uses[srcs[j]->n] == 1)
+						score++;
+				score = score * 1024 + node->height;
+			} else {
+				score = node->height;
+			}
+
+			/* Ties go to the earlier insn. */
+			if (best == -1 || score > best_score) {
+				best = i;
+				best_score = score;
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		if (s->nodes[best].fold >= 0)
+			place_node(s, &s->nodes[s->nodes[best].fold], tail, &live);
+		place_node(s, &s->nodes[best], tail, &live);
+	}
+
+	/* Reset the per register state we touched. */
+	for (uint32_t i = 0; i < s->count; i++) {
+		ksim_assert(s->nodes[i].scheduled);
+		s->block_def[s->nodes[i].insn->dst.n] = -1;
+	}
+	s->count = 0;
+
+	return;
+
+ done:
+	for (uint32_t i = 0; i < s->count; i++) {
+		uint32_t n = kir_insn_srcs(s->nodes[i].insn, srcs);
+
+		for (uint32_t j = 0; j < n; j++)
+			s->uses[srcs[j]->n]--;
+		if (s->nodes[i].comment)
+			list_insert(tail->prev, &s->nodes[i].comment->link);
+		list_insert(tail->prev, &s->nodes[i].insn->link);
+	}
+	s->count = 0;
+}
+
+/* List scheduling of the straight line code between sends, calls and
+ * control flow. Long latency insns, gathers in particular, move up so
+ * that independent work can hide their latency, as long as we don't
+ * run out of registers. Afterwards, registers are renumbered in the
+ * new order, since live ranges are in terms of insn numbers. */
+static void
+kir_program_schedule(struct kir_program *prog)
+{
+	const uint32_t count = prog->next_reg.n;
+	struct kir_insn *insn, *next, *comment = NULL;
+	struct kir_reg *srcs[3];
+	struct sched_state s;
+	struct list insns;
+	uint32_t *remap;
+
+	s.prog = prog;
+	s.nodes = kir_program_alloc(prog, count * sizeof(s.nodes[0]));
+	s.block_def = kir_program_alloc(prog, count * sizeof(s.block_def[0]));
+	s.uses = kir_program_zalloc(prog, count * sizeof(s.uses[0]));
+	s.uses_left = kir_program_zalloc(prog, count * sizeof(s.uses_left[0]));
+	memset(s.block_def, 0xff, count * sizeof(s.block_def[0]));
+	s.count = 0;
+
+	list_for_each_entry(insn, &prog->insns, link) {
+		uint32_t n = kir_insn_srcs(insn, srcs);
+		for (uint32_t j = 0; j < n; j++)
+			s.uses[srcs[j]->n]++;
+	}
+
+	/* Move everything to a new list and build the scheduled
+	 * program back into prog->insns, one block at a time. */
+	list_init(&insns);
+	if (!list_empty(&prog->insns)) {
+		insns.next = prog->insns.next;
+		insns.prev = prog->insns.prev;
+		insns.next->prev = &insns;
+		insns.prev->next = &insns;
+		list_init(&prog->insns);
+	}
+
+	list_for_each_entry_safe(insn, next, &insns, link) {
+		list_remove(&insn->link);
+
+		if (insn->opcode == kir_comment) {
+			/* Keep only the last comment before an insn;
+			 * earlier ones go out in order. */
+			if (comment)
+				list_insert(prog->insns.prev, &comment->link);
+			comment = insn;
+		} else if (is_schedule_barrier(insn)) {
+			schedule_block(&s, &prog->insns);
+			if (comment)
+				list_insert(prog->insns.prev, &comment->link);
+			comment = NULL;
+			list_insert(prog->insns.prev, &insn->link);
+		} else {
+			s.nodes[s.count++] = (struct sched_node) {
+				.insn = insn,
+				.comment = comment,
+				.fold = -1,
+			};
+			comment = NULL;
+		}
+	}
+	schedule_block(&s, &prog->insns);
+	if (comment)
+		list_insert(prog->insns.prev, &comment->link);
+
+	remap = kir_program_alloc(prog, count * sizeof(remap[0]));
+	uint32_t n = 0;
+	list_for_each_entry(insn, &prog->insns, link) {
+		uint32_t srcs_count = kir_insn_srcs(insn, srcs);
+		for (uint32_t j = 0; j < srcs_count; j++)
+			*srcs[j] = kir_reg(remap[srcs[j]->n]);
+		remap[insn->dst.n] = n;
+		insn->dst = kir_reg(n++);
+	}
+	prog->next_reg = kir_reg(n);
+}
+
+static struct kir_insn *
+next_non_comment(struct kir_insn *insn)
+{
+	do
+		insn = kir_insn_next(insn);
+	while (insn->opcode == kir_comment);
+
+	return insn;
+}
+
+/* Mark loads that the next insn can take as a memory operand. The
+ * register is still allocated, but we don't emit the load. */
+static void
+kir_program_fold_loads(struct kir_program *prog)
+{
+	struct kir_insn *insn, *next;
+
+	list_for_each_entry(insn, &prog->insns, link) {
+		if (insn->opcode != kir_load_region ||
+		    !is_full_region(&insn->xfer.region))
+			continue;
+
+		next = next_non_comment(insn);
+		if (alu_fold_slot(next, insn->dst) >= 0 &&
+		    prog->live_ranges[insn->dst.n] <= next->dst.n)
+			insn->xfer.fold = true;
+	}
+}
+
+struct bit_vector {
+	uint64_t bits[2];
+};
+
+static void
+bit_vector_init(struct bit_vector *v)
+{
+	v->bits[0] = ~0ul;
+	v->bits[1] = ~0ul;
+}
+
+static uint32_t
+bit_vector_alloc(struct bit_vector *v)
+{
+	for (uint32_t i = 0; i < ARRAY_LENGTH(v->bits); i++) {
+		if (v->bits[i]) {
+			uint32_t b = __builtin_ffsl(v->bits[i]) - 1;
+			v->bits[i] &= ~(1ul << b);
+			return b + i * 64;
+		}
+	}
+
+	ksim_unreachable();
+	return 0;
+}
+
+static void
+bit_vector_free(struct bit_vector *v, uint32_t b)
+{
+	ksim_assert((v->bits[b >> 6] & (1ul << (b & 63))) == 0);
+	v->bits[b >> 6] |= 1ul << (b & 63);
+}
+
+/* reg_to_avx value for a register that was spilled by dropping it,
+ * and is recomputed from its definition when used again. */
+#define REMAT_REG 0xfe
+
+struct ra_state {
+	struct kir_program *prog;
+	uint32_t *range;
+	uint32_t regs;
+	uint8_t *reg_to_avx;
+	struct kir_insn **remat;	/* Defining insn, if we can redo it */
+	struct kir_reg avx_to_reg[16];
+	struct bit_vector spill_slots;
+	uint32_t locked_regs;	/* Don't spill these */
+	uint32_t exclude_regs;	/* Don't allocate these */
+
+	uint32_t next_reg;
+};
+
+/* Returns true if nothing writes the region insn loads before the
+ * loaded register dies, in which case we can reload the region
+ * instead of spilling the register. */
+static bool
+region_unchanged(struct kir_program *prog, struct kir_insn *insn)
+{
+	const uint32_t end = prog->live_ranges[insn->dst.n];
+	const uint32_t grf_size = sizeof(((struct thread *) 0)->grf);
+	uint32_t start, stop, s, e;
+	struct kir_insn *next;
+
+	region_extent(&insn->xfer.region, &start, &stop);
+
+	for (next = container_of(insn->link.next, next, link);
+	     &next->link != &prog->insns && next->dst.n < end;
+	     next = container_of(next->link.next, next, link)) {
+		switch (next->opcode) {
+		case kir_store_region:
+		case kir_store_region_mask:
+			region_extent(&next->xfer.region, &s, &e);
+			if (s < stop && start < e)
+				return false;
+			break;
+		case kir_send:
+		case kir_const_send:
+			/* Sends write their response, and we don't
+			 * know what else they touch outside the
+			 * grf. */
+			s = next->send.dst * 32;
+			e = s + next->send.rlen * 32;
+			if ((s < stop && start < e) || stop > grf_size)
+				return false;
+			break;
+		case kir_call:
+		case kir_const_call:
+			if (stop > grf_size)
+				return false;
+			break;
+		case kir_label:
+		case kir_branch:
+		case kir_eot:
+		case kir_eot_if_dead:
+			return false;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void
+find_rematerializable(struct kir_program *prog, struct ra_state *state)
+{
+	struct kir_insn *insn;
+
+	list_for_each_entry(insn, &prog->insns, link) {
+		switch (insn->opcode) {
+		case kir_immd:
+		case kir_immw:
+		case kir_immv:
+		case kir_immvf:
+			state->remat[insn->dst.n] = insn;
+			break;
+		case kir_load_region:
+			if (region_unchanged(prog, insn))
+				state->remat[insn->dst.n] = insn;
+			break;
+		default:
+			break;
+		}
+	}
+}
 
+/* Linear scan style spill choice: prefer registers we can recompute,
+ * since spilling those is free, and among those, or if there are
+ * none, the one that's live the furthest. */
 static int
 pick_spill_reg(struct ra_state *state)
 {
-	uint32_t start_reg = state->next_spill_reg++ & 15;
-	uint32_t regs = 0xffff ^ state->locked_regs;
+	uint32_t regs = 0xffff & ~state->locked_regs & ~state->regs;
+	uint32_t best_end = 0, end, avx_reg;
+	bool best_remat = false, remat;
+	int best = -1;
+
+	for_each_bit(avx_reg, regs) {
+		struct kir_reg reg = state->avx_to_reg[avx_reg];
+
+		remat = state->remat[reg.n] != NULL;
+		end = state->range[reg.n];
+		if (best == -1 || (remat && !best_remat) ||
+		    (remat == best_remat && end > best_end)) {
+			best = avx_reg;
+			best_end = end;
+			best_remat = remat;
+		}
+	}
 
-	if (regs >> start_reg)
-		return __builtin_ffs(regs >> start_reg) + start_reg - 1;
-	else
-		return __builtin_ffs(regs) - 1;
+	ksim_assert(best != -1);
+
+	return best;
 }
 
 /* Insert spill instruction of register reg before instruction insn */
 static void
 spill_reg(struct ra_state *state, struct kir_insn *insn, int avx_reg)
 {
+	struct kir_reg def = state->avx_to_reg[avx_reg];
+
+	if (state->remat[def.n]) {
+		ksim_trace(TRACE_RA, "\tdrop ymm%d, rematerialize r%d\n",
+			   avx_reg, def.n);
+		state->regs |= (1 << avx_reg);
+		state->reg_to_avx[def.n] = REMAT_REG;
+		return;
+	}
+
 	int slot = bit_vector_alloc(&state->spill_slots);
 
 	ksim_trace(TRACE_RA, "\tspill ymm%d to slot %d\n", avx_reg, slot);
 
-	/* FIXME: Don't spill regs that are simple region loads or
-	 * immediates, just make the unspill reload.  Not trivial for
-	 * regions as they're not SSA.  Prefer spilling one of these
-	 * regs when possible. */
-
 	struct kir_insn *spill =
-		kir_insn_create(kir_store_region, void_reg, insn->link.prev);
+		kir_insn_create(state->prog, kir_store_region, void_reg, insn->link.prev);
 
 	spill->xfer.src = kir_reg(avx_reg);
 	spill->xfer.region = (struct eu_region) {
@@ -1200,8 +2667,6 @@ spill_reg(struct ra_state *state, struct kir_insn *insn, int avx_reg)
 		.hstride = 1
 	};
 
-	struct kir_reg def = state->avx_to_reg[avx_reg];
-
 	state->regs |= (1 << avx_reg);
 	state->reg_to_avx[def.n] = 16 + slot;
 }
@@ -1233,13 +2698,31 @@ unspill_reg(struct ra_state *state, struct kir_insn *insn, struct kir_reg reg)
 	ksim_assert(regs);
 
 	int avx_reg = __builtin_ffs(regs) - 1;
+
+	if (state->reg_to_avx[reg.n] == REMAT_REG) {
+		struct kir_insn *def = state->remat[reg.n];
+
+		ksim_trace(TRACE_RA, "\trematerialize r%d in ymm%d\n",
+			   reg.n, avx_reg);
+
+		struct kir_insn *remat =
+			kir_insn_create(state->prog, def->opcode, reg, insn->link.prev);
+		if (def->opcode == kir_load_region)
+			remat->xfer = def->xfer;
+		else
+			remat->imm = def->imm;
+
+		assign_reg(state, remat, avx_reg);
+		return;
+	}
+
 	uint32_t slot = state->reg_to_avx[reg.n] - 16;
 	bit_vector_free(&state->spill_slots, slot);
 
 	ksim_trace(TRACE_RA, "\tunspill slot %d to ymm%d\n", slot, avx_reg);
 
 	struct kir_insn *unspill =
-		kir_insn_create(kir_load_region, reg, insn->link.prev);
+		kir_insn_create(state->prog, kir_load_region, reg, insn->link.prev);
 
 	unspill->xfer.region = (struct eu_region) {
 		.offset = offsetof(struct thread, spill[slot]),
@@ -1249,6 +2732,7 @@ unspill_reg(struct ra_state *state, struct kir_insn *insn, struct kir_reg reg)
 		.width = 8,
 		.hstride = 1
 	};
+	unspill->xfer.fold = false;
 
 	assign_reg(state, unspill, avx_reg);
 }
@@ -1340,11 +2824,13 @@ kir_program_allocate_registers(struct kir_program *prog)
 
 	bit_vector_init(&state.spill_slots);
 	state.regs = 0xffff;
-	state.reg_to_avx = malloc(count * sizeof(state.reg_to_avx[0]));
+	state.prog = prog;
+	state.reg_to_avx = kir_program_alloc(prog, count * sizeof(state.reg_to_avx[0]));
 	memset(state.reg_to_avx, 0xff, count * sizeof(state.reg_to_avx[0]));
 	state.range = prog->live_ranges;
 	state.next_reg = 0;
-	state.next_spill_reg = 0;
+	state.remat = kir_program_zalloc(prog, count * sizeof(state.remat[0]));
+	find_rematerializable(prog, &state);
 
 	list_for_each_entry(insn, &prog->insns, link) {
 		ksim_trace(TRACE_RA, "%s\n", kir_insn_format(insn, buf, sizeof(buf)));
@@ -1377,12 +2863,26 @@ kir_program_allocate_registers(struct kir_program *prog)
 			break;
 			
 		case kir_call:
-		case kir_const_call:
+		case kir_const_call: {
+			struct kir_reg src0 = insn->call.src0;
+			struct kir_reg src1 = insn->call.src1;
+
 			spill_all(&state, insn);
 			if (insn->call.args > 0)
-				insn->call.src0 = use_reg(&state, insn, insn->call.src0);
-			if (insn->call.args > 1)
-				insn->call.src1 = use_reg(&state, insn, insn->call.src1);
+				insn->call.src0 = use_reg(&state, insn, src0);
+			if (insn->call.args > 1 && src1.n == src0.n)
+				insn->call.src1 = insn->call.src0;
+			else if (insn->call.args > 1)
+				insn->call.src1 = use_reg(&state, insn, src1);
+
+			/* The callee clobbers all ymm regs, so arguments
+			 * that live past the call (shared immediates,
+			 * for example) have to go back to their slots. */
+			if (insn->call.args > 0 && !reg_dead(&state, insn, src0))
+				spill_reg(&state, insn, insn->call.src0.n);
+			if (insn->call.args > 1 && src1.n != src0.n &&
+			    !reg_dead(&state, insn, src1))
+				spill_reg(&state, insn, insn->call.src1.n);
 
 			/* FIXME: Only if has return value. */
 			if (insn->call.args > 0)
@@ -1390,6 +2890,7 @@ kir_program_allocate_registers(struct kir_program *prog)
 			else
 				allocate_reg(&state, insn);
 			break;
+		}
 
 		case kir_mov:
 			ksim_unreachable();
@@ -1408,6 +2909,7 @@ kir_program_allocate_registers(struct kir_program *prog)
 		case kir_rndz:
 		case kir_shri:
 		case kir_shli:
+		case kir_asri:
 			insn->alu.src0 = use_reg(&state, insn, insn->alu.src0);
 			allocate_reg(&state, insn);
 			break;
@@ -1489,7 +2991,7 @@ kir_program_allocate_registers(struct kir_program *prog)
 				assign_reg(&state, insn, reuse_src->n);
 			} else if (state.regs & state.exclude_regs) {
 				struct kir_insn *mov =
-					kir_insn_create(kir_mov, kir_reg(0), insn->link.prev);
+					kir_insn_create(prog, kir_mov, kir_reg(0), insn->link.prev);
 				allocate_reg(&state, insn);
 
 				mov->dst = insn->dst;
@@ -1548,6 +3050,19 @@ kir_program_allocate_registers(struct kir_program *prog)
 			insn->store.mask = use_reg(&state, insn, insn->store.mask);
 			break;
 
+		case kir_label:
+			/* Nothing is live across a label, so start
+			 * over with all registers and spill slots
+			 * free. */
+			state.regs = 0xffff;
+			bit_vector_init(&state.spill_slots);
+			break;
+		case kir_branch:
+			if (insn->branch.test) {
+				lock_reg(&state, insn->branch.src);
+				insn->branch.src = use_reg(&state, insn, insn->branch.src);
+			}
+			break;
 		case kir_eot:
 			break;
 		case kir_eot_if_dead:
@@ -1557,8 +3072,6 @@ kir_program_allocate_registers(struct kir_program *prog)
 		}
 	}
 
-	free(state.reg_to_avx);
-
 	ksim_trace(TRACE_RA, "\n");
 }
 
@@ -1667,17 +3180,124 @@ emit_region_store(struct builder *bld,
 	}
 }
 
+/* Emit an alu op with the src in slot loaded from offset(%rdi). */
+static void
+emit_alu_rdi_relative(struct builder *bld, struct kir_insn *insn,
+		      int slot, int32_t offset)
+{
+	const int dst = insn->dst.n;
+	const int other = slot == 0 ? insn->alu.src1.n : insn->alu.src0.n;
+
+	switch (insn->opcode) {
+	case kir_ps2d:
+		builder_emit_vcvtps2dq_rdi_relative(bld, dst, offset);
+		break;
+	case kir_d2ps:
+		builder_emit_vcvtdq2ps_rdi_relative(bld, dst, offset);
+		break;
+	case kir_absd:
+		builder_emit_vpabsd_rdi_relative(bld, dst, offset);
+		break;
+	case kir_rcp:
+		builder_emit_vrcpps_rdi_relative(bld, dst, offset);
+		break;
+	case kir_sqrt:
+		builder_emit_vsqrtps_rdi_relative(bld, dst, offset);
+		break;
+	case kir_rsqrt:
+		builder_emit_vrsqrtps_rdi_relative(bld, dst, offset);
+		break;
+	case kir_and:
+		builder_emit_vpand_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_andn:
+		builder_emit_vpandn_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_or:
+		builder_emit_vpor_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_xor:
+		builder_emit_vpxor_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_shr:
+		builder_emit_vpsrlvd_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_shl:
+		builder_emit_vpsllvd_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_asr:
+		builder_emit_vpsravd_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_maxf:
+		builder_emit_vmaxps_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_minf:
+		builder_emit_vminps_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_addd:
+		builder_emit_vpaddd_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_addw:
+		builder_emit_vpaddw_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_addf:
+		builder_emit_vaddps_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_subd:
+		builder_emit_vpsubd_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_subf:
+		builder_emit_vsubps_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_muld:
+		builder_emit_vpmulld_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_mulw:
+		builder_emit_vpmullw_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_mulf:
+		builder_emit_vmulps_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_cmpf:
+		builder_emit_vcmpps_rdi_relative(bld, insn->alu.imm2, dst, other, offset);
+		break;
+	case kir_cmpeqd:
+		builder_emit_vpcmpeqd_rdi_relative(bld, dst, other, offset);
+		break;
+	case kir_cmpgtd:
+		builder_emit_vpcmpgtd_rdi_relative(bld, dst, other, offset);
+		break;
+	default:
+		ksim_unreachable("can't fold load into %d", insn->opcode);
+	}
+}
+
 void
 kir_program_emit(struct kir_program *prog, struct builder *bld)
 {
-	struct kir_insn *insn;
+	struct kir_insn *insn, *folded = NULL;
 
 	list_for_each_entry(insn, &prog->insns, link) {
+		if (folded && insn->opcode != kir_comment) {
+			emit_alu_rdi_relative(bld, insn,
+					      alu_fold_slot(insn, folded->dst),
+					      folded->xfer.region.offset);
+			folded = NULL;
+			continue;
+		}
+
 		switch (insn->opcode) {
 		case kir_comment:
 			break;
 		case kir_load_region:
-			emit_region_load(bld, &insn->xfer.region, insn->dst.n);
+			/* Register allocation may have put spills or
+			 * moves between the load and its user, check
+			 * that it's still right there. */
+			if (insn->xfer.fold &&
+			    alu_fold_slot(next_non_comment(insn), insn->dst) >= 0)
+				folded = insn;
+			else
+				emit_region_load(bld, &insn->xfer.region, insn->dst.n);
 			break;
 		case kir_store_region_mask:
 			emit_region_store_mask(bld, &insn->xfer.region,
@@ -1694,19 +3314,23 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 		case kir_set_load_base_imm: {
 			const void **p = get_const_data(sizeof(*p), sizeof(*p));
 			*p = insn->set_load_base.pointer;
+			shader_reloc_pointer(p, insn->set_load_base.address);
 			builder_emit_load_rax_rip_relative(bld, builder_offset(bld, p));
+			builder_reloc_const(bld, p);
 			break;
 		}
 		case kir_set_load_base_imm_offset: {
 			const void **p = get_const_data(sizeof(*p), sizeof(*p));
 			*p = insn->set_load_base.pointer;
+			shader_reloc_pointer(p, insn->set_load_base.address);
 
 			builder_emit_vpextrd(bld, insn->set_load_base.src.n, 2);
 			builder_emit_add_rax_rip_relative(bld, builder_offset(bld, p));
+			builder_reloc_const(bld, p);
 			break;
 		}
 		case kir_load:
-			builder_emit_vmovdqa_from_rax(bld, insn->dst.n, insn->load.offset);
+			builder_emit_vmovdqu_from_rax(bld, insn->dst.n, insn->load.offset);
 			break;
 		case kir_mask_store:
 			builder_emit_vpmaskmovd_to_rax(bld, insn->store.src.n,
@@ -1723,6 +3347,7 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 				uint32_t *p = get_const_data(sizeof(*p), sizeof(*p));
 				*p = insn->imm.d;
 				builder_emit_vpbroadcastd_rip_relative(bld, insn->dst.n, builder_offset(bld, p));
+				builder_reloc_const(bld, p);
 			}
 			break;
 		}
@@ -1737,6 +3362,7 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 				uint16_t *p = get_const_data(sizeof(*p), sizeof(*p));
 				*p = insn->imm.d;
 				builder_emit_vpbroadcastw_rip_relative(bld, insn->dst.n, builder_offset(bld, p));
+				builder_reloc_const(bld, p);
 			}
 			break;
 		}
@@ -1746,6 +3372,7 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 			memcpy(p, insn->imm.v, 8 * 2);
 			builder_emit_vbroadcasti128_rip_relative(bld, insn->dst.n,
 								 builder_offset(bld, p));
+			builder_reloc_const(bld, p);
 			break;
 		}
 
@@ -1754,6 +3381,7 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 			memcpy(p, insn->imm.vf, 4 * 4);
 			builder_emit_vbroadcasti128_rip_relative(bld, insn->dst.n,
 								 builder_offset(bld, p));
+			builder_reloc_const(bld, p);
 			break;
 		}
 
@@ -1764,13 +3392,16 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 				break;
 			}
 			builder_emit_load_rsi_rip_relative(bld, builder_offset(bld, insn->send.args));
+			builder_reloc_const(bld, insn->send.args);
 			if (kir_insn_next(insn)->opcode == kir_eot) {
-				int32_t offset = (uint8_t *) insn->send.func - bld->p;
+				int32_t offset = (uint8_t *) insn->send.func - builder_pc(bld);
 				builder_emit_jmp_relative(bld, offset);
+				builder_reloc_call(bld, insn->send.func);
 			} else {
 				builder_emit_push_rdi(bld);
-				int32_t offset = (uint8_t *) insn->send.func - bld->p;
+				int32_t offset = (uint8_t *) insn->send.func - builder_pc(bld);
 				builder_emit_call_relative(bld, offset);
+				builder_reloc_call(bld, insn->send.func);
 				builder_emit_pop_rdi(bld);
 			}
 			break;
@@ -1780,11 +3411,17 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 			ksim_assert(insn->dst.n == 0);
 			if (insn->call.args > 0)
 				ksim_assert(insn->call.src0.n == 0);
-			if (insn->call.args > 1)
+			/* Same register for both arguments, for example
+			 * when constant propagation turned both into the
+			 * same immediate. */
+			if (insn->call.args > 1 && insn->call.src1.n == 0)
+				builder_emit_vmovdqa(bld, 1, 0);
+			else if (insn->call.args > 1)
 				ksim_assert(insn->call.src1.n == 1);
 
 			builder_emit_push_rdi(bld);
-			builder_emit_call_relative(bld, (uint8_t *) insn->call.func - bld->p);
+			builder_emit_call_relative(bld, (uint8_t *) insn->call.func - builder_pc(bld));
+			builder_reloc_call(bld, insn->call.func);
 			builder_emit_pop_rdi(bld);
 			break;
 		case kir_mov:
@@ -1849,6 +3486,9 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 		case kir_shli:
 			builder_emit_vpslld(bld, insn->dst.n, insn->alu.src0.n, insn->alu.src1.n);
 			break;
+		case kir_asri:
+			builder_emit_vpsrad(bld, insn->dst.n, insn->alu.src0.n, insn->alu.imm1);
+			break;
 		case kir_shl:
 			builder_emit_vpsllvd(bld, insn->dst.n, insn->alu.src0.n, insn->alu.src1.n);
 			break;
@@ -1886,6 +3526,9 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 			builder_emit_vminps(bld, insn->dst.n, insn->alu.src0.n, insn->alu.src1.n);
 			break;
 		case kir_divf:
+			builder_emit_vdivps(bld, insn->dst.n,
+					    insn->alu.src1.n, insn->alu.src0.n);
+			break;
 		case kir_int_div_q_and_r:
 		case kir_int_div_q:
 		case kir_int_div_r:
@@ -1976,6 +3619,40 @@ kir_program_emit(struct kir_program *prog, struct builder *bld)
 						insn->gather.base_offset);
 			break;
 		}			
+		case kir_label: {
+			struct kir_insn *branch;
+
+			insn->label.pc = bld->p;
+			for (branch = insn->label.branches; branch; branch = branch->branch.next)
+				builder_set_branch32_target(bld, branch->branch.pc, bld->p);
+			break;
+		}
+		case kir_branch: {
+			struct kir_insn *label = insn->branch.label;
+			int32_t offset;
+
+			if (insn->branch.test) {
+				builder_emit_vmovmskps(bld, insn->branch.src.n);
+				builder_emit_test_eax(bld, insn->branch.test);
+			}
+
+			/* Backward branches know where they're going,
+			 * forward branches get patched by the label. */
+			offset = label->label.pc ? label->label.pc - bld->p : 0;
+			if (insn->branch.test == 0)
+				builder_emit_jmp_relative(bld, offset);
+			else if (insn->branch.if_empty)
+				builder_emit_jz_relative(bld, offset);
+			else
+				builder_emit_jnz_relative(bld, offset);
+
+			if (label->label.pc == NULL) {
+				insn->branch.pc = bld->p;
+				insn->branch.next = label->label.branches;
+				label->label.branches = insn;
+			}
+			break;
+		}
 		case kir_eot:
 			builder_emit_ret(bld);
 			break;
@@ -2016,6 +3693,12 @@ kir_program_init(struct kir_program *prog, uint64_t surfaces, uint64_t samplers)
 	list_init(&prog->insns);
 	prog->next_reg = kir_reg(0);
 	prog->scope = 0;
+	prog->jump_targets = NULL;
+	prog->arena = NULL;
+	prog->defs_size = 256;
+	prog->defs = kir_program_zalloc(prog, prog->defs_size * sizeof(prog->defs[0]));
+	prog->imm_next = 0;
+	forget_constants(prog);
 	prog->urb_offset = 0;
 	prog->urb_length = 0;
 	prog->binding_table_address = surfaces;
@@ -2026,19 +3709,35 @@ shader_t
 kir_program_finish(struct kir_program *prog)
 {
 	struct builder bld;
+	uint64_t *invocations;
+
+	/* Baseline shaders skip the passes that only make the code
+	 * faster. */
+	const bool baseline = shader_cache_baseline();
 
 	if (trace_mask & TRACE_EU) {
-		fprintf(trace_file, "# --- initial codegen\n");
+		fprintf(trace_file, "# --- initial codegen%s\n",
+			baseline ? " (baseline)" : "");
 		kir_program_print(prog, trace_file);
 		fprintf(trace_file, "\n");
 	}
 
-	kir_program_copy_propagation(prog);
+	if (!baseline) {
+		kir_program_copy_propagation(prog);
 
-	if (trace_mask & TRACE_EU) {
-		fprintf(trace_file, "# --- after copy propagation\n");
-		kir_program_print(prog, trace_file);
-		fprintf(trace_file, "\n");
+		if (trace_mask & TRACE_EU) {
+			fprintf(trace_file, "# --- after copy propagation\n");
+			kir_program_print(prog, trace_file);
+			fprintf(trace_file, "\n");
+		}
+
+		kir_program_uniform_values(prog);
+
+		if (trace_mask & TRACE_EU) {
+			fprintf(trace_file, "# --- after uniform values\n");
+			kir_program_print(prog, trace_file);
+			fprintf(trace_file, "\n");
+		}
 	}
 
 	kir_program_compute_live_ranges(prog);
@@ -2051,6 +3750,18 @@ kir_program_finish(struct kir_program *prog)
 		fprintf(trace_file, "\n");
 	}
 
+	if (!baseline) {
+		kir_program_schedule(prog);
+		kir_program_compute_live_ranges(prog);
+		kir_program_fold_loads(prog);
+
+		if (trace_mask & TRACE_EU) {
+			fprintf(trace_file, "# --- after scheduling\n");
+			kir_program_print(prog, trace_file);
+			fprintf(trace_file, "\n");
+		}
+	}
+
 	kir_program_allocate_registers(prog);
 
 	if (trace_mask & TRACE_EU) {
@@ -2061,17 +3772,22 @@ kir_program_finish(struct kir_program *prog)
 
 	builder_init(&bld);
 
+	/* Count invocations so the shader cache can tell when to
+	 * recompile. The count doesn't need to be exact, so threads
+	 * race on it. */
+	if (baseline) {
+		invocations = get_const_data(sizeof(*invocations), 8);
+		*invocations = 0;
+		builder_emit_inc_rip_relative(&bld, builder_offset(&bld, invocations));
+		builder_reloc_const(&bld, invocations);
+		shader_cache_set_invocations(invocations);
+	}
+
 	ksim_trace(TRACE_AVX | TRACE_EU, "# --- code emit\n");
 	kir_program_emit(prog, &bld);
 
-	while (!list_empty(&prog->insns)) {
-		struct kir_insn *insn = 
-			container_of(prog->insns.next, insn, link);
-		list_remove(&insn->link);
-		kir_insn_destroy(insn);
-	}
-
-	free(prog->live_ranges);
+	list_init(&prog->insns);
+	kir_program_free_arena(prog);
 
 	return builder_finish(&bld);
 }
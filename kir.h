@@ -31,6 +31,21 @@ kir_reg(int n)
 	return (struct kir_reg) { .n = n };
 }
 
+struct kir_insn;
+
+union kir_imm {
+	int32_t d;
+	int16_t v[8];
+	float vf[4];
+};
+
+/* Where control flow out of an execution mask scope lands. */
+struct kir_scope {
+	bool loop;
+	struct kir_insn *label;	/* IF: at ELSE or ENDIF, DO: top of loop */
+	struct kir_insn *cont;	/* DO: at WHILE, for BREAK and CONTINUE */
+};
+
 struct kir_program {
 	struct list insns;
 
@@ -39,14 +54,41 @@ struct kir_program {
 	uint32_t exec_offset;
 	struct kir_reg dst;
 	int scope;
-	int new_scope;
 	int quarter;
+	struct kir_scope scopes[MAX_SCOPES];
+	uint32_t ip;			/* Offset of the next EU instruction */
+	struct kir_insn *jump_targets;	/* Labels for pending JMPIs */
+
+	/* Constant lattice for the GRF, tracked while we build the
+	 * program: bit n of grf_known[g] says dword n of g holds
+	 * grf_value[g][n]. Everything is unknown at the start of a
+	 * block. */
+	uint8_t grf_known[128];
+	uint32_t grf_value[128][8];
+
+	/* Defining instruction for each register, while building. */
+	struct kir_insn **defs;
+	uint32_t defs_size;
+
+	/* Immediates already loaded in the current block. */
+	struct kir_insn *imm_cache[16];
+	uint32_t imm_next;
+
+	/* Address set by the last set_load_base_imm, while rax
+	 * still holds it, 0 otherwise. */
+	uint64_t load_base_address;
+	struct kir_reg load_base;
+
 	uint32_t *live_ranges;
 	uint32_t urb_offset;
 	uint32_t urb_length;
 
 	uint64_t binding_table_address;
 	uint64_t sampler_state_address;
+
+	/* Insns, comments and analysis tables are bump allocated from
+	 * here and all freed at once by kir_program_finish(). */
+	struct kir_arena *arena;
 };
 
 enum kir_opcode {
@@ -90,6 +132,7 @@ enum kir_opcode {
 	kir_rndz,
 	kir_shri, /* src1 immediate */
 	kir_shli, /* src1 immediate */
+	kir_asri, /* src1 immediate */
 
 	/* alu binop */
 	kir_and,
@@ -139,6 +182,10 @@ enum kir_opcode {
 	kir_maddf,
 	kir_blend,
 
+	/* control flow */
+	kir_label,
+	kir_branch,
+
 	kir_eot,
 	kir_eot_if_dead
 };
@@ -169,6 +216,7 @@ struct kir_insn {
 			uint32_t offset;
 			struct kir_reg src;
 			struct kir_reg mask;
+			bool fold; /* load_region: memory operand of next insn */
 		} xfer;
 
 		/* The base register for store and load comes from the
@@ -191,6 +239,7 @@ struct kir_insn {
 			struct kir_reg src;
 			uint32_t offset;
 			void *pointer;
+			uint64_t address;
 		} set_load_base;
 
 		struct {
@@ -214,11 +263,7 @@ struct kir_insn {
 			uint32_t base_offset;	/* immediate offset */
 		} gather;
 
-		union {
-			int32_t d;
-			int16_t v[8];
-			float vf[4];
-		} imm;
+		union kir_imm imm;
 
 		/* A send instruction is a C function that reads its
 		 * arguments from a contiguous number of registers in
@@ -245,6 +290,27 @@ struct kir_insn {
 		struct {
 			struct kir_reg src;
 		} eot;
+
+		/* A label starts a new block: nothing stays in avx
+		 * registers across it. */
+		struct {
+			uint32_t ip;		/* EU offset for JMPI targets */
+			struct kir_insn *next;	/* Next pending JMPI target */
+			uint8_t *pc;		/* Set once emitted */
+			struct kir_insn *branches; /* Forward branches to patch */
+		} label;
+
+		/* A branch moves the sign bits of src into eax and
+		 * jumps if any (or, with if_empty, none) of the test
+		 * bits are set. A test of 0 is an unconditional jump. */
+		struct {
+			struct kir_reg src;
+			uint32_t test;
+			bool if_empty;
+			struct kir_insn *label;
+			uint8_t *pc;		/* End of the emitted jump */
+			struct kir_insn *next;	/* Next branch to patch */
+		} branch;
 	};
 
 	struct list link;
@@ -274,6 +340,19 @@ kir_program_init(struct kir_program *prog, uint64_t surfaces, uint64_t samplers)
 struct kir_reg
 kir_program_alu(struct kir_program *prog, enum kir_opcode opcode, ...);
 
+struct kir_reg
+kir_program_imm(struct kir_program *prog, enum kir_opcode opcode, union kir_imm imm);
+
+bool
+kir_program_get_constant(struct kir_program *prog, uint32_t grf, uint32_t *value);
+
+void
+kir_program_set_constant(struct kir_program *prog, uint32_t grf, const uint32_t *values);
+
+bool
+kir_program_get_region_constant(struct kir_program *prog,
+				const struct eu_region *region, uint32_t *value);
+
 struct kir_reg
 kir_program_load_region(struct kir_program *prog, const struct eu_region *region);
 
@@ -289,10 +368,10 @@ struct kir_reg
 kir_program_set_load_base_indirect(struct kir_program *prog, uint32_t offset);
 
 struct kir_reg
-kir_program_set_load_base_imm(struct kir_program *prog, void *pointer);
+kir_program_set_load_base_imm(struct kir_program *prog, uint64_t address);
 
 struct kir_reg
-kir_program_set_load_base_imm_offset(struct kir_program *prog, void *pointer, struct kir_reg offset);
+kir_program_set_load_base_imm_offset(struct kir_program *prog, uint64_t address, struct kir_reg offset);
 
 struct kir_reg
 kir_program_load(struct kir_program *prog, struct kir_reg base, uint32_t offset);
@@ -331,6 +410,19 @@ kir_program_gather(struct kir_program *prog,
 		   struct kir_reg mask,
 		   uint32_t scale, uint32_t base_offset);
 
+struct kir_insn *
+kir_program_create_label(struct kir_program *prog);
+
+void
+kir_program_place_label(struct kir_program *prog, struct kir_insn *label);
+
+void
+kir_program_branch(struct kir_program *prog, struct kir_reg src,
+		   uint32_t test, bool if_empty, struct kir_insn *label);
+
+void
+kir_program_jump(struct kir_program *prog, struct kir_insn *label);
+
 shader_t
 kir_program_finish(struct kir_program *prog);
 
@@ -343,29 +435,20 @@ kir_program_emit_shader(struct kir_program *prog, uint64_t kernel_offset);
 static inline struct kir_reg
 kir_program_immd(struct kir_program *prog, int32_t d)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_immd);
-
-	insn->imm.d = d;
-
-	return insn->dst;
+	return kir_program_imm(prog, kir_immd, (union kir_imm) { .d = d });
 }
 
 static inline struct kir_reg
 kir_program_immf(struct kir_program *prog, float f)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_immd);
-
-	insn->imm.d = float_to_u32(f);
-
-	return insn->dst;
+	return kir_program_imm(prog, kir_immd,
+			       (union kir_imm) { .d = float_to_u32(f) });
 }
 
 static inline struct kir_reg
 kir_program_load_uniform(struct kir_program *prog, uint32_t offset)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_load_region);
-
-	insn->xfer.region = (struct eu_region) {
+	const struct eu_region region = {
 		.offset = offset,
 		.type_size = 4,
 		.exec_size = 1,
@@ -374,15 +457,13 @@ kir_program_load_uniform(struct kir_program *prog, uint32_t offset)
 		.hstride = 0
 	};
 
-	return insn->dst;
+	return kir_program_load_region(prog, &region);
 }
 
 static inline struct kir_reg
 kir_program_load_v8(struct kir_program *prog, uint32_t offset)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_load_region);
-
-	insn->xfer.region = (struct eu_region) {
+	const struct eu_region region = {
 		.offset = offset,
 		.type_size = 4,
 		.exec_size = 8,
@@ -391,17 +472,14 @@ kir_program_load_v8(struct kir_program *prog, uint32_t offset)
 		.hstride = 1
 	};
 
-	return insn->dst;
+	return kir_program_load_region(prog, &region);
 }
 
 static inline void
 kir_program_store_v8(struct kir_program *prog,
 		     uint32_t offset, struct kir_reg src)
 {
-	struct kir_insn *insn = kir_program_add_insn(prog, kir_store_region);
-
-	insn->xfer.src = src;
-	insn->xfer.region = (struct eu_region) {
+	const struct eu_region region = {
 		.offset = offset,
 		.type_size = 4,
 		.exec_size = 8,
@@ -409,4 +487,6 @@ kir_program_store_v8(struct kir_program *prog,
 		.width = 8,
 		.hstride = 1
 	};
+
+	kir_program_store_region(prog, &region, src);
 }
@@ -59,6 +59,12 @@ extern uint32_t breakpoint_mask;
 extern FILE *trace_file;
 extern char *framebuffer_filename;
 extern bool use_threads;
+extern uint32_t thread_count;
+extern char *shader_cache_dir;
+extern bool bake_constants;
+extern uint32_t tier_threshold;
+extern bool use_perf_map;
+extern bool use_jitdump;
 
 static inline void
 __ksim_trace(uint32_t tag, const char *fmt, ...)
@@ -210,7 +216,7 @@ void start_batch_buffer(uint64_t address, uint32_t ring);
 /* Per stage urb allocation info and entry pool. All sizes in bytes */
 struct urb {
 	uint32_t size;
-	uint32_t count, total, free_list;
+	uint32_t count, total, free_list, free_count;
 	void *data;
 };
 
@@ -258,18 +264,42 @@ struct reg32 {
 	__m256i q[4];
 };
 
+/* Execution mask stack for control flow. IF pushes one scope, DO
+ * pushes two: one for the channels still in the loop and one for the
+ * channels active in the current iteration. */
+#define MAX_SCOPES 16
+
 struct thread {
 	struct reg grf[128];
 	struct reg32 f[2];
-	struct reg32 mask[2];
+	struct reg32 mask[MAX_SCOPES];
 	__m256i constants[32];
 	__m256i spill[128]; /* Needs to be dynamically determined */
 };
 
 typedef void (*shader_t)(struct thread *t);
 
+/* The command streamer sets these when it changes state that a stage's
+ * shader or its per-draw thread setup depends on. Draws and walkers
+ * only look up shaders for dirty stages. */
+enum {
+	DIRTY_VS = 1 << 0,
+	DIRTY_HS = 1 << 1,
+	DIRTY_DS = 1 << 2,
+	DIRTY_GS = 1 << 3,
+	DIRTY_PS = 1 << 4,
+	DIRTY_CS = 1 << 5,
+	DIRTY_SHADERS = (1 << 6) - 1,
+
+	DIRTY_VS_CONSTANTS = 1 << 6,	/* Push constants for vs threads. */
+	DIRTY_VIEWPORT = 1 << 7,	/* Clip and viewport in vue buffers. */
+
+	DIRTY_ALL = (1 << 8) - 1,
+};
+
 struct gt {
 	uint32_t pipeline;
+	uint32_t dirty;
 
 	struct {
 		struct vb {
@@ -481,9 +511,9 @@ struct gt {
 		bool fast_clear;
 		uint32_t resolve_type;
 		bool enable;
-		shader_t avx_shader_simd8;
 		shader_t avx_shader_simd16;
 		shader_t avx_shader_simd32;
+		shader_t avx_tile_shader;
 	} ps;
 
 	struct {
@@ -729,6 +759,7 @@ uint32_t ia_state_cut(struct ia_state *s, struct prim_queue *q);
 void tessellate_patch(struct value **vue);
 void dispatch_gs(struct value ***vue,
 		 uint32_t vertex_count, uint32_t primitive_count);
+void set_default_csr(void);
 void dispatch_primitive(void);
 void dispatch_compute(void);
 
@@ -774,6 +805,7 @@ void rasterize_primitive(struct value **vue, enum GEN9_3D_Prim_Topo_Type topolog
 
 struct surface {
 	void *pixels;
+	uint64_t address;
 	enum GEN9_SURFACE_FORMAT format;
 	int type;
 	int width;
@@ -792,6 +824,11 @@ void wm_stall(void);
 void wm_flush(void);
 void depth_clear(void);
 
+typedef void (*thread_pool_func_t)(void *data, uint32_t worker);
+
+uint32_t thread_pool_size(void);
+void thread_pool_run(thread_pool_func_t func, void *data);
+
 /* URB handles are indexes to 64 byte blocks in the URB. */
 
 static inline uint32_t
@@ -819,9 +856,16 @@ void set_urb_allocation(struct urb *urb,
 			uint32_t address, uint32_t size, uint32_t total);
 void *alloc_urb_entry(struct urb *urb);
 void free_urb_entry(struct urb* urb, void *entry);
+
+static inline uint32_t
+urb_entries_available(struct urb *urb)
+{
+	return urb->total - urb->count + urb->free_count;
+}
 void validate_urb_state(void);
 
 struct kir_program;
+struct shader_key;
 struct builder;
 struct inst;
 void builder_emit_sfid_urb(struct kir_program *prog, struct inst *inst);
@@ -839,7 +883,10 @@ void builder_emit_sfid_dataport1(struct kir_program *prog, struct inst *inst);
 void builder_emit_shader(struct builder *bld, uint64_t kernel_offset);
 
 uint32_t emit_load_constants(struct kir_program *prog, struct curbe *c, uint32_t start);
+uint32_t emit_resident_constants(struct kir_program *prog, struct curbe *c, uint32_t start);
+void add_constants_key(struct shader_key *key, struct curbe *c, uint32_t start);
 uint32_t load_constants(struct thread *t, struct curbe *c);
+uint32_t baked_constants_dirty(void);
 
 struct vue_buffer {
 	struct rectanglef clip;
@@ -859,14 +906,13 @@ struct vue_buffer {
 
 void init_vue_buffer(struct vue_buffer *b);
 void emit_vertex_post_processing(struct kir_program *prog, uint32_t base);
+void add_vertex_post_processing_key(struct shader_key *key);
 
 void compile_ps(void);
 void compile_hs(void);
 void compile_ds(void);
 void compile_gs(void);
 
-void reset_shader_pool(void);
-
 void *get_const_data(size_t size, size_t align);
 
 static inline uint32_t *
@@ -881,6 +927,80 @@ get_const_ud(uint32_t ud)
 	return p;
 }
 
+void free_shader(shader_t shader);
+uint32_t shader_size(shader_t shader);
+uint64_t shader_arena_size(void);
+
+#define SHADER_MAX_SIZE (1024 * 1024)
+
+enum shader_reloc_type {
+	RELOC_CONST,	/* rel32 in the code to the shader's constant data */
+	RELOC_CALL,	/* rel32 in the code to a function */
+	RELOC_POINTER,	/* pointer in the constant data mapped from a gtt address */
+};
+
+struct shader_reloc {
+	uint32_t type;
+	uint32_t offset;
+	uint64_t target;
+};
+
+struct shader_image {
+	const void *code;
+	uint32_t code_size;
+	const void *constants;
+	uint32_t const_size;
+	const struct shader_reloc *relocs;
+	uint32_t reloc_count;
+};
+
+void shader_reloc_pointer(void *slot, uint64_t address);
+void shader_get_image(shader_t shader, struct shader_image *image);
+shader_t shader_from_image(const struct shader_image *image);
+
+uint32_t kernel_size(uint64_t kernel_offset);
+bool kernel_writes_grfs(uint64_t kernel_offset, uint32_t start, uint32_t end);
+
+enum shader_stage {
+	SHADER_VS,
+	SHADER_HS,
+	SHADER_DS,
+	SHADER_GS,
+	SHADER_PS,
+	SHADER_CS,
+};
+
+struct shader_key {
+	enum shader_stage stage;
+	uint64_t ksp;
+	uint64_t hash;
+	uint32_t size;
+	uint32_t alloc;
+	uint8_t *data;
+};
+
+void shader_key_init(struct shader_key *key, enum shader_stage stage);
+void shader_key_add(struct shader_key *key, const void *data, size_t size);
+void shader_key_add_kernel(struct shader_key *key, uint64_t kernel_offset);
+
+#define shader_key_add_value(key, v) shader_key_add((key), &(v), sizeof(v))
+
+static inline void
+shader_key_add_u32(struct shader_key *key, uint32_t v)
+{
+	shader_key_add(key, &v, sizeof(v));
+}
+
+shader_t shader_cache_lookup(struct shader_key *key);
+shader_t shader_cache_add(shader_t shader);
+void shader_cache_add_surface(uint32_t binding_table_offset, int i,
+			      bool valid, const struct surface *s);
+void shader_cache_prepare(void);
+bool shader_cache_baseline(void);
+void shader_cache_set_invocations(uint64_t *invocations);
+
+void perf_add_shader(shader_t shader, const char *fmt, ...);
+
 struct list {
 	struct list *prev;
 	struct list *next;
@@ -0,0 +1,201 @@
+/*
+ * Copyright © 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <elf.h>
+#include <sys/uio.h>
+
+#include "ksim.h"
+
+/* Tell perf where the shaders are. /tmp/perf-<pid>.map is the simple
+ * format perf report reads for anonymous executable memory: one line
+ * of start, size and name per symbol. The jitdump file,
+ * /tmp/jit-<pid>.dump, also carries a copy of the code. Once perf
+ * record sees us mmap it, perf inject --jit turns the records into
+ * ELF images, so perf annotate can show the AVX2 instructions.
+ * Jitdump timestamps are CLOCK_MONOTONIC, so record with -k mono. */
+
+#define JITDUMP_MAGIC 0x4a695444 /* "JiTD" */
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+struct jitdump_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+
+struct jitdump_code_load {
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+	/* Followed by the nul terminated name and the code. */
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	bool initialized;
+	FILE *map;
+	int dump_fd;
+	void *dump_marker;
+	uint64_t code_index;
+} perf = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.dump_fd = -1,
+};
+
+static uint64_t
+timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+open_jitdump(void)
+{
+	struct jitdump_header header = {
+		.magic = JITDUMP_MAGIC,
+		.version = JITDUMP_VERSION,
+		.total_size = sizeof(header),
+		.elf_mach = EM_X86_64,
+		.pid = getpid(),
+		.timestamp = timestamp(),
+	};
+	char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+	perf.dump_fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+	if (perf.dump_fd < 0) {
+		ksim_warn("failed to create %s\n", path);
+		return;
+	}
+
+	if (write(perf.dump_fd, &header, sizeof(header)) != sizeof(header)) {
+		ksim_warn("failed to write %s\n", path);
+		close(perf.dump_fd);
+		perf.dump_fd = -1;
+		return;
+	}
+
+	/* perf finds the dump by the executable mapping of it that
+	 * shows up in the recording. */
+	perf.dump_marker = mmap(NULL, sysconf(_SC_PAGESIZE),
+				PROT_READ | PROT_EXEC, MAP_PRIVATE,
+				perf.dump_fd, 0);
+	if (perf.dump_marker == MAP_FAILED)
+		ksim_warn("failed to map %s\n", path);
+}
+
+static void
+perf_init(void)
+{
+	char path[64];
+
+	if (use_perf_map) {
+		snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+		perf.map = fopen(path, "w");
+		if (perf.map == NULL)
+			ksim_warn("failed to create %s\n", path);
+	}
+
+	if (use_jitdump)
+		open_jitdump();
+
+	perf.initialized = true;
+}
+
+void
+perf_add_shader(shader_t shader, const char *fmt, ...)
+{
+	struct shader_image image;
+	struct jitdump_code_load record;
+	char name[128];
+	va_list va;
+
+	if (!use_perf_map && !use_jitdump)
+		return;
+
+	va_start(va, fmt);
+	vsnprintf(name, sizeof(name), fmt, va);
+	va_end(va);
+
+	shader_get_image(shader, &image);
+
+	pthread_mutex_lock(&perf.mutex);
+
+	if (!perf.initialized)
+		perf_init();
+
+	if (perf.map) {
+		fprintf(perf.map, "%lx %x %s\n",
+			(uintptr_t) shader, image.code_size, name);
+		fflush(perf.map);
+	}
+
+	if (perf.dump_fd >= 0) {
+		const size_t name_size = strlen(name) + 1;
+		struct iovec iov[] = {
+			{ &record, sizeof(record) },
+			{ name, name_size },
+			{ (void *) image.code, image.code_size },
+		};
+
+		record = (struct jitdump_code_load) {
+			.id = JIT_CODE_LOAD,
+			.total_size = sizeof(record) + name_size + image.code_size,
+			.timestamp = timestamp(),
+			.pid = getpid(),
+			.tid = syscall(SYS_gettid),
+			.vma = (uintptr_t) shader,
+			.code_addr = (uintptr_t) shader,
+			.code_size = image.code_size,
+			.code_index = perf.code_index++,
+		};
+
+		if (writev(perf.dump_fd, iov, ARRAY_LENGTH(iov)) !=
+		    (ssize_t) record.total_size)
+			ksim_warn("failed to write jitdump record\n");
+	}
+
+	pthread_mutex_unlock(&perf.mutex);
+}
@@ -21,6 +21,8 @@
  * IN THE SOFTWARE.
  */
 
+#include <stdlib.h>
+
 #include "ksim.h"
 #include "kir.h"
 
@@ -41,8 +43,30 @@ ia_state_peek(struct ia_state *s, uint32_t i)
 	return s->vue[i & (ARRAY_LENGTH(s->vue) - 1)];
 }
 
+/* The vertex range of a 3DPRIMITIVE is split into SIMD8 groups, which
+ * are shaded in batches on the thread pool. Each group gets its URB
+ * entries up front, so workers can write their VUEs independently, and
+ * the batch is then fed to primitive assembly in submission order. */
+
+struct vs_group {
+	uint32_t iid;
+	uint32_t vid;
+	uint32_t count;
+	bool end_of_instance;
+	struct reg vue_handles;
+};
+
+#define MAX_VS_BATCH 256
+
+struct vs_batch {
+	struct vs_thread *threads;
+	struct vs_group groups[MAX_VS_BATCH];
+	uint32_t count;
+	uint32_t next;
+};
+
 static void
-flush_to_vues(struct vue_buffer *b, uint32_t count, struct ia_state *s)
+flush_to_vues(struct vue_buffer *b, uint32_t count)
 {
 	/* Transpose the SIMD8 vs_thread back into individual VUEs */
 	for (uint32_t c = 0; c < count; c++) {
@@ -50,34 +74,22 @@ flush_to_vues(struct vue_buffer *b, uint32_t count, struct ia_state *s)
 		__m256i offsets = (__m256i) (__v8si) { 0, 8, 16, 24, 32, 40, 48, 56 };
 		for (uint32_t i = 0; i < gt.vs.urb.size / 32; i++)
 			vue[i] = _mm256_i32gather_epi32(&b->data[i * 8].d[c], offsets, 4);
-
-		/* FIXME: Cut index: ia_state_flush(), ia_state_cut(); else add... */
-		ia_state_add(s, (struct value *) vue);
- 	}
-
-	ksim_assert(s->head - s->tail <= 64);
+	}
 }
 
 static void
-dispatch_vs(struct vs_thread *t, uint32_t iid, uint32_t vid, struct ia_state *state)
+dispatch_vs(struct vs_thread *t, const struct vs_group *g)
 {
 	struct reg *grf = &t->t.grf[0];
 
 	/* Not sure what we should make this. */
 	uint32_t fftid = 0;
 
-	uint32_t rest = gt.prim.vertex_count - vid;
-	uint32_t count;
-	if (rest > 8)
-		count = 8;
-	else
-		count = rest;
-
 	static const struct reg range = { .d = {  0, 1, 2, 3, 4, 5, 6, 7 } };
-	t->t.mask[0].q[0] = _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), range.ireg);
+	t->t.mask[0].q[0] = _mm256_cmpgt_epi32(_mm256_set1_epi32(g->count), range.ireg);
 
-	t->iid = iid;
-	t->vid.ireg = _mm256_add_epi32(range.ireg, _mm256_set1_epi32(vid));
+	t->iid = g->iid;
+	t->vid.ireg = _mm256_add_epi32(range.ireg, _mm256_set1_epi32(g->vid));
 
 	/* Fixed function header */
 	grf[0] = (struct reg) {
@@ -94,25 +106,29 @@ dispatch_vs(struct vs_thread *t, uint32_t iid, uint32_t vid, struct ia_state *st
 			/* R0.5: fftid, scratch offset */
 			gt.vs.scratch_pointer | fftid,
 			/* R0.6: thread id */
-			gt.vs.tid++ & 0xffffff,
+			__atomic_fetch_add(&gt.vs.tid, 1, __ATOMIC_RELAXED) & 0xffffff,
 			/* R0.7: Reserved */
 			0,
 		}
 	};
 
-	for (uint32_t c = 0; c < count; c++) {
-		void *entry = alloc_urb_entry(&gt.vs.urb);
-		t->buffer.vue_handles.ud[c] = urb_entry_to_handle(entry);
-	}
-
+	t->buffer.vue_handles = g->vue_handles;
 	grf[1].ireg = t->buffer.vue_handles.ireg;
 
-	if (gt.vs.statistics)
-		gt.vs_invocation_count++;
-
 	gt.vs.avx_shader(&t->t);
 
-	flush_to_vues(&t->buffer, count, state);
+	flush_to_vues(&t->buffer, g->count);
+}
+
+static void
+dispatch_vs_batch(void *data, uint32_t worker)
+{
+	struct vs_batch *b = data;
+	uint32_t i;
+
+	while (i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED),
+	       i < b->count)
+		dispatch_vs(&b->threads[worker], &b->groups[i]);
 }
 
 static void
@@ -572,11 +588,9 @@ emit_vertex_fetch(struct kir_program *prog)
 
 		/* FIXME: INDEX_BYTE and INDEX_WORD can read outside
 		 * the index buffer. */
-		uint64_t range;
-		void *index_buffer = map_gtt_offset(gt.vf.ib.address, &range);
 		struct kir_reg dst, base;
 
-		base = kir_program_set_load_base_imm(prog, index_buffer);
+		base = kir_program_set_load_base_imm(prog, gt.vf.ib.address);
 		switch (gt.vf.ib.format) {
 		case INDEX_BYTE:
 			dst = emit_gather(prog, base, vid, 1, 0);
@@ -649,7 +663,7 @@ emit_vertex_fetch(struct kir_program *prog)
 		}
 
 		struct kir_reg dst[4];
-		struct kir_reg base = kir_program_set_load_base_imm(prog, vb->data);
+		struct kir_reg base = kir_program_set_load_base_imm(prog, vb->address);
 		emit_load_format_simd8(prog, ve->format, base, offset, dst);
 
 		for (uint32_t c = 0; c < 4; c++) {
@@ -798,6 +812,15 @@ emit_viewport_transform(struct kir_program *prog, uint32_t base)
 	kir_program_store_v8(prog, vue_offset(base, z), zs);
 }
 
+void
+add_vertex_post_processing_key(struct shader_key *key)
+{
+	shader_key_add_u32(key, gt.clip.perspective_divide_disable);
+	shader_key_add_u32(key, gt.clip.guardband_clip_test_enable);
+	shader_key_add_u32(key, gt.clip.viewport_clip_test_enable);
+	shader_key_add_u32(key, gt.sf.viewport_transform_enable);
+}
+
 void
 emit_vertex_post_processing(struct kir_program *prog, uint32_t base)
 {
@@ -812,10 +835,65 @@ emit_vertex_post_processing(struct kir_program *prog, uint32_t base)
 		emit_viewport_transform(prog, base);
 }
 
+static void
+add_vs_key(struct shader_key *key)
+{
+	shader_key_add_value(key, gt.vs.binding_table_address);
+	shader_key_add_value(key, gt.vs.sampler_state_address);
+
+	shader_key_add_u32(key, gt.vs.enable);
+	if (gt.vs.enable) {
+		add_constants_key(key, &gt.vs.curbe, gt.vs.urb_start_grf);
+		shader_key_add_value(key, gt.vs.vue_read_offset);
+		shader_key_add_value(key, gt.vs.vue_read_length);
+		shader_key_add_kernel(key, gt.vs.ksp);
+	}
+
+	/* Vertex fetch bakes in the vertex layout and buffer addresses. The
+	 * pointers they map to are relocations, checked by the cache. */
+	shader_key_add_u32(key, gt.prim.start_vertex > 0);
+	shader_key_add_u32(key, gt.prim.start_instance > 0);
+	shader_key_add_u32(key, gt.prim.access_type);
+	if (gt.prim.access_type == RANDOM) {
+		shader_key_add_value(key, gt.vf.ib.address);
+		shader_key_add_value(key, gt.vf.ib.format);
+		shader_key_add_u32(key, gt.prim.base_vertex > 0);
+	}
+
+	shader_key_add_value(key, gt.vf.ve_count);
+	for (uint32_t i = 0; i < gt.vf.ve_count; i++) {
+		struct ve *ve = &gt.vf.ve[i];
+
+		shader_key_add_value(key, *ve);
+		if (ve->valid) {
+			shader_key_add_value(key, gt.vf.vb[ve->vb].pitch);
+			shader_key_add_value(key, gt.vf.vb[ve->vb].address);
+		}
+	}
+
+	shader_key_add_u32(key, gt.vf.iid_enable);
+	shader_key_add_value(key, gt.vf.iid_element);
+	shader_key_add_value(key, gt.vf.iid_component);
+	shader_key_add_u32(key, gt.vf.vid_enable);
+	shader_key_add_value(key, gt.vf.vid_element);
+	shader_key_add_value(key, gt.vf.vid_component);
+
+	shader_key_add_u32(key, gt.gs.enable);
+	shader_key_add_u32(key, gt.hs.enable);
+	add_vertex_post_processing_key(key);
+}
+
 static void
 compile_vs(void)
 {
 	struct kir_program prog;
+	struct shader_key key;
+
+	shader_key_init(&key, SHADER_VS);
+	add_vs_key(&key);
+	gt.vs.avx_shader = shader_cache_lookup(&key);
+	if (gt.vs.avx_shader)
+		return;
 
 	ksim_trace(TRACE_EU | TRACE_AVX, "jit vs\n");
 
@@ -854,7 +932,7 @@ compile_vs(void)
 
 	kir_program_add_insn(&prog, kir_eot);
 
-	gt.vs.avx_shader = kir_program_finish(&prog);
+	gt.vs.avx_shader = shader_cache_add(kir_program_finish(&prog));
 }
 
 void
@@ -879,16 +957,104 @@ init_vue_buffer(struct vue_buffer *b)
 	}
 }
 
+/* The vs threads live across draws, so only redo the parts of the
+ * setup whose inputs changed. */
 static void
-init_vs_thread(struct vs_thread *t)
+init_vs_thread(struct vs_thread *t, uint32_t dirty)
 {
 	t->start_vertex = gt.prim.start_vertex;
 	t->base_vertex = gt.prim.base_vertex;
 	t->start_instance = gt.prim.start_instance;
 
-	init_vue_buffer(&t->buffer);
+	if (dirty & DIRTY_VIEWPORT)
+		init_vue_buffer(&t->buffer);
+
+	if (dirty & DIRTY_VS_CONSTANTS)
+		load_constants(&t->t, &gt.vs.curbe);
+}
+
+static struct vs_batch *
+get_vs_batch(void)
+{
+	static struct vs_batch *batch;
+
+	if (batch == NULL) {
+		batch = aligned_alloc(32, sizeof(*batch));
+		ksim_assert(batch != NULL);
+		batch->threads = aligned_alloc(32, thread_pool_size() *
+					       sizeof(batch->threads[0]));
+		ksim_assert(batch->threads != NULL);
+		gt.dirty |= DIRTY_ALL;
+	}
 
-	load_constants(&t->t, &gt.vs.curbe);
+	return batch;
+}
+
+/* The stages don't depend on each other, so the dirty ones are
+ * compiled in parallel on the thread pool. Each worker builds into its
+ * own part of the code arena. */
+struct compile_jobs {
+	void (*compile[5])(void);
+	uint32_t count;
+	uint32_t next;
+};
+
+static void
+run_compile_jobs(void *data, uint32_t worker)
+{
+	struct compile_jobs *jobs = data;
+	uint32_t i;
+
+	while (i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED),
+	       i < jobs->count)
+		jobs->compile[i]();
+}
+
+static void
+compile_shaders(void)
+{
+	static const struct {
+		uint32_t dirty;
+		void (*compile)(void);
+	} stages[] = {
+		/* Up to three ps kernels, so start it first. */
+		{ DIRTY_PS, compile_ps },
+		{ DIRTY_VS, compile_vs },
+		{ DIRTY_HS, compile_hs },
+		{ DIRTY_DS, compile_ds },
+		{ DIRTY_GS, compile_gs },
+	};
+	struct compile_jobs jobs = { .count = 0, .next = 0 };
+
+	for (uint32_t i = 0; i < ARRAY_LENGTH(stages); i++)
+		if (gt.dirty & stages[i].dirty)
+			jobs.compile[jobs.count++] = stages[i].compile;
+
+	/* Keep jit traces from different stages apart. */
+	if (jobs.count > 1 && !(trace_mask & (TRACE_EU | TRACE_AVX)))
+		thread_pool_run(run_compile_jobs, &jobs);
+	else
+		run_compile_jobs(&jobs, 0);
+}
+
+void
+set_default_csr(void)
+{
+	/* Configure csr to round toward zero to make vcvtps2dq match
+	 * the GEN EU behavior when converting from float to int. This
+	 * may disagree with the rounding mode programmed in
+	 * 3DSTATE_PS etc, which only affects rounding of internal
+	 * intermediate float results. */
+	const uint32_t csr_default =
+		_MM_MASK_INVALID |
+		_MM_MASK_DENORM |
+		_MM_MASK_DIV_ZERO |
+		_MM_MASK_OVERFLOW |
+		_MM_MASK_UNDERFLOW |
+		_MM_MASK_INEXACT |
+		_MM_ROUND_TOWARD_ZERO;
+
+	_mm_setcsr(csr_default);
 }
 
 void
@@ -926,33 +1092,21 @@ dispatch_primitive(void)
 	gt.depth.hiz_buffer = map_gtt_offset(gt.depth.hiz_address, &range);
 	gt.depth.buffer = map_gtt_offset(gt.depth.address, &range);
 
-	/* Configure csr to round toward zero to make vcvtps2dq match
-	 * the GEN EU behavior when converting from float to int. This
-	 * may disagree with the rounding mode programmed in
-	 * 3DSTATE_PS etc, which only affects rounding of internal
-	 * intermediate float results. */
-	const uint32_t csr_default =
-		_MM_MASK_INVALID |
-		_MM_MASK_DENORM |
-		_MM_MASK_DIV_ZERO |
-		_MM_MASK_OVERFLOW |
-		_MM_MASK_UNDERFLOW |
-		_MM_MASK_INEXACT |
-		_MM_ROUND_TOWARD_ZERO;
+	set_default_csr();
 
-	_mm_setcsr(csr_default);
+	struct vs_batch *batch = get_vs_batch();
 
-	reset_shader_pool();
+	shader_cache_prepare();
 
-	compile_vs();
-	compile_hs();
-	compile_ds();
-	compile_gs();
-	compile_ps();
+	gt.dirty |= baked_constants_dirty();
+	compile_shaders();
 
-	struct vs_thread t;
+	const uint32_t workers = thread_pool_size();
+	for (uint32_t i = 0; i < workers; i++)
+		init_vs_thread(&batch->threads[i], gt.dirty);
 
-	init_vs_thread(&t);
+	/* Compute state is independent of the 3D pipeline. */
+	gt.dirty &= DIRTY_CS;
 
 	struct ia_state state;
 	struct prim_queue pq;
@@ -962,18 +1116,63 @@ dispatch_primitive(void)
 
 	prim_queue_init(&pq, gt.ia.topology, &gt.vs.urb);
 
-	for (uint32_t iid = 0; iid < gt.prim.instance_count; iid++) {
-		for (uint32_t i = 0; i < gt.prim.vertex_count; i += 8) {
-			dispatch_vs(&t, iid, i, &state);
+	uint32_t iid = 0, vid = 0;
+	while (iid < gt.prim.instance_count && gt.prim.vertex_count > 0) {
+		/* Only batch as many groups as we have URB entries
+		 * for. Everything that primitive assembly still holds
+		 * on to is already allocated. */
+		uint32_t max_groups = urb_entries_available(&gt.vs.urb) / 8;
+		if (max_groups == 0)
+			max_groups = 1;
+		else if (max_groups > MAX_VS_BATCH)
+			max_groups = MAX_VS_BATCH;
+
+		batch->count = 0;
+		batch->next = 0;
+		while (batch->count < max_groups &&
+		       iid < gt.prim.instance_count) {
+			struct vs_group *g = &batch->groups[batch->count++];
+			uint32_t rest = gt.prim.vertex_count - vid;
+
+			g->iid = iid;
+			g->vid = vid;
+			g->count = rest > 8 ? 8 : rest;
+			for (uint32_t c = 0; c < g->count; c++) {
+				void *entry = alloc_urb_entry(&gt.vs.urb);
+				g->vue_handles.ud[c] = urb_entry_to_handle(entry);
+			}
+
+			if (gt.vs.statistics)
+				gt.vs_invocation_count++;
+
+			vid += 8;
+			g->end_of_instance = vid >= gt.prim.vertex_count;
+			if (g->end_of_instance) {
+				vid = 0;
+				iid++;
+			}
+		}
+
+		thread_pool_run(dispatch_vs_batch, batch);
+
+		for (uint32_t i = 0; i < batch->count; i++) {
+			struct vs_group *g = &batch->groups[i];
+
+			/* FIXME: Cut index: ia_state_flush(), ia_state_cut(); else add... */
+			for (uint32_t c = 0; c < g->count; c++)
+				ia_state_add(&state, urb_handle_to_entry(g->vue_handles.ud[c]));
+			ksim_assert(state.head - state.tail <= 64);
 
 			tail = ia_state_flush(&state, &pq);
 			for (uint32_t i = tail; i < state.tail; i++)
 				prim_queue_free_vue(&pq, ia_state_peek(&state, i));
-		}
 
-		tail = ia_state_cut(&state, &pq);
-		for (uint32_t i = tail; i < state.tail; i++)
-			prim_queue_free_vue(&pq, ia_state_peek(&state, i));
+			if (g->end_of_instance) {
+				tail = ia_state_cut(&state, &pq);
+				for (uint32_t i = tail; i < state.tail; i++)
+					prim_queue_free_vue(&pq, ia_state_peek(&state, i));
+			}
+		}
 	}
 
 	prim_queue_flush(&pq);
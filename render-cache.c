@@ -674,6 +674,78 @@ pick_render_cache_function(enum message_type type, enum message_subtype subtype,
 	}
 }
 
+/* Linear RGBA8 render targets are common enough that we write them
+ * inline instead of calling out to the C helpers. Pixels 0, 1, 4 and
+ * 5 go to row y and 2, 3, 6 and 7 to row y + 1. We don't have a
+ * permute in kir, so we do a masked store per pixel pair, biasing the
+ * store offset so that the pair lands at the right address. */
+static void
+emit_rt_write_simd8_rgba8_linear(struct kir_program *prog, uint32_t src,
+				 const struct surface *rt)
+{
+	static const int16_t pairs[4][8] = {
+		{ -1, -1,  0,  0,  0,  0,  0,  0 },
+		{  0,  0,  0,  0, -1, -1,  0,  0 },
+		{  0,  0, -1, -1,  0,  0,  0,  0 },
+		{  0,  0,  0,  0,  0,  0, -1, -1 },
+	};
+	const int32_t pair_offset[4] = {
+		0, -8, rt->stride - 8, rt->stride - 16
+	};
+	const uint32_t slice_y = rt->minimum_array_element * rt->qpitch;
+	struct kir_reg c[4], rgba, xy, x, y, offset, base, exec_mask, mask;
+	union kir_imm imm;
+
+	kir_program_comment(prog, "rt write: linear rgba8, format %d", rt->format);
+
+	for (uint32_t i = 0; i < 4; i++) {
+		c[i] = kir_program_load_v8(prog, offsetof(struct thread, grf[src + i]));
+		if (rt->format != SF_R8G8B8A8_UNORM)
+			continue;
+
+		kir_program_immf(prog, 1.0f);
+		c[i] = kir_program_alu(prog, kir_minf, c[i], prog->dst);
+		kir_program_immf(prog, 0.0f);
+		c[i] = kir_program_alu(prog, kir_maxf, c[i], prog->dst);
+		kir_program_immf(prog, 255.0f);
+		c[i] = kir_program_alu(prog, kir_mulf, c[i], prog->dst);
+		kir_program_immf(prog, 0.5f);
+		c[i] = kir_program_alu(prog, kir_addf, c[i], prog->dst);
+		c[i] = kir_program_alu(prog, kir_ps2d, c[i]);
+	}
+
+	rgba = kir_program_alu(prog, kir_shli, c[3], 8);
+	rgba = kir_program_alu(prog, kir_or, rgba, c[2]);
+	rgba = kir_program_alu(prog, kir_shli, rgba, 8);
+	rgba = kir_program_alu(prog, kir_or, rgba, c[1]);
+	rgba = kir_program_alu(prog, kir_shli, rgba, 8);
+	rgba = kir_program_alu(prog, kir_or, rgba, c[0]);
+
+	/* Pixel x and y of the first subspan are in g1.4 and g1.5. */
+	xy = kir_program_load_uniform(prog, offsetof(struct thread, grf[1].ud[2]));
+	kir_program_immd(prog, 0xffff);
+	x = kir_program_alu(prog, kir_and, xy, prog->dst);
+	x = kir_program_alu(prog, kir_shli, x, 2);
+	y = kir_program_alu(prog, kir_shri, xy, 16);
+	if (slice_y > 0) {
+		kir_program_immd(prog, slice_y);
+		y = kir_program_alu(prog, kir_addd, y, prog->dst);
+	}
+	kir_program_immd(prog, rt->stride);
+	y = kir_program_alu(prog, kir_muld, y, prog->dst);
+	offset = kir_program_alu(prog, kir_addd, x, y);
+	base = kir_program_set_load_base_imm_offset(prog, rt->address, offset);
+
+	exec_mask = kir_program_load_v8(prog, offsetof(struct thread, mask[prog->scope].q[0]));
+	for (uint32_t i = 0; i < 4; i++) {
+		memcpy(imm.v, pairs[i], sizeof(imm.v));
+		kir_program_imm(prog, kir_immv, imm);
+		kir_program_alu(prog, kir_sxwd, prog->dst);
+		mask = kir_program_alu(prog, kir_and, exec_mask, prog->dst);
+		kir_program_mask_store(prog, base, pair_offset[i], rgba, mask);
+	}
+}
+
 void
 builder_emit_sfid_render_cache_helper(struct kir_program *prog,
 				      uint32_t exec_size,
@@ -692,6 +764,14 @@ builder_emit_sfid_render_cache_helper(struct kir_program *prog,
 	if (!rt_valid)
 		return;
 
+	if (type == MSD_RTW && subtype == MESSAGE_SUBTYPE_SIMD8_LO &&
+	    args->rt.tile_mode == LINEAR &&
+	    (args->rt.format == SF_R8G8B8A8_UNORM ||
+	     args->rt.format == SF_R8G8B8A8_UINT)) {
+		emit_rt_write_simd8_rgba8_linear(prog, src, &args->rt);
+		return;
+	}
+
 	struct kir_insn *insn = kir_program_add_insn(prog, kir_send);
 	insn->send.exec_size = exec_size;
 	insn->send.src = src;
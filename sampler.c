@@ -748,6 +748,68 @@ sfid_sampler_noop_stub(struct thread *t, const struct sfid_sampler_args *args)
 	dst[3].reg = _mm256_set1_ps(1.0f);
 }
 
+/* SIMD8 ld from a linear surface of 32 bit channels is just a gather
+ * per channel, which we can do inline. */
+static bool
+emit_sampler_ld_simd8_linear(struct kir_program *prog,
+			     const struct sfid_sampler_args *args)
+{
+	struct kir_reg u, v, offset, base, mask, dst;
+	uint32_t channels;
+
+	switch (args->tex.format) {
+	case SF_R32_FLOAT:
+	case SF_R32_SINT:
+	case SF_R32_UINT:
+		channels = 1;
+		break;
+	case SF_R32G32_FLOAT:
+	case SF_R32G32_SINT:
+	case SF_R32G32_UINT:
+		channels = 2;
+		break;
+	case SF_R32G32B32_FLOAT:
+	case SF_R32G32B32_SINT:
+	case SF_R32G32B32_UINT:
+		channels = 3;
+		break;
+	case SF_R32G32B32A32_FLOAT:
+	case SF_R32G32B32A32_SINT:
+	case SF_R32G32B32A32_UINT:
+		channels = 4;
+		break;
+	default:
+		return false;
+	}
+
+	kir_program_comment(prog, "sampler ld: linear, format %d", args->tex.format);
+
+	u = kir_program_load_v8(prog, offsetof(struct thread, grf[args->src]));
+	kir_program_immd(prog, args->tex.cpp);
+	u = kir_program_alu(prog, kir_muld, u, prog->dst);
+	v = kir_program_load_v8(prog, offsetof(struct thread, grf[args->src + 1]));
+	kir_program_immd(prog, args->tex.stride);
+	v = kir_program_alu(prog, kir_muld, v, prog->dst);
+	offset = kir_program_alu(prog, kir_addd, u, v);
+	base = kir_program_set_load_base_imm(prog, args->tex.address);
+
+	for (uint32_t i = 0; i < args->rlen; i++) {
+		if (i < channels) {
+			/* vpgatherdd clears the mask, so load it for
+			 * each gather. */
+			mask = kir_program_load_v8(prog, offsetof(struct thread, mask[0].q[0]));
+			dst = kir_program_gather(prog, base, offset, mask, 1, i * 4);
+		} else if (i < 3) {
+			dst = kir_program_immd(prog, 0);
+		} else {
+			dst = kir_program_immf(prog, 1.0f);
+		}
+		kir_program_store_v8(prog, offsetof(struct thread, grf[args->dst + i]), dst);
+	}
+
+	return true;
+}
+
 void
 builder_emit_sfid_sampler(struct kir_program *prog, struct inst *inst)
 {
@@ -787,6 +849,9 @@ builder_emit_sfid_sampler(struct kir_program *prog, struct inst *inst)
 			func = sfid_sampler_ld_simd4x2_linear;
 		} else if (d.simd_mode == SIMD_MODE_SIMD8 &&
 			   args->tex.tile_mode == LINEAR) {
+			args->rlen = send.rlen;
+			if (send.rlen > 0 && emit_sampler_ld_simd8_linear(prog, args))
+				return;
 			func = sfid_sampler_ld_simd8_linear;
 		} else if (d.simd_mode == SIMD_MODE_SIMD16 &&
 			   args->tex.tile_mode == LINEAR) {
@@ -0,0 +1,805 @@
+/*
+ * Copyright © 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <link.h>
+#include <sys/stat.h>
+
+#include "ksim.h"
+
+/* Compiled shaders are cached across draws and walkers. The key is
+ * the kernel binary plus all the gt state that the compile_*
+ * functions bake into the generated code. The compiler also reads
+ * surface state through get_surface() and bakes formats, tiling and
+ * pixel pointers into the send arguments. That state lives in
+ * memory the batches can rewrite behind our back, so each entry
+ * records the surfaces it was compiled against and a lookup only
+ * hits if they still unpack to the same thing.
+ *
+ * Once the shaders in the cache take up more than SHADER_CACHE_SIZE
+ * bytes of code and constants, the least recently used ones are
+ * evicted and their code freed.
+ *
+ * With a cache directory set, every compiled shader is also written
+ * out as a relocatable image, in a file named after its key hash, and
+ * a miss in memory looks for the file before compiling. Host
+ * pointers never go into the key or the file. Pointers into buffers
+ * are stored as gtt addresses and mapped again on load, functions as
+ * library offsets.
+ *
+ * With tiering enabled, a miss compiles a cheap baseline shader that
+ * counts its invocations. Once a baseline shader has run
+ * tier_threshold times, shader_cache_prepare() frees it and leaves
+ * the entry behind without a shader, marking the key as hot. The next
+ * lookup misses again and the shader is compiled with the full
+ * optimizer. Only optimized shaders are written to disk. */
+
+#define SHADER_CACHE_BUCKETS 256
+#define SHADER_CACHE_SIZE (32 * 1024 * 1024)
+
+struct surface_dep {
+	uint32_t binding_table_offset;
+	int index;
+	bool valid;
+	struct surface surface;
+};
+
+struct shader_entry {
+	struct shader_entry *next;
+	struct list link;
+	struct shader_key key;
+	shader_t shader;
+
+	/* Baseline shaders count invocations here, in the shader's
+	 * constant data, and sit on the baseline list. */
+	uint64_t *invocations;
+	struct list baseline_link;
+	bool hot;
+
+	uint32_t dep_count;
+	uint32_t dep_size;
+	struct surface_dep *deps;
+};
+
+/* Stages may be compiled in parallel, so the table is protected by
+ * a lock and each thread has its own pending entry. */
+static struct {
+	pthread_mutex_t mutex;
+	struct shader_entry *buckets[SHADER_CACHE_BUCKETS];
+
+	/* All entries, most recently used first. */
+	struct list lru;
+
+	/* Entries with a baseline shader. */
+	struct list baseline;
+
+	uint32_t count;
+	uint64_t hits;
+	uint64_t misses;
+} cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.lru = { &cache.lru, &cache.lru },
+	.baseline = { &cache.baseline, &cache.baseline },
+};
+
+/* The entry for the shader this thread is compiling, if any. */
+static __thread struct shader_entry *pending;
+
+static const uint64_t fnv_offset_basis = 0xcbf29ce484222325ull;
+static const uint64_t fnv_prime = 0x100000001b3ull;
+
+void
+shader_key_init(struct shader_key *key, enum shader_stage stage)
+{
+	key->stage = stage;
+	key->ksp = 0;
+	key->hash = fnv_offset_basis;
+	key->size = 0;
+	key->alloc = 0;
+	key->data = NULL;
+
+	shader_key_add_u32(key, stage);
+
+	/* Tracing adds calls to the generated code. */
+	shader_key_add_u32(key, trace_mask);
+}
+
+void
+shader_key_add(struct shader_key *key, const void *data, size_t size)
+{
+	const uint8_t *bytes = data;
+
+	if (key->size + size > key->alloc) {
+		key->alloc = key->alloc ? key->alloc * 2 : 256;
+		while (key->alloc < key->size + size)
+			key->alloc *= 2;
+		key->data = realloc(key->data, key->alloc);
+		ksim_assert(key->data != NULL);
+	}
+
+	memcpy(key->data + key->size, data, size);
+	key->size += size;
+
+	for (size_t i = 0; i < size; i++)
+		key->hash = (key->hash ^ bytes[i]) * fnv_prime;
+}
+
+void
+shader_key_add_kernel(struct shader_key *key, uint64_t kernel_offset)
+{
+	uint64_t range;
+	const uint32_t size = kernel_size(kernel_offset);
+	const void *kernel =
+		map_gtt_offset(kernel_offset + gt.instruction_base_address, &range);
+
+	key->ksp = kernel_offset;
+	shader_key_add_u32(key, size);
+	shader_key_add(key, kernel, size);
+}
+
+/* The pixel pointer is a relocation in the shader and validated as
+ * such, so only compare the gtt address here. */
+static bool
+surface_equal(const struct surface *a, const struct surface *b)
+{
+	return a->address == b->address &&
+		a->format == b->format &&
+		a->type == b->type &&
+		a->width == b->width &&
+		a->height == b->height &&
+		a->stride == b->stride &&
+		a->cpp == b->cpp &&
+		a->qpitch == b->qpitch &&
+		a->minimum_array_element == b->minimum_array_element &&
+		a->tile_mode == b->tile_mode;
+}
+
+static bool
+validate_deps(struct shader_entry *e)
+{
+	for (uint32_t i = 0; i < e->dep_count; i++) {
+		struct surface_dep *d = &e->deps[i];
+		struct surface s;
+		bool valid;
+
+		valid = get_surface(d->binding_table_offset, d->index, &s);
+		if (valid != d->valid)
+			return false;
+		if (valid && !surface_equal(&s, &d->surface))
+			return false;
+	}
+
+	return true;
+}
+
+/* Buffers can be unbound and others bound at the same gtt address, so
+ * check that the pointers baked into the shader are still current. */
+static bool
+validate_pointers(shader_t shader)
+{
+	struct shader_image image;
+	uint64_t range;
+
+	shader_get_image(shader, &image);
+	for (uint32_t i = 0; i < image.reloc_count; i++) {
+		const struct shader_reloc *r = &image.relocs[i];
+		void *const *slot = image.constants + r->offset;
+
+		if (r->type == RELOC_POINTER &&
+		    *slot != map_gtt_offset(r->target, &range))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+key_equal(const struct shader_key *a, const struct shader_key *b)
+{
+	return a->hash == b->hash &&
+		a->size == b->size &&
+		memcmp(a->data, b->data, a->size) == 0;
+}
+
+static void
+unlink_entry(struct shader_entry *e)
+{
+	struct shader_entry **prev;
+
+	prev = &cache.buckets[e->key.hash % SHADER_CACHE_BUCKETS];
+	while (*prev != e)
+		prev = &(*prev)->next;
+	*prev = e->next;
+}
+
+static const char *const stage_names[] = {
+	[SHADER_VS] = "vs",
+	[SHADER_HS] = "hs",
+	[SHADER_DS] = "ds",
+	[SHADER_GS] = "gs",
+	[SHADER_PS] = "ps",
+	[SHADER_CS] = "cs",
+};
+
+static void
+insert_entry(struct shader_entry *e)
+{
+	const uint32_t bucket = e->key.hash % SHADER_CACHE_BUCKETS;
+	struct shader_entry *old, *next;
+
+	pthread_mutex_lock(&cache.mutex);
+
+	/* An optimized shader replaces the entry that marked its key
+	 * as hot. */
+	if (e->invocations == NULL) {
+		for (old = cache.buckets[bucket]; old != NULL; old = next) {
+			next = old->next;
+			if (old->shader == NULL && key_equal(&old->key, &e->key)) {
+				unlink_entry(old);
+				free(old->key.data);
+				free(old->deps);
+				free(old);
+			}
+		}
+	}
+
+	/* A stale entry with the same key may still be in the
+	 * bucket if its surfaces changed. New entries go first, so
+	 * lookups find the newest version. */
+	e->next = cache.buckets[bucket];
+	cache.buckets[bucket] = e;
+	list_insert(&cache.lru, &e->link);
+	if (e->invocations)
+		list_insert(&cache.baseline, &e->baseline_link);
+	cache.count++;
+
+	pthread_mutex_unlock(&cache.mutex);
+
+	perf_add_shader(e->shader, "ksim_%s_ksp_0x%lx_%016lx%s",
+			stage_names[e->key.stage], e->key.ksp, e->key.hash,
+			e->invocations ? "_baseline" : "");
+}
+
+#define DISK_MAGIC 0x4d49534b /* "KSIM" */
+#define DISK_VERSION 1
+#define MAX_LIBRARIES 8
+
+struct disk_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_size;
+	uint32_t dep_count;
+	uint32_t code_size;
+	uint32_t const_size;
+	uint32_t reloc_count;
+	uint32_t library_count;
+};
+
+/* Call targets are stored as an offset into one of the libraries the
+ * shader calls into, which is identified by its path, size and mtime.
+ * Library 0 is always ksim itself, so a rebuilt ksim never loads
+ * shaders generated by an older version. */
+struct disk_library {
+	char name[256];
+	uint64_t size;
+	int64_t mtime;
+};
+
+#define LIBRARY_SHIFT 48
+
+static void
+disk_path(char *path, size_t size, uint64_t hash)
+{
+	snprintf(path, size, "%s/%016lx", shader_cache_dir, hash);
+}
+
+static bool
+get_library(struct link_map *map, struct disk_library *lib)
+{
+	struct stat st;
+
+	if (strlen(map->l_name) == 0 ||
+	    strlen(map->l_name) >= sizeof(lib->name) ||
+	    stat(map->l_name, &st) != 0)
+		return false;
+
+	memset(lib, 0, sizeof(*lib));
+	strcpy(lib->name, map->l_name);
+	lib->size = st.st_size;
+	lib->mtime = st.st_mtime;
+
+	return true;
+}
+
+static int
+add_library(struct disk_library *libs, uint32_t *count, const void *func,
+	    uint64_t *offset)
+{
+	struct disk_library lib;
+	struct link_map *map;
+	Dl_info info;
+
+	if (!dladdr1(func, &info, (void **) &map, RTLD_DL_LINKMAP) ||
+	    !get_library(map, &lib))
+		return -1;
+
+	*offset = (uintptr_t) func - map->l_addr;
+
+	for (uint32_t i = 0; i < *count; i++)
+		if (strcmp(libs[i].name, lib.name) == 0)
+			return i;
+
+	if (*count == MAX_LIBRARIES)
+		return -1;
+
+	libs[*count] = lib;
+
+	return (*count)++;
+}
+
+/* Only the fields validate_deps() compares go to disk. The surface
+ * pixels pointer is only good in this process, and copying field by
+ * field leaves the padding zeroed. */
+static void
+disk_dep(struct surface_dep *out, const struct surface_dep *d)
+{
+	memset(out, 0, sizeof(*out));
+	out->binding_table_offset = d->binding_table_offset;
+	out->index = d->index;
+	out->valid = d->valid;
+	out->surface.address = d->surface.address;
+	out->surface.format = d->surface.format;
+	out->surface.type = d->surface.type;
+	out->surface.width = d->surface.width;
+	out->surface.height = d->surface.height;
+	out->surface.stride = d->surface.stride;
+	out->surface.cpp = d->surface.cpp;
+	out->surface.qpitch = d->surface.qpitch;
+	out->surface.minimum_array_element = d->surface.minimum_array_element;
+	out->surface.tile_mode = d->surface.tile_mode;
+}
+
+static void
+save_entry(struct shader_entry *e)
+{
+	struct disk_library libs[MAX_LIBRARIES];
+	struct shader_image image;
+	struct shader_reloc *relocs;
+	struct surface_dep *deps;
+	uint32_t lib_count = 0;
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	uint64_t offset;
+	FILE *f;
+	int lib;
+
+	shader_get_image(e->shader, &image);
+
+	add_library(libs, &lib_count, shader_cache_lookup, &offset);
+	if (lib_count != 1)
+		return;
+
+	relocs = malloc(image.reloc_count * sizeof(relocs[0]));
+	ksim_assert(image.reloc_count == 0 || relocs != NULL);
+	for (uint32_t i = 0; i < image.reloc_count; i++) {
+		relocs[i] = image.relocs[i];
+		if (relocs[i].type != RELOC_CALL)
+			continue;
+
+		lib = add_library(libs, &lib_count,
+				  (void *) (uintptr_t) relocs[i].target, &offset);
+		if (lib < 0) {
+			trace(TRACE_EU, "shader cache: can't relocate call to %p\n",
+			      (void *) (uintptr_t) relocs[i].target);
+			free(relocs);
+			return;
+		}
+		relocs[i].target = ((uint64_t) lib << LIBRARY_SHIFT) | offset;
+	}
+
+	struct disk_header header = {
+		.magic = DISK_MAGIC,
+		.version = DISK_VERSION,
+		.key_size = e->key.size,
+		.dep_count = e->dep_count,
+		.code_size = image.code_size,
+		.const_size = image.const_size,
+		.reloc_count = image.reloc_count,
+		.library_count = lib_count,
+	};
+
+	deps = malloc(e->dep_count * sizeof(deps[0]));
+	ksim_assert(e->dep_count == 0 || deps != NULL);
+	for (uint32_t i = 0; i < e->dep_count; i++)
+		disk_dep(&deps[i], &e->deps[i]);
+
+	/* Write to a temporary file and rename it into place, so
+	 * concurrent runs never see a partial file. */
+	disk_path(path, sizeof(path), e->key.hash);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		free(deps);
+		free(relocs);
+		return;
+	}
+
+	bool ok =
+		fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(libs, sizeof(libs[0]), lib_count, f) == lib_count &&
+		fwrite(e->key.data, 1, e->key.size, f) == e->key.size &&
+		fwrite(deps, sizeof(deps[0]), e->dep_count, f) == e->dep_count &&
+		fwrite(relocs, sizeof(relocs[0]), image.reloc_count, f) == image.reloc_count &&
+		fwrite(image.code, 1, image.code_size, f) == image.code_size &&
+		fwrite(image.constants, 1, image.const_size, f) == image.const_size;
+
+	free(deps);
+	free(relocs);
+
+	if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+struct find_library {
+	const char *name;
+	uintptr_t base;
+};
+
+static int
+find_library_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct find_library *find = data;
+
+	if (strcmp(info->dlpi_name, find->name) != 0)
+		return 0;
+
+	find->base = info->dlpi_addr;
+
+	return 1;
+}
+
+/* The cache files aren't trusted, a reloc that points outside the code
+ * or constants would have shader_from_image() write out of bounds. */
+static bool
+valid_reloc(const struct shader_reloc *r, const struct disk_header *header)
+{
+	switch (r->type) {
+	case RELOC_CONST:
+		return header->code_size >= 4 &&
+			r->offset <= header->code_size - 4 &&
+			r->target < header->const_size;
+	case RELOC_CALL:
+		return header->code_size >= 4 &&
+			r->offset <= header->code_size - 4 &&
+			(r->target >> LIBRARY_SHIFT) < header->library_count;
+	case RELOC_POINTER:
+		return header->const_size >= 8 &&
+			r->offset <= header->const_size - 8;
+	default:
+		return false;
+	}
+}
+
+static struct shader_entry *
+load_entry(struct shader_key *key)
+{
+	struct shader_entry *e = NULL;
+	struct disk_header *header;
+	struct disk_library *libs;
+	struct surface_dep *deps;
+	struct shader_reloc *relocs;
+	struct shader_image image;
+	uintptr_t bases[MAX_LIBRARIES];
+	char path[PATH_MAX];
+	uint64_t range;
+	struct stat st;
+	void *data, *p;
+	int fd;
+
+	disk_path(path, sizeof(path), key->hash);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	header = data;
+	p = data + sizeof(*header);
+	libs = p;
+	p += header->library_count * sizeof(*libs);
+	const void *key_data = p;
+	p += header->key_size;
+	deps = p;
+	p += header->dep_count * sizeof(*deps);
+	relocs = p;
+	p += header->reloc_count * sizeof(*relocs);
+	image.code = p;
+	p += header->code_size;
+	image.constants = p;
+	p += header->const_size;
+
+	if (header->magic != DISK_MAGIC ||
+	    header->version != DISK_VERSION ||
+	    header->library_count > MAX_LIBRARIES ||
+	    p - data != st.st_size ||
+	    header->key_size != key->size ||
+	    memcmp(key_data, key->data, key->size) != 0)
+		goto out;
+
+	if (header->code_size > SHADER_MAX_SIZE ||
+	    header->const_size > SHADER_MAX_SIZE)
+		goto out;
+
+	for (uint32_t i = 0; i < header->reloc_count; i++) {
+		if (!valid_reloc(&relocs[i], header))
+			goto out;
+	}
+
+	for (uint32_t i = 0; i < header->library_count; i++) {
+		struct find_library find = { .name = libs[i].name };
+		struct stat lib_st;
+
+		if (stat(libs[i].name, &lib_st) != 0 ||
+		    lib_st.st_size != libs[i].size ||
+		    lib_st.st_mtime != libs[i].mtime ||
+		    !dl_iterate_phdr(find_library_cb, &find))
+			goto out;
+		bases[i] = find.base;
+	}
+
+	e = calloc(1, sizeof(*e));
+	ksim_assert(e != NULL);
+	e->dep_count = header->dep_count;
+	e->dep_size = header->dep_count;
+	e->deps = malloc(e->dep_count * sizeof(e->deps[0]));
+	ksim_assert(e->dep_count == 0 || e->deps != NULL);
+	memcpy(e->deps, deps, e->dep_count * sizeof(e->deps[0]));
+
+	if (!validate_deps(e)) {
+		free(e->deps);
+		free(e);
+		e = NULL;
+		goto out;
+	}
+
+	image.code_size = header->code_size;
+	image.const_size = header->const_size;
+	image.reloc_count = header->reloc_count;
+	struct shader_reloc *fixed = malloc(image.reloc_count * sizeof(fixed[0]));
+	ksim_assert(image.reloc_count == 0 || fixed != NULL);
+	for (uint32_t i = 0; i < image.reloc_count; i++) {
+		fixed[i] = relocs[i];
+		if (fixed[i].type == RELOC_CALL) {
+			const uint32_t lib = fixed[i].target >> LIBRARY_SHIFT;
+			const uint64_t offset =
+				fixed[i].target & ((1ull << LIBRARY_SHIFT) - 1);
+
+			fixed[i].target = bases[lib] + offset;
+		}
+	}
+	image.relocs = fixed;
+
+	e->shader = shader_from_image(&image);
+	free(fixed);
+
+	/* Now map the gtt addresses the shader uses in this process. */
+	shader_get_image(e->shader, &image);
+	for (uint32_t i = 0; i < image.reloc_count; i++) {
+		const struct shader_reloc *r = &image.relocs[i];
+		void **slot = (void *) image.constants + r->offset;
+
+		if (r->type == RELOC_POINTER)
+			*slot = map_gtt_offset(r->target, &range);
+	}
+
+	e->key = *key;
+
+	trace(TRACE_EU, "shader cache: loaded %s\n", path);
+
+ out:
+	munmap(data, st.st_size);
+
+	return e;
+}
+
+shader_t
+shader_cache_lookup(struct shader_key *key)
+{
+	const uint32_t bucket = key->hash % SHADER_CACHE_BUCKETS;
+	struct shader_entry *e;
+	bool hot = false;
+
+	ksim_assert(pending == NULL);
+
+	pthread_mutex_lock(&cache.mutex);
+	for (e = cache.buckets[bucket]; e != NULL; e = e->next) {
+		if (!key_equal(&e->key, key))
+			continue;
+
+		if (e->shader == NULL) {
+			hot = true;
+			continue;
+		}
+
+		if (validate_deps(e) && validate_pointers(e->shader)) {
+			__atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+			list_remove(&e->link);
+			list_insert(&cache.lru, &e->link);
+			pthread_mutex_unlock(&cache.mutex);
+			free(key->data);
+			return e->shader;
+		}
+	}
+	pthread_mutex_unlock(&cache.mutex);
+
+	if (shader_cache_dir) {
+		e = load_entry(key);
+		if (e) {
+			insert_entry(e);
+			__atomic_add_fetch(&cache.hits, 1, __ATOMIC_RELAXED);
+			return e->shader;
+		}
+	}
+
+	/* Miss: the caller compiles the shader and hands it to
+	 * shader_cache_add(). Until then, get_surface() calls are
+	 * recorded as dependencies of the new entry. */
+	__atomic_add_fetch(&cache.misses, 1, __ATOMIC_RELAXED);
+	e = calloc(1, sizeof(*e));
+	ksim_assert(e != NULL);
+	e->key = *key;
+	e->hot = hot;
+	pending = e;
+
+	return NULL;
+}
+
+/* Whether the shader being compiled should be a baseline shader. */
+bool
+shader_cache_baseline(void)
+{
+	return tier_threshold > 0 && pending != NULL && !pending->hot;
+}
+
+void
+shader_cache_set_invocations(uint64_t *invocations)
+{
+	ksim_assert(pending != NULL);
+
+	pending->invocations = invocations;
+}
+
+shader_t
+shader_cache_add(shader_t shader)
+{
+	struct shader_entry *e = pending;
+
+	ksim_assert(e != NULL);
+
+	e->shader = shader;
+	insert_entry(e);
+	pending = NULL;
+
+	if (shader_cache_dir && e->invocations == NULL)
+		save_entry(e);
+
+	trace(TRACE_EU, "shader cache: %d entries, %ld hits, %ld misses\n",
+	      cache.count, cache.hits, cache.misses);
+
+	return shader;
+}
+
+void
+shader_cache_add_surface(uint32_t binding_table_offset, int i,
+			 bool valid, const struct surface *s)
+{
+	struct shader_entry *e = pending;
+
+	if (e == NULL)
+		return;
+
+	for (uint32_t j = 0; j < e->dep_count; j++)
+		if (e->deps[j].binding_table_offset == binding_table_offset &&
+		    e->deps[j].index == i)
+			return;
+
+	if (e->dep_count == e->dep_size) {
+		e->dep_size = e->dep_size ? e->dep_size * 2 : 4;
+		e->deps = realloc(e->deps, e->dep_size * sizeof(e->deps[0]));
+		ksim_assert(e->deps != NULL);
+	}
+
+	e->deps[e->dep_count++] = (struct surface_dep) {
+		.binding_table_offset = binding_table_offset,
+		.index = i,
+		.valid = valid,
+		.surface = *s,
+	};
+}
+
+static void
+free_entry_shader(struct shader_entry *e)
+{
+	list_remove(&e->link);
+	if (e->invocations)
+		list_remove(&e->baseline_link);
+	e->invocations = NULL;
+	free_shader(e->shader);
+	e->shader = NULL;
+	cache.count--;
+}
+
+static void
+evict_entry(struct shader_entry *e)
+{
+	unlink_entry(e);
+	free_entry_shader(e);
+	free(e->key.data);
+	free(e->deps);
+	free(e);
+}
+
+/* Called before compiling the shaders for a draw or walker, which is
+ * the only time no cached shader is in use. */
+void
+shader_cache_prepare(void)
+{
+	struct shader_entry *e, *next;
+
+	pthread_mutex_lock(&cache.mutex);
+	while (shader_arena_size() > SHADER_CACHE_SIZE &&
+	       !list_empty(&cache.lru)) {
+		e = container_of(cache.lru.prev, e, link);
+		evict_entry(e);
+
+		/* Stages that aren't dirty hold on to their shaders
+		 * without looking them up, and this one may be in
+		 * use. */
+		gt.dirty |= DIRTY_SHADERS;
+	}
+
+	list_for_each_entry_safe(e, next, &cache.baseline, baseline_link) {
+		if (*e->invocations < tier_threshold)
+			continue;
+
+		trace(TRACE_EU, "shader cache: %016lx is hot, recompiling\n",
+		      e->key.hash);
+		free_entry_shader(e);
+		gt.dirty |= DIRTY_SHADERS;
+	}
+	pthread_mutex_unlock(&cache.mutex);
+}
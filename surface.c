@@ -24,8 +24,8 @@
 #include <libpng16/png.h>
 #include "ksim.h"
 
-bool
-get_surface(uint32_t binding_table_offset, int i, struct surface *s)
+static bool
+unpack_surface(uint32_t binding_table_offset, int i, struct surface *s)
 {
 	uint64_t range;
 	const uint32_t *binding_table;
@@ -53,7 +53,8 @@ get_surface(uint32_t binding_table_offset, int i, struct surface *s)
 	s->tile_mode = v.TileMode;
 	s->qpitch = v.SurfaceQPitch << 2;
 	s->minimum_array_element = v.MinimumArrayElement;
-	s->pixels = map_gtt_offset(v.SurfaceBaseAddress, &range);
+	s->address = v.SurfaceBaseAddress;
+	s->pixels = map_gtt_offset(s->address, &range);
 
 	const uint32_t block_size = format_block_size(s->format);
 	const uint32_t height_in_blocks = DIV_ROUND_UP(s->height, block_size);
@@ -66,6 +67,20 @@ get_surface(uint32_t binding_table_offset, int i, struct surface *s)
 	return true;
 }
 
+bool
+get_surface(uint32_t binding_table_offset, int i, struct surface *s)
+{
+	bool valid = unpack_surface(binding_table_offset, i, s);
+
+	/* The jit bakes surface state into the code, so let the
+	 * shader cache know what the current shader depends on. */
+	shader_cache_add_surface(binding_table_offset, i, valid, s);
+	if (valid)
+		shader_reloc_pointer(&s->pixels, s->address);
+
+	return valid;
+}
+
 static char *
 detile_xmajor(struct surface *s, __m256i alpha)
 {
@@ -48,14 +48,32 @@ emit_load_hs_payload(struct kir_program *prog)
 	/* FIXME: Load vertex data. */
 }
 
+static void
+add_hs_key(struct shader_key *key)
+{
+	shader_key_add_value(key, gt.hs.binding_table_address);
+	shader_key_add_value(key, gt.hs.sampler_state_address);
+	shader_key_add_value(key, gt.ia.topology);
+	shader_key_add_u32(key, gt.hs.include_vertex_handles);
+	add_constants_key(key, &gt.hs.curbe, gt.hs.urb_start_grf);
+	shader_key_add_kernel(key, gt.hs.ksp);
+}
+
 void
 compile_hs(void)
 {
 	struct kir_program prog;
+	struct shader_key key;
 
 	if (!gt.hs.enable)
 		return;
 
+	shader_key_init(&key, SHADER_HS);
+	add_hs_key(&key);
+	gt.hs.avx_shader = shader_cache_lookup(&key);
+	if (gt.hs.avx_shader)
+		return;
+
 	ksim_trace(TRACE_EU | TRACE_AVX, "jit hs\n");
 
 	kir_program_init(&prog,
@@ -69,7 +87,7 @@ compile_hs(void)
 
 	kir_program_add_insn(&prog, kir_eot);
 
-	gt.hs.avx_shader = kir_program_finish(&prog);
+	gt.hs.avx_shader = shader_cache_add(kir_program_finish(&prog));
 }
 
 void
@@ -247,16 +265,37 @@ emit_load_ds_payload(struct kir_program *prog)
 	emit_load_constants(prog, &gt.ds.curbe, gt.ds.urb_start_grf);
 }
 
+static void
+add_ds_key(struct shader_key *key)
+{
+	shader_key_add_value(key, gt.ds.binding_table_address);
+	shader_key_add_value(key, gt.ds.sampler_state_address);
+	shader_key_add_u32(key, gt.ds.compute_w);
+	add_constants_key(key, &gt.ds.curbe, gt.ds.urb_start_grf);
+	shader_key_add_kernel(key, gt.ds.ksp);
+
+	shader_key_add_u32(key, gt.gs.enable);
+	if (!gt.gs.enable)
+		add_vertex_post_processing_key(key);
+}
+
 void
 compile_ds(void)
 {
 	struct kir_program prog;
+	struct shader_key key;
 
 	if (!gt.ds.enable)
 		return;
 
 	ksim_assert(gt.ds.dispatch_mode == DISPATCH_MODE_SIMD8_SINGLE_PATCH);
 
+	shader_key_init(&key, SHADER_DS);
+	add_ds_key(&key);
+	gt.ds.avx_shader = shader_cache_lookup(&key);
+	if (gt.ds.avx_shader)
+		return;
+
 	ksim_trace(TRACE_EU | TRACE_AVX, "jit ds\n");
 
 	kir_program_init(&prog,
@@ -276,7 +315,7 @@ compile_ds(void)
 
 	kir_program_add_insn(&prog, kir_eot);
 
-	gt.ds.avx_shader = kir_program_finish(&prog);
+	gt.ds.avx_shader = shader_cache_add(kir_program_finish(&prog));
 }
 
 void
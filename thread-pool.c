@@ -0,0 +1,157 @@
+/*
+ * Copyright © 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ksim.h"
+
+/* A fixed set of worker threads that all run the same function when
+ * kicked by thread_pool_run(). The thread calling thread_pool_run()
+ * participates as worker 0 and returns once every worker is done, so
+ * from the callers point of view, a run is just a (parallel) function
+ * call. Workers are expected to pull work items from shared state
+ * using atomics. Workers run with the MXCSR of the calling thread, since
+ * the generated code depends on its rounding mode. */
+
+#define MAX_WORKERS 64
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	pthread_t threads[MAX_WORKERS];
+	uint32_t size;
+	uint32_t generation;
+	uint32_t pending;
+	bool running;
+
+	thread_pool_func_t func;
+	void *data;
+	uint32_t csr;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.start_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+worker_main(void *arg)
+{
+	const uint32_t worker = (uintptr_t) arg;
+	uint32_t generation = 0;
+	thread_pool_func_t func;
+	void *data;
+	uint32_t csr;
+
+	pthread_mutex_lock(&pool.mutex);
+	while (true) {
+		while (pool.generation == generation)
+			pthread_cond_wait(&pool.start_cond, &pool.mutex);
+		generation = pool.generation;
+		func = pool.func;
+		data = pool.data;
+		csr = pool.csr;
+		pthread_mutex_unlock(&pool.mutex);
+
+		_mm_setcsr(csr);
+		func(data, worker);
+
+		pthread_mutex_lock(&pool.mutex);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done_cond);
+	}
+
+	return NULL;
+}
+
+static void
+thread_pool_init(void)
+{
+	uint32_t size;
+
+	if (!use_threads) {
+		pool.size = 1;
+		return;
+	}
+
+	if (thread_count > 0)
+		size = thread_count;
+	else
+		size = sysconf(_SC_NPROCESSORS_ONLN);
+	if (size > MAX_WORKERS)
+		size = MAX_WORKERS;
+
+	/* Worker 0 is the thread that calls thread_pool_run(). */
+	pool.size = 1;
+	for (uint32_t i = 1; i < size; i++) {
+		if (pthread_create(&pool.threads[i], NULL,
+				   worker_main, (void *) (uintptr_t) i) != 0) {
+			ksim_warn("failed to create worker thread %d\n", i);
+			break;
+		}
+		pool.size++;
+	}
+
+	trace(TRACE_DEBUG, "thread pool: %d workers\n", pool.size);
+}
+
+uint32_t
+thread_pool_size(void)
+{
+	if (pool.size == 0)
+		thread_pool_init();
+
+	return pool.size;
+}
+
+void
+thread_pool_run(thread_pool_func_t func, void *data)
+{
+	if (thread_pool_size() == 1) {
+		func(data, 0);
+		return;
+	}
+
+	/* No nested runs; workers can't kick the pool. */
+	ksim_assert(!pool.running);
+	pool.running = true;
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.func = func;
+	pool.data = data;
+	pool.csr = _mm_getcsr();
+	pool.pending = pool.size - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start_cond);
+	pthread_mutex_unlock(&pool.mutex);
+
+	func(data, 0);
+
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done_cond, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+
+	pool.running = false;
+}
@@ -24,40 +24,144 @@
 #include "ksim.h"
 #include "kir.h"
 
+static struct reg *
+map_constant_buffer(struct curbe *c, uint32_t b)
+{
+	struct reg *regs;
+	uint64_t base, range;
+
+	if (b == 0 && gt.curbe_dynamic_state_base)
+		base = gt.dynamic_state_base_address;
+	else
+		base = 0;
+
+	regs = map_gtt_offset(c->buffer[b].address + base, &range);
+	ksim_assert(c->buffer[b].length * sizeof(regs[0]) <= range);
+
+	return regs;
+}
+
+static bool
+is_uniform(const struct reg *r)
+{
+	for (uint32_t i = 1; i < 8; i++)
+		if (r->ud[i] != r->ud[0])
+			return false;
+
+	return true;
+}
+
 uint32_t
 emit_load_constants(struct kir_program *prog, struct curbe *c, uint32_t start)
 {
 	uint32_t grf = start;
 	uint32_t bc = 0;
+	struct reg *regs = NULL;
 
 	kir_program_comment(prog, "load constants");
 	for (uint32_t b = 0; b < 4; b++) {
+		if (bake_constants && c->buffer[b].length > 0)
+			regs = map_constant_buffer(c, b);
+
 		for (uint32_t i = 0; i < c->buffer[b].length; i++) {
-			kir_program_load_v8(prog, offsetof(struct thread, constants[bc++]));
-			kir_program_store_v8(prog, offsetof(struct thread, grf[grf++]), prog->dst);
+			/* When we bake the constants, the copy in the
+			 * thread still has the same contents, but we
+			 * tell kir what they are, so that most uses
+			 * become immediates and the stores can be
+			 * eliminated. */
+			if (bake_constants && is_uniform(&regs[i]))
+				kir_program_immd(prog, regs[i].ud[0]);
+			else
+				kir_program_load_v8(prog, offsetof(struct thread, constants[bc]));
+			kir_program_store_v8(prog, offsetof(struct thread, grf[grf]), prog->dst);
+			if (bake_constants)
+				kir_program_set_constant(prog, grf, regs[i].ud);
+			bc++;
+			grf++;
+		}
+	}
+
+	return grf;
+}
+
+/* The constants are already in the GRFs from an earlier
+ * emit_load_constants() and nothing wrote over them since. With baked
+ * constants, tell kir what they hold again after a label made it
+ * forget. Returns the first GRF after the constants. */
+uint32_t
+emit_resident_constants(struct kir_program *prog, struct curbe *c, uint32_t start)
+{
+	uint32_t grf = start;
+	struct reg *regs;
+
+	for (uint32_t b = 0; b < 4; b++) {
+		if (bake_constants && c->buffer[b].length > 0) {
+			regs = map_constant_buffer(c, b);
+			for (uint32_t i = 0; i < c->buffer[b].length; i++)
+				kir_program_set_constant(prog, grf + i, regs[i].ud);
 		}
+		grf += c->buffer[b].length;
 	}
 
 	return grf;
 }
 
+void
+add_constants_key(struct shader_key *key, struct curbe *c, uint32_t start)
+{
+	shader_key_add_value(key, start);
+	for (uint32_t b = 0; b < 4; b++)
+		shader_key_add_value(key, c->buffer[b].length);
+
+	if (!bake_constants)
+		return;
+
+	for (uint32_t b = 0; b < 4; b++) {
+		if (c->buffer[b].length > 0)
+			shader_key_add(key, map_constant_buffer(c, b),
+				       c->buffer[b].length * sizeof(struct reg));
+	}
+}
+
+/* Stages that have baked constants must look up their shader for
+ * every draw, since the constants may have changed without any state
+ * changing. */
+uint32_t
+baked_constants_dirty(void)
+{
+	static const struct {
+		struct curbe *curbe;
+		uint32_t dirty;
+	} stages[] = {
+		{ &gt.vs.curbe, DIRTY_VS },
+		{ &gt.hs.curbe, DIRTY_HS },
+		{ &gt.ds.curbe, DIRTY_DS },
+		{ &gt.gs.curbe, DIRTY_GS },
+		{ &gt.ps.curbe, DIRTY_PS },
+	};
+	uint32_t dirty = 0;
+
+	if (!bake_constants)
+		return 0;
+
+	for (uint32_t i = 0; i < ARRAY_LENGTH(stages); i++) {
+		for (uint32_t b = 0; b < 4; b++)
+			if (stages[i].curbe->buffer[b].length > 0)
+				dirty |= stages[i].dirty;
+	}
+
+	return dirty;
+}
+
 uint32_t
 load_constants(struct thread *t, struct curbe *c)
 {
 	struct reg *regs;
-	uint64_t base, range;
 	uint32_t bc = 0;
 
 	for (uint32_t b = 0; b < 4; b++) {
-		if (b == 0 && gt.curbe_dynamic_state_base)
-			base = gt.dynamic_state_base_address;
-		else
-			base = 0;
-
-		if (c->buffer[b].length > 0) {
-			regs = map_gtt_offset(c->buffer[b].address + base, &range);
-			ksim_assert(c->buffer[b].length * sizeof(regs[0]) <= range);
-		}
+		if (c->buffer[b].length > 0)
+			regs = map_constant_buffer(c, b);
 
 		for (uint32_t i = 0; i < c->buffer[b].length; i++)
 			t->constants[bc++] = regs[i].ireg;
@@ -39,6 +39,7 @@ set_urb_allocation(struct urb *urb, uint32_t address, uint32_t size, uint32_t to
 	urb->total = total;
 
 	urb->free_list = URB_EMPTY;
+	urb->free_count = 0;
 	urb->count = 0;
 }
 
@@ -51,6 +52,7 @@ alloc_urb_entry(struct urb *urb)
 	if (urb->free_list != URB_EMPTY) {
 		f = p = urb->data + urb->free_list;
 		urb->free_list = f->next;
+		urb->free_count--;
 	} else {
 		ksim_assert(urb->count < urb->total);
 		p = urb->data + urb->size * urb->count++;
@@ -72,6 +74,7 @@ free_urb_entry(struct urb* urb, void *entry)
 
 	f->next = urb->free_list;
 	urb->free_list = entry - urb->data;
+	urb->free_count++;
 }
 
 void
@@ -108,26 +111,6 @@ validate_urb_state(void)
 
 }
 
-static void
-emit_sfid_urb_simd8_simple_write(struct kir_program *prog, struct inst *inst)
-{
-	struct inst_send send = unpack_inst_send(inst);
-	uint32_t src = (unpack_inst_2src_src0(inst).num + 1) * 32;
-	uint32_t vue_offset = field(send.function_control, 4, 14);
-	uint32_t dst = prog->urb_offset + vue_offset * 4 * 32;
-
-	/* We should only get here if there's a urb offset set. */
-	ksim_assert(prog->urb_offset != 0);
-
-	kir_program_comment(prog, "urb write: length %d, offset %d",
-			    send.mlen - 1, vue_offset);
-
-	for (uint32_t i = 0; i < send.mlen - 1; i++) {
-		kir_program_load_v8(prog, src + i * 32);
-		kir_program_store_v8(prog, dst + i  * 32, prog->dst);
-	}
-}
-
 enum urb_opcode {
 	URB_WRITE_HWORD = 0,
 	URB_WRITE_OWORD = 1,
@@ -175,32 +158,30 @@ unpack_urb_message_descriptor(uint32_t function_control)
 
 struct sfid_urb_args {
 	uint32_t global_offset;
-	bool per_slot_offset;
-	bool channel_mask;
-	uint32_t src, dst, len, rlen;
+	uint32_t offset;	/* grf of per-slot offsets, 0 if none */
+	uint32_t channel_mask;	/* grf of channel masks, 0 if none */
+	uint32_t channel_bits;
+	uint32_t src, data, dst;
 	uint32_t scope;
 };
 
 static void
 sfid_urb_simd8_read(struct thread *t, struct sfid_urb_args *args)
 {
-	uint32_t grf = args->src;
-	struct reg vue_handles = t->grf[grf++];
+	struct reg vue_handles = t->grf[args->src];
 	struct reg offset, channel_mask;
 
 	offset.ireg = _mm256_set1_epi32(args->global_offset);
-	if (args->per_slot_offset)
-		offset.ireg = _mm256_add_epi32(offset.ireg, t->grf[grf++].ireg);
-
-	uint32_t valid_bits = (1 << args->rlen) - 1;
+	if (args->offset)
+		offset.ireg = _mm256_add_epi32(offset.ireg, t->grf[args->offset].ireg);
 
 	if (args->channel_mask) {
-		channel_mask.ireg = t->grf[grf++].ireg;
+		channel_mask.ireg = t->grf[args->channel_mask].ireg;
 		channel_mask.ireg = _mm256_srli_epi32(channel_mask.ireg, 16);
 		channel_mask.ireg = _mm256_and_si256(channel_mask.ireg,
-						     _mm256_set1_epi32(valid_bits));
+						     _mm256_set1_epi32(args->channel_bits));
 	} else {
-		channel_mask.ireg = _mm256_set1_epi32(valid_bits);
+		channel_mask.ireg = _mm256_set1_epi32(args->channel_bits);
 	}
 
 	struct reg mask;
@@ -220,27 +201,20 @@ sfid_urb_simd8_read(struct thread *t, struct sfid_urb_args *args)
 static void
 sfid_urb_simd8_write(struct thread *t, struct sfid_urb_args *args)
 {
-	uint32_t grf = args->src;
-	struct reg vue_handles = t->grf[grf++];
+	struct reg vue_handles = t->grf[args->src];
 	struct reg offset, channel_mask;
 
-	/* FIXME: For tessellation we often get a constant channel
-	 * mask with just one bit set. We should find a way to emit
-	 * just a single dword store for that. */
-
 	offset.ireg = _mm256_set1_epi32(args->global_offset);
-	if (args->per_slot_offset)
-		offset.ireg = _mm256_add_epi32(offset.ireg, t->grf[grf++].ireg);
+	if (args->offset)
+		offset.ireg = _mm256_add_epi32(offset.ireg, t->grf[args->offset].ireg);
 
 	if (args->channel_mask) {
-		channel_mask.ireg = t->grf[grf++].ireg;
-		uint32_t valid_bits = (1 << (args->src + args->len - grf)) - 1;
+		channel_mask.ireg = t->grf[args->channel_mask].ireg;
 		channel_mask.ireg = _mm256_srli_epi32(channel_mask.ireg, 16);
 		channel_mask.ireg = _mm256_and_si256(channel_mask.ireg,
-						     _mm256_set1_epi32(valid_bits));
+						     _mm256_set1_epi32(args->channel_bits));
 	} else {
-		uint32_t valid_bits = (1 << (args->src + args->len - grf)) - 1;
-		channel_mask.ireg = _mm256_set1_epi32(valid_bits);
+		channel_mask.ireg = _mm256_set1_epi32(args->channel_bits);
 	}
 
 	struct reg mask;
@@ -252,29 +226,86 @@ sfid_urb_simd8_write(struct thread *t, struct sfid_urb_args *args)
 			offset.ud[c] * 16;
 		uint32_t i;
 		for_each_bit(i, channel_mask.ud[c])
-			vue[i] = t->grf[grf + i].ud[c];
+			vue[i] = t->grf[args->data + i].ud[c];
 	}
 }
 
-static struct sfid_urb_args *
-create_urb_args(struct kir_program *prog, struct inst *inst)
+static void
+emit_sfid_urb_simd8_simple_write(struct kir_program *prog,
+				 struct sfid_urb_args *args)
+{
+	uint32_t dst = prog->urb_offset + args->global_offset * 4 * 32;
+	uint32_t i;
+
+	/* We should only get here if there's a urb offset set. */
+	ksim_assert(prog->urb_offset != 0);
+
+	kir_program_comment(prog, "urb write: channels 0x%x, offset %d",
+			    args->channel_bits, args->global_offset);
+
+	/* A constant channel mask with just one bit set, as we often
+	 * get for tessellation, becomes a single store. */
+	for_each_bit(i, args->channel_bits) {
+		kir_program_load_v8(prog, (args->data + i) * 32);
+		kir_program_store_v8(prog, dst + i * 32, prog->dst);
+	}
+}
+
+static void
+init_urb_args(struct kir_program *prog, struct inst *inst,
+	      struct sfid_urb_args *args)
 {
 	struct inst_send send = unpack_inst_send(inst);
 	struct urb_message_descriptor md =
 		unpack_urb_message_descriptor(send.function_control);
-	struct sfid_urb_args *args;
+	uint32_t grf, value;
 
-	args = get_const_data(sizeof *args, 8);
-	args->per_slot_offset = md.per_slot_offset;
-	args->channel_mask = md.channel_mask;
 	args->global_offset = md.global_offset;
 	args->src = unpack_inst_2src_src0(inst).num;
 	args->dst = unpack_inst_2src_dst(inst).num;
-	args->len = send.mlen;
-	args->rlen = send.rlen;
 	args->scope = prog->scope;
 
-	return args;
+	/* Per-slot offsets and channel masks are usually set up with
+	 * a mov from an immediate, in which case we fold them into
+	 * the descriptor here. */
+	grf = args->src + 1;
+	args->offset = 0;
+	if (md.per_slot_offset) {
+		if (kir_program_get_constant(prog, grf, &value))
+			args->global_offset += value;
+		else
+			args->offset = grf;
+		grf++;
+	}
+
+	args->channel_mask = 0;
+	if (md.channel_mask)
+		grf++;
+	args->data = grf;
+
+	if (send.rlen > 0)
+		args->channel_bits = (1 << send.rlen) - 1;
+	else
+		args->channel_bits = (1 << (args->src + send.mlen - args->data)) - 1;
+
+	if (md.channel_mask) {
+		if (kir_program_get_constant(prog, grf - 1, &value))
+			args->channel_bits &= value >> 16;
+		else
+			args->channel_mask = grf - 1;
+	}
+}
+
+/* The send helpers get their arguments from the shader constants. */
+static struct sfid_urb_args *
+create_urb_args(const struct sfid_urb_args *args)
+{
+	struct sfid_urb_args *copy;
+
+	copy = get_const_data(sizeof *copy, 8);
+	*copy = *args;
+
+	return copy;
 }
 
 void
@@ -283,7 +314,7 @@ builder_emit_sfid_urb(struct kir_program *prog, struct inst *inst)
 	struct inst_send send = unpack_inst_send(inst);
 	struct urb_message_descriptor md =
 		unpack_urb_message_descriptor(send.function_control);
-	struct sfid_urb_args *args;
+	struct sfid_urb_args args;
 
 	ksim_assert(send.header_present);
 
@@ -299,17 +330,20 @@ builder_emit_sfid_urb(struct kir_program *prog, struct inst *inst)
 		return;
 
 	case URB_SIMD8_READ:
-		args = create_urb_args(prog, inst);
-		kir_program_const_send(prog, inst, sfid_urb_simd8_read, args);
+		init_urb_args(prog, inst, &args);
+		kir_program_const_send(prog, inst, sfid_urb_simd8_read,
+				       create_urb_args(&args));
 		return;
 
 	case URB_SIMD8_WRITE:
 		ksim_assert(send.rlen == 0);
-		if (!md.per_slot_offset && !md.channel_mask && prog->urb_offset > 0) {
-			emit_sfid_urb_simd8_simple_write(prog, inst);
+		init_urb_args(prog, inst, &args);
+		if (args.offset == 0 && args.channel_mask == 0 &&
+		    prog->urb_offset > 0) {
+			emit_sfid_urb_simd8_simple_write(prog, &args);
 		} else {
-			args = create_urb_args(prog, inst);
-			kir_program_send(prog, inst, sfid_urb_simd8_write, args);
+			kir_program_send(prog, inst, sfid_urb_simd8_write,
+					 create_urb_args(&args));
 		}
 		break;
 	default:
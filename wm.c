@@ -70,6 +70,20 @@ struct ps_thread {
 	struct reg attribute_deltas[64];
 
 	uint32_t invocation_count;
+
+	/* Tile loop state for gt.ps.avx_tile_shader. The edge
+	 * functions and the group index live here between groups,
+	 * since no kir register is live across the loop labels. */
+	struct reg w2, w0, w1;
+	struct reg w2_step, w0_step, w1_step;
+	struct reg w2_row_step, w0_row_step, w1_row_step;
+	struct reg group;
+	struct reg invocations;
+	struct reg depth_offset;
+	uint32_t tile_xy;
+	uint32_t tile_depth_offset;
+	int32_t rect_c;
+	int32_t rectlist;
 };
 
 static void
@@ -100,8 +114,11 @@ emit_barycentric_conversion(struct kir_program *prog)
 	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].w2_pc), w2);
 }
 
+/* In the tile shader, the depth test branches to next instead of
+ * returning when all pixels fail, and the depth address comes from
+ * the group position instead of ps_thread.depth. */
 static void
-emit_depth_test(struct kir_program *prog)
+emit_depth_test(struct kir_program *prog, struct kir_insn *next)
 {
 	struct kir_reg base, depth;
 
@@ -128,7 +145,12 @@ emit_depth_test(struct kir_program *prog)
 		return;
 
 	kir_program_comment(prog, "load depth");
-	base = kir_program_set_load_base_indirect(prog, offsetof(struct ps_thread, depth));
+	if (next) {
+		kir_program_load_v8(prog, offsetof(struct ps_thread, depth_offset));
+		base = kir_program_set_load_base_imm_offset(prog, gt.depth.address, prog->dst);
+	} else {
+		base = kir_program_set_load_base_indirect(prog, offsetof(struct ps_thread, depth));
+	}
 	switch (gt.depth.format) {
 	case D32_FLOAT:
 		depth = kir_program_load(prog, base, 0);
@@ -207,7 +229,9 @@ emit_depth_test(struct kir_program *prog)
 
 	}
 
-	if (gt.depth.test_enable) {
+	if (gt.depth.test_enable && next) {
+		kir_program_branch(prog, mask, 0xff, true, next);
+	} else if (gt.depth.test_enable) {
 		struct kir_insn *insn = kir_program_add_insn(prog, kir_eot_if_dead);
 		insn->eot.src = mask;
 	}
@@ -217,7 +241,6 @@ static void
 dispatch_ps(struct ps_thread *t)
 {
 	struct dispatch *d = &t->queue[0];
-	int count = t->queue_length;
 	/* Not sure what we should make this. */
 	struct reg *grf = &t->t.grf[0];
 
@@ -245,11 +268,9 @@ dispatch_ps(struct ps_thread *t)
 
 	t->invocation_count++;
 
-	if (count == 1 && gt.ps.enable_simd8) {
-		gt.ps.avx_shader_simd8(&t->t);
-	} else if (gt.ps.enable_simd16) {
+	/* SIMD8 dispatch runs the tile shader instead. */
+	if (gt.ps.enable_simd16)
 		gt.ps.avx_shader_simd16(&t->t);
-	}
 }
 
 const int tile_width = 128 / 4;
@@ -379,7 +400,7 @@ fill_dispatch(struct ps_thread *pt,
 	}
 
 	pt->queue_length++;
-	if (gt.ps.enable_simd8 || pt->queue_length == 2) {
+	if (pt->queue_length == 2) {
 		dispatch_ps(pt);
 		pt->queue_length = 0;
 	}
@@ -416,7 +437,7 @@ init_ps_thread(struct ps_thread *pt, struct ps_primitive *p)
 			/* R0.5: fftid, scratch offset */
 			gt.ps.scratch_pointer | fftid,
 			/* R0.6: thread id */
-			gt.ps.tid++ & 0xffffff,
+			__atomic_fetch_add(&gt.ps.tid, 1, __ATOMIC_RELAXED) & 0xffffff,
 			/* R0.7: Reserved */
 			0,
 		}
@@ -427,12 +448,54 @@ static void
 finish_ps_thread(struct ps_thread *pt)
 {
 	if (pt->queue_length > 0) {
-		ksim_assert(pt->queue_length == 1 && !gt.ps.enable_simd8);
+		ksim_assert(pt->queue_length == 1);
 		pt->t.mask[0].q[1] = _mm256_set1_epi32(0);
 		dispatch_ps(pt);
 	}
 	if (gt.ps.statistics)
-		gt.ps_invocation_count += pt->invocation_count;
+		__atomic_add_fetch(&gt.ps_invocation_count,
+				   pt->invocation_count, __ATOMIC_RELAXED);
+}
+
+/* Run the whole tile through the tile shader, which steps the edge
+ * functions, computes coverage and sets up the payload for each 4x2
+ * group itself and runs the SIMD8 shader inline. */
+static void
+rasterize_tile_jit(struct ps_primitive *p, const struct bbox_iter *bbox_iter,
+		   bool rectlist)
+{
+	struct tile_iterator iter;
+	struct ps_thread pt;
+
+	init_ps_thread(&pt, p);
+	tile_iterator_init(&iter, p, bbox_iter);
+
+	pt.w2.ireg = iter.w2;
+	pt.w0.ireg = iter.w0;
+	pt.w1.ireg = iter.w1;
+	pt.w2_step.ireg = p->w2_step;
+	pt.w0_step.ireg = p->w0_step;
+	pt.w1_step.ireg = p->w1_step;
+	pt.w2_row_step.ireg = p->w2_row_step;
+	pt.w0_row_step.ireg = p->w0_row_step;
+	pt.w1_row_step.ireg = p->w1_row_step;
+	pt.group.ireg = _mm256_setzero_si256();
+	pt.invocations.ireg = _mm256_setzero_si256();
+	pt.tile_xy = (iter.y0 << 16) | iter.x0;
+	pt.rect_c = p->area - 1;
+	pt.rectlist = rectlist ? -1 : 0;
+
+	if (gt.depth.write_enable || gt.depth.test_enable) {
+		uint32_t cpp = depth_format_size(gt.depth.format);
+		void *depth = ymajor_offset(gt.depth.buffer, iter.x0, iter.y0,
+					    gt.depth.stride, cpp);
+		pt.tile_depth_offset = depth - gt.depth.buffer;
+	}
+
+	gt.ps.avx_tile_shader(&pt.t);
+
+	pt.invocation_count = pt.invocations.ud[0];
+	finish_ps_thread(&pt);
 }
 
 static void
@@ -441,6 +504,11 @@ rasterize_rectlist_tile(struct ps_primitive *p, struct bbox_iter *bbox_iter)
 	struct tile_iterator iter;
 	struct ps_thread pt;
 
+	if (gt.ps.avx_tile_shader) {
+		rasterize_tile_jit(p, bbox_iter, true);
+		return;
+	}
+
 	init_ps_thread(&pt, p);
 
 	/* To determine coverage, we compute the edge function for all
@@ -475,6 +543,11 @@ rasterize_triangle_tile(struct ps_primitive *p, const struct bbox_iter *bbox_ite
 	struct tile_iterator iter;
 	struct ps_thread pt;
 
+	if (gt.ps.avx_tile_shader) {
+		rasterize_tile_jit(p, bbox_iter, false);
+		return;
+	}
+
 	init_ps_thread(&pt, p);
 
 	for (tile_iterator_init(&iter, p, bbox_iter);
@@ -491,6 +564,151 @@ rasterize_triangle_tile(struct ps_primitive *p, const struct bbox_iter *bbox_ite
 	finish_ps_thread(&pt);
 }
 
+/* Triangle setup doesn't run the PS directly, it bins the primitive
+ * into per-tile queues. When the bins are flushed, the workers in the
+ * thread pool each grab whole tiles and run all primitives binned to
+ * that tile in submission order. Since only one worker ever touches a
+ * tile, the RT, depth and hiz accesses for the tile don't race and the
+ * tile stays in that cores cache. */
+
+struct tile_job {
+	struct ps_primitive *p;
+	struct bbox_iter iter;
+	bool rectlist;
+};
+
+struct tile_bin {
+	struct tile_job *jobs;
+	uint32_t length;
+	uint32_t size;
+};
+
+#define MAX_BINNED_PRIMITIVES 1024
+
+static struct {
+	struct tile_bin *bins;
+	uint32_t width, height;
+
+	/* Indices of the non-empty bins, in the order they were first
+	 * used, and the next one for a worker to pick up. */
+	uint32_t *active;
+	uint32_t active_count;
+	uint32_t next;
+
+	/* Storage for binned primitives, allocated on demand and
+	 * reused after each flush. */
+	struct ps_primitive *primitives[MAX_BINNED_PRIMITIVES];
+	uint32_t primitive_count;
+} binner;
+
+static void
+binner_reserve(const struct rectangle *rect)
+{
+	uint32_t width = rect->x1 / tile_width;
+	uint32_t height = rect->y1 / tile_height;
+
+	if (width <= binner.width && height <= binner.height)
+		return;
+
+	/* Grid changes need empty bins. */
+	wm_stall();
+
+	if (width < binner.width)
+		width = binner.width;
+	if (height < binner.height)
+		height = binner.height;
+
+	for (uint32_t i = 0; i < binner.width * binner.height; i++)
+		free(binner.bins[i].jobs);
+	free(binner.bins);
+	free(binner.active);
+
+	binner.width = width;
+	binner.height = height;
+	binner.bins = calloc(width * height, sizeof(binner.bins[0]));
+	binner.active = malloc(width * height * sizeof(binner.active[0]));
+	ksim_assert(binner.bins != NULL && binner.active != NULL);
+}
+
+static struct ps_primitive *
+binner_add_primitive(const struct ps_primitive *p)
+{
+	struct ps_primitive **slot;
+
+	if (binner.primitive_count == MAX_BINNED_PRIMITIVES)
+		wm_stall();
+
+	slot = &binner.primitives[binner.primitive_count++];
+	if (*slot == NULL) {
+		*slot = aligned_alloc(32, sizeof(**slot));
+		ksim_assert(*slot != NULL);
+	}
+
+	**slot = *p;
+
+	return *slot;
+}
+
+static void
+binner_add_tile(struct ps_primitive *p,
+		const struct bbox_iter *iter, bool rectlist)
+{
+	const uint32_t index =
+		iter->y / tile_height * binner.width + iter->x / tile_width;
+	struct tile_bin *bin = &binner.bins[index];
+
+	ksim_assert(index < binner.width * binner.height);
+
+	if (bin->length == 0)
+		binner.active[binner.active_count++] = index;
+
+	if (bin->length == bin->size) {
+		bin->size = bin->size ? bin->size * 2 : 16;
+		bin->jobs = realloc(bin->jobs, bin->size * sizeof(bin->jobs[0]));
+		ksim_assert(bin->jobs != NULL);
+	}
+
+	bin->jobs[bin->length++] = (struct tile_job) {
+		.p = p,
+		.iter = *iter,
+		.rectlist = rectlist
+	};
+}
+
+static void
+rasterize_bins(void *data, uint32_t worker)
+{
+	uint32_t i;
+
+	while (i = __atomic_fetch_add(&binner.next, 1, __ATOMIC_RELAXED),
+	       i < binner.active_count) {
+		struct tile_bin *bin = &binner.bins[binner.active[i]];
+
+		for (uint32_t j = 0; j < bin->length; j++) {
+			struct tile_job *job = &bin->jobs[j];
+
+			if (job->rectlist)
+				rasterize_rectlist_tile(job->p, &job->iter);
+			else
+				rasterize_triangle_tile(job->p, &job->iter);
+		}
+
+		bin->length = 0;
+	}
+}
+
+void
+wm_stall(void)
+{
+	if (binner.active_count > 0) {
+		binner.next = 0;
+		thread_pool_run(rasterize_bins, NULL);
+		binner.active_count = 0;
+	}
+
+	binner.primitive_count = 0;
+}
+
 struct point {
 	int32_t x, y;
 };
@@ -578,11 +796,12 @@ bbox_iter_next(struct bbox_iter *iter)
 void
 rasterize_rectlist(struct ps_primitive *p, struct rectangle *rect)
 {
+	struct ps_primitive *binned = binner_add_primitive(p);
 	struct bbox_iter iter;
 
 	for (bbox_iter_init(&iter, p, rect);
 	     !bbox_iter_done(&iter); bbox_iter_next(&iter))
-		rasterize_rectlist_tile(p, &iter);
+		binner_add_tile(binned, &iter, true);
 }
 
 static int32_t
@@ -606,6 +825,7 @@ rasterize_triangle(struct ps_primitive *p, struct rectangle *rect)
 	int32_t min_w0_delta = edge_delta_to_tile_min(&p->e12);
 	int32_t min_w1_delta = edge_delta_to_tile_min(&p->e20);
 
+	struct ps_primitive *binned = NULL;
 	struct bbox_iter iter;
 	for (bbox_iter_init(&iter, p, rect);
 	     !bbox_iter_done(&iter); bbox_iter_next(&iter)) {
@@ -613,8 +833,11 @@ rasterize_triangle(struct ps_primitive *p, struct rectangle *rect)
 		int32_t min_w0 = iter.w0 + min_w0_delta;
 		int32_t min_w1 = iter.w1 + min_w1_delta;
 
-		if ((min_w2 & min_w0 & min_w1) < 0)
-			rasterize_triangle_tile(p, &iter);
+		if ((min_w2 & min_w0 & min_w1) < 0) {
+			if (binned == NULL)
+				binned = binner_add_primitive(p);
+			binner_add_tile(binned, &iter, false);
+		}
 	}
 }
 
@@ -813,6 +1036,8 @@ rasterize_primitive(struct value **vue, enum GEN9_3D_Prim_Topo_Type topology)
 	if (rect.x1 <= rect.x0 || rect.y1 < rect.y0)
 		return;
 
+	binner_reserve(&rect);
+
 	const uint32_t dx = 4;
 	const uint32_t dy = 2;
 	static const struct reg sx = { .d = {  0, 1, 0, 1, 2, 3, 2, 3 } };
@@ -851,6 +1076,8 @@ rasterize_primitive(struct value **vue, enum GEN9_3D_Prim_Topo_Type topology)
 void
 wm_flush(void)
 {
+	wm_stall();
+
 	if (framebuffer_filename) {
 		struct surface s;
 		get_surface(gt.ps.binding_table_address, 0, &s);
@@ -961,37 +1188,291 @@ emit_load_payload(struct kir_program *prog, int width)
 	}
 }
 
+static void
+add_ps_key(struct shader_key *key, uint64_t kernel_offset, int width)
+{
+	shader_key_add_value(key, width);
+	shader_key_add_value(key, gt.ps.binding_table_address);
+	shader_key_add_value(key, gt.ps.sampler_state_address);
+
+	shader_key_add_u32(key, gt.depth.test_enable);
+	shader_key_add_u32(key, gt.depth.write_enable);
+	if (gt.depth.test_enable || gt.depth.write_enable) {
+		shader_key_add_value(key, gt.depth.format);
+		shader_key_add_value(key, gt.depth.test_function);
+	}
+
+	shader_key_add_u32(key, gt.ps.enable);
+	if (gt.ps.enable) {
+		shader_key_add_value(key, gt.wm.barycentric_mode);
+		shader_key_add_u32(key, gt.ps.uses_source_depth);
+		shader_key_add_u32(key, gt.ps.uses_source_w);
+		shader_key_add_value(key, gt.ps.position_offset_xy);
+		shader_key_add_value(key, gt.ps.input_coverage_mask_state);
+		shader_key_add_u32(key, gt.ps.push_constant_enable);
+		add_constants_key(key, &gt.ps.curbe, gt.ps.grf_start0);
+		shader_key_add_u32(key, gt.ps.attribute_enable);
+		shader_key_add_value(key, gt.sbe.num_attributes);
+		shader_key_add_kernel(key, kernel_offset);
+	}
+}
+
+static void
+emit_ps(struct kir_program *prog, uint64_t kernel_offset, int width,
+	struct kir_insn *next, bool resident_constants)
+{
+	emit_barycentric_conversion(prog);
+
+	emit_depth_test(prog, next);
+
+	if (gt.ps.enable) {
+		emit_load_payload(prog, width);
+
+		int g;
+		if (!gt.ps.push_constant_enable)
+			g = gt.ps.grf_start0;
+		else if (resident_constants)
+			g = emit_resident_constants(prog, &gt.ps.curbe, gt.ps.grf_start0);
+		else
+			g = emit_load_constants(prog, &gt.ps.curbe, gt.ps.grf_start0);
+
+		if (gt.ps.attribute_enable)
+			emit_load_attributes_deltas(prog, g);
+
+		kir_program_comment(prog, "eu ps");
+		kir_program_emit_shader(prog, kernel_offset);
+	}
+}
+
 static shader_t
 compile_ps_for_width(uint64_t kernel_offset, int width)
 {
 	struct kir_program prog;
+	struct shader_key key;
+	shader_t shader;
+
+	shader_key_init(&key, SHADER_PS);
+	add_ps_key(&key, kernel_offset, width);
+	shader = shader_cache_lookup(&key);
+	if (shader)
+		return shader;
+
+	ksim_trace(TRACE_EU | TRACE_AVX, "jit simd%d ps\n", width);
 
 	kir_program_init(&prog, gt.ps.binding_table_address,
 			 gt.ps.sampler_state_address);
 
-	emit_barycentric_conversion(&prog);
+	emit_ps(&prog, kernel_offset, width, NULL, false);
 
-	emit_depth_test(&prog);
+	kir_program_add_insn(&prog, kir_eot);
 
-	if (gt.ps.enable) {
-		emit_load_payload(&prog, width);
+	return shader_cache_add(kir_program_finish(&prog));
+}
 
-		int g;
-		if (gt.ps.push_constant_enable)
-			g = emit_load_constants(&prog, &gt.ps.curbe, gt.ps.grf_start0);
-		else
-			g = gt.ps.grf_start0;
+/* Set up the thread for the next 4x2 group of the tile, the way
+ * fill_dispatch() and dispatch_ps() do in C. Branches to next if
+ * the group isn't covered. */
+static void
+emit_tile_dispatch(struct kir_program *prog, struct kir_insn *next)
+{
+	struct kir_reg w2, w0, w1, c, rect, mask, g, x, y, xy, v, bits, weights;
+	union kir_imm imm;
+
+	kir_program_comment(prog, "tile: coverage");
+	w2 = kir_program_load_v8(prog, offsetof(struct ps_thread, w2));
+	w0 = kir_program_load_v8(prog, offsetof(struct ps_thread, w0));
+	w1 = kir_program_load_v8(prog, offsetof(struct ps_thread, w1));
+
+	/* For rectlists, we only have two edges and compute the
+	 * opposite ones by subtracting from the area, see
+	 * rasterize_rectlist_tile(). Pick that or w1 at run time so
+	 * that one shader handles both. */
+	c = kir_program_load_uniform(prog, offsetof(struct ps_thread, rect_c));
+	rect = kir_program_alu(prog, kir_and,
+			       kir_program_alu(prog, kir_subd, c, w2),
+			       kir_program_alu(prog, kir_subd, c, w0));
+	kir_program_load_uniform(prog, offsetof(struct ps_thread, rectlist));
+	rect = kir_program_alu(prog, kir_blend, rect, w1, prog->dst);
+	mask = kir_program_alu(prog, kir_and, w2, w0);
+	mask = kir_program_alu(prog, kir_and, mask, rect);
+	kir_program_store_v8(prog, offsetof(struct thread, mask[0].q[0]), mask);
+	kir_program_branch(prog, mask, 0xff, true, next);
+
+	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].int_w2), w2);
+	kir_program_store_v8(prog, offsetof(struct ps_thread, queue[0].int_w1), w1);
+
+	v = kir_program_load_v8(prog, offsetof(struct ps_thread, invocations));
+	kir_program_immd(prog, 1);
+	v = kir_program_alu(prog, kir_addd, v, prog->dst);
+	kir_program_store_v8(prog, offsetof(struct ps_thread, invocations), v);
+
+	kir_program_comment(prog, "tile: dispatch header");
+	/* Group g of the tile is at x = (g & 7) * 4, y = (g >> 3) * 2. */
+	g = kir_program_load_v8(prog, offsetof(struct ps_thread, group));
+	kir_program_immd(prog, 7);
+	x = kir_program_alu(prog, kir_and, g, prog->dst);
+	x = kir_program_alu(prog, kir_shli, x, 2);
+	y = kir_program_alu(prog, kir_shri, g, 3);
+	y = kir_program_alu(prog, kir_shli, y, 1);
+
+	xy = kir_program_alu(prog, kir_shli, y, 16);
+	xy = kir_program_alu(prog, kir_or, xy, x);
+	kir_program_load_uniform(prog, offsetof(struct ps_thread, tile_xy));
+	xy = kir_program_alu(prog, kir_addd, xy, prog->dst);
+
+	/* R1.2 and R1.3: x, y for subspan 0 and 1. */
+	imm = (union kir_imm) { .v = { 0, 0, 0, 2, 0, 0, 0, 0 } };
+	kir_program_imm(prog, kir_immv, imm);
+	kir_program_alu(prog, kir_sxwd, prog->dst);
+	v = kir_program_alu(prog, kir_addd, xy, prog->dst);
+	imm = (union kir_imm) { .v = { 0, 0, -1, -1, 0, 0, 0, 0 } };
+	kir_program_imm(prog, kir_immv, imm);
+	kir_program_alu(prog, kir_sxwd, prog->dst);
+	v = kir_program_alu(prog, kir_and, v, prog->dst);
+
+	/* R1.7: pixel sample mask and copy. We don't have a movmsk,
+	 * so put one bit per channel in R1 and or together
+	 * broadcasts of each channel. Only the sign bit of the
+	 * coverage mask is significant. */
+	imm = (union kir_imm) { .v = { 1, 2, 4, 8, 16, 32, 64, 128 } };
+	kir_program_imm(prog, kir_immv, imm);
+	weights = kir_program_alu(prog, kir_sxwd, prog->dst);
+	bits = kir_program_alu(prog, kir_asri, mask, 31);
+	bits = kir_program_alu(prog, kir_and, bits, weights);
+	kir_program_store_v8(prog, offsetof(struct thread, grf[1]), bits);
+	bits = kir_program_load_uniform(prog, offsetof(struct thread, grf[1].ud[0]));
+	for (uint32_t i = 1; i < 8; i++) {
+		kir_program_load_uniform(prog, offsetof(struct thread, grf[1].ud[i]));
+		bits = kir_program_alu(prog, kir_or, bits, prog->dst);
+	}
+	kir_program_alu(prog, kir_shli, bits, 16);
+	bits = kir_program_alu(prog, kir_or, bits, prog->dst);
+	imm = (union kir_imm) { .v = { 0, 0, 0, 0, 0, 0, 0, -1 } };
+	kir_program_imm(prog, kir_immv, imm);
+	kir_program_alu(prog, kir_sxwd, prog->dst);
+	v = kir_program_alu(prog, kir_blend, bits, v, prog->dst);
+	kir_program_store_v8(prog, offsetof(struct thread, grf[1]), v);
 
-		if (gt.ps.attribute_enable)
-			emit_load_attributes_deltas(&prog, g);
+	if (gt.depth.write_enable || gt.depth.test_enable) {
+		/* The tile is aligned to a ymajor tile, so the depth
+		 * offset inside it is just the ymajor swizzle of the
+		 * group position. */
+		kir_program_immd(prog, depth_format_size(gt.depth.format));
+		x = kir_program_alu(prog, kir_muld, x, prog->dst);
+		kir_program_immd(prog, 15);
+		v = kir_program_alu(prog, kir_and, x, prog->dst);
+		kir_program_alu(prog, kir_shri, x, 4);
+		kir_program_alu(prog, kir_shli, prog->dst, 9);
+		v = kir_program_alu(prog, kir_addd, v, prog->dst);
+		kir_program_alu(prog, kir_shli, y, 4);
+		v = kir_program_alu(prog, kir_addd, v, prog->dst);
+		kir_program_load_uniform(prog, offsetof(struct ps_thread, tile_depth_offset));
+		v = kir_program_alu(prog, kir_addd, v, prog->dst);
+		kir_program_store_v8(prog, offsetof(struct ps_thread, depth_offset), v);
+	}
+}
+
+/* Step the edge functions to the next group and loop back to top
+ * until we've done all tile_width / 4 * tile_height / 2 groups. */
+static void
+emit_tile_step(struct kir_program *prog, struct kir_insn *top)
+{
+	struct kir_reg g, row, w, seven;
+
+	static const struct {
+		uint32_t w, step, row_step;
+	} edges[] = {
+		{
+			offsetof(struct ps_thread, w2),
+			offsetof(struct ps_thread, w2_step),
+			offsetof(struct ps_thread, w2_row_step)
+		},
+		{
+			offsetof(struct ps_thread, w0),
+			offsetof(struct ps_thread, w0_step),
+			offsetof(struct ps_thread, w0_row_step)
+		},
+		{
+			offsetof(struct ps_thread, w1),
+			offsetof(struct ps_thread, w1_step),
+			offsetof(struct ps_thread, w1_row_step)
+		},
+	};
 
-		kir_program_comment(&prog, "eu ps");
-		kir_program_emit_shader(&prog, kernel_offset);
+	kir_program_comment(prog, "tile: step");
+	g = kir_program_load_v8(prog, offsetof(struct ps_thread, group));
+	seven = kir_program_immd(prog, 7);
+	kir_program_alu(prog, kir_and, g, seven);
+	row = kir_program_alu(prog, kir_cmpeqd, prog->dst, seven);
+
+	for (uint32_t i = 0; i < ARRAY_LENGTH(edges); i++) {
+		struct kir_reg step, row_step;
+
+		w = kir_program_load_v8(prog, edges[i].w);
+		step = kir_program_load_v8(prog, edges[i].step);
+		row_step = kir_program_load_v8(prog, edges[i].row_step);
+		kir_program_alu(prog, kir_blend, row_step, step, row);
+		w = kir_program_alu(prog, kir_addd, w, prog->dst);
+		kir_program_store_v8(prog, edges[i].w, w);
 	}
 
+	kir_program_immd(prog, 1);
+	g = kir_program_alu(prog, kir_addd, g, prog->dst);
+	kir_program_store_v8(prog, offsetof(struct ps_thread, group), g);
+	kir_program_immd(prog, tile_width / 4 * tile_height / 2);
+	kir_program_alu(prog, kir_cmpgtd, g, prog->dst);
+	kir_program_branch(prog, prog->dst, 0xff, false, top);
+}
+
+static shader_t
+compile_ps_tile(uint64_t kernel_offset)
+{
+	struct kir_program prog;
+	struct shader_key key;
+	struct kir_insn *top, *next;
+	bool resident_constants = false;
+	uint32_t end;
+	shader_t shader;
+
+	shader_key_init(&key, SHADER_PS);
+	add_ps_key(&key, kernel_offset, 8);
+	shader_key_add_u32(&key, true);
+	if (gt.depth.test_enable || gt.depth.write_enable)
+		shader_key_add_value(&key, gt.depth.address);
+	shader = shader_cache_lookup(&key);
+	if (shader)
+		return shader;
+
+	ksim_trace(TRACE_EU | TRACE_AVX, "jit simd8 ps tile\n");
+
+	kir_program_init(&prog, gt.ps.binding_table_address,
+			 gt.ps.sampler_state_address);
+
+	/* Push constants are the same for every group in the tile,
+	 * so unless the kernel writes over them, load them once
+	 * before the loop. */
+	if (gt.ps.enable && gt.ps.push_constant_enable) {
+		end = gt.ps.grf_start0;
+		for (uint32_t b = 0; b < 4; b++)
+			end += gt.ps.curbe.buffer[b].length;
+		if (!kernel_writes_grfs(kernel_offset, gt.ps.grf_start0, end)) {
+			emit_load_constants(&prog, &gt.ps.curbe, gt.ps.grf_start0);
+			resident_constants = true;
+		}
+	}
+
+	top = kir_program_create_label(&prog);
+	next = kir_program_create_label(&prog);
+
+	kir_program_place_label(&prog, top);
+	emit_tile_dispatch(&prog, next);
+	emit_ps(&prog, kernel_offset, 8, next, resident_constants);
+	kir_program_place_label(&prog, next);
+	emit_tile_step(&prog, top);
+
 	kir_program_add_insn(&prog, kir_eot);
 
-	return kir_program_finish(&prog);
+	return shader_cache_add(kir_program_finish(&prog));
 }
 
 void
@@ -1024,18 +1505,18 @@ compile_ps(void)
 		}
 	}
 
+	/* With SIMD8 dispatch, we run each group as it's rasterized,
+	 * so the whole tile loop goes into one shader. */
+	gt.ps.avx_tile_shader = NULL;
 	if (ksp_simd8 != NO_KERNEL) {
-		ksim_trace(TRACE_EU | TRACE_AVX, "jit simd8 ps\n");
-		gt.ps.avx_shader_simd8 =
-			compile_ps_for_width(ksp_simd8, 8);
+		gt.ps.avx_tile_shader =
+			compile_ps_tile(ksp_simd8);
 	}
 	if (ksp_simd16 != NO_KERNEL) {
-		ksim_trace(TRACE_EU | TRACE_AVX, "jit simd16 ps\n");
 		gt.ps.avx_shader_simd16 =
 			compile_ps_for_width(ksp_simd16, 16);
 	}
 	if (ksp_simd32 != NO_KERNEL) {
-		ksim_trace(TRACE_EU | TRACE_AVX, "jit simd32 ps\n");
 		gt.ps.avx_shader_simd32 =
 			compile_ps_for_width(ksp_simd32, 32);
 	}